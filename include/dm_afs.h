@@ -2,19 +2,29 @@
  * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
  * Copyright: UC Santa Cruz, SSRC
  */
+#include <dm_afs_cache.h>
 #include <dm_afs_config.h>
 #include <dm_afs_crypto.h>
 #include <dm_afs_engine.h>
 #include <dm_afs_format.h>
+#include <dm_afs_lock.h>
+#include <dm_afs_log.h>
+#include <dm_afs_map.h>
 #include <dm_afs_modules.h>
+#include <dm_afs_prefetch.h>
+#include <dm_afs_repair.h>
+#include <dm_afs_scrub.h>
+#include <dm_afs_submit.h>
 #include "lib/cauchy_rs.h"
 #include <lib/bit_vector.h>
 #include <linux/bio.h>
 #include <linux/completion.h>
 #include <linux/device-mapper.h>
 #include <linux/kernel.h>
+#include <linux/mempool.h>
 #include <linux/mm_types.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/spinlock_types.h>
 #include <linux/stddef.h>
 #include <linux/types.h>
@@ -35,6 +45,13 @@ struct afs_args {
     char passive_dev[PASSIVE_DEV_SZ];      // Name of passive device.
     char entropy_dir[ENTROPY_DIR_SZ];      // Name of the entropy directory.
     uint8_t instance_type;                 // Type of instance.
+    uint8_t read_mode;                     // How carrier blocks are read.
+    uint8_t hedge_width;                   // Carriers issued by a hedged read.
+    uint32_t cache_blocks;                 // Capacity of the decoded block cache.
+    uint8_t write_mode;                    // When writes are encoded.
+    uint32_t prefetch_blocks;              // Largest read-ahead window of a stream.
+    uint32_t scrub_rate;                   // Blocks scrubbed per second.
+    uint32_t map_cache_blocks;             // Map blocks kept in memory.
 };
 
 // Private data per instance.
@@ -43,44 +60,94 @@ struct afs_private {
     struct block_device *bdev;
     struct afs_config config;
     struct afs_super_block __attribute__((aligned(4096))) super_block;
+    struct afs_aux_block __attribute__((aligned(4096))) aux_block;
+    struct mutex aux_lock;
     struct afs_passive_fs passive_fs;
     struct afs_args args;
     struct afs_allocation_vector vector;
 
-    // I/O requests are handled by a two level queueing system. Work
-    // structs for the flight queue are within the request structure
-    // itself.
-    //
-    // All requests provided to the map callback are added to the
-    // ground queue. A thread dequeues elements from the ground
-    // queue and adds them to the flight queue. Only requests which
-    // are part of the flight queue are being actively processed. In
-    // case a request for a certain block is already part of the
-    // flight queue, it is skipped over for selection in the ground
-    // queue until the request in the flight queue has been completed.
-    //
-    // After a request has been processed, a thread is called which
-    // cleans up the flight queue. This thread does not require its
-    // separate workqueue since the kernel workqueue is used for it.
-    struct afs_engine_queue ground_eq;
-    struct afs_engine_queue flight_eq;
-    struct afs_engine_queue crypto_eq;
-    struct workqueue_struct *ground_wq;
+    // Reads are started right from the map function and decoded on the
+    // CPU they were mapped on, through the per-CPU queue, so a read runs
+    // to completion on one CPU. Writes are started from the flight queue
+    // and encoded on the crypto queue. Requests for the same block are
+    // serialized through the lock table, a request that has to wait is
+    // started on the flight queue once the one before it completes.
     struct workqueue_struct *flight_wq;
     struct workqueue_struct *crypto_wq;
-    struct work_struct ground_ws;
-    struct work_struct clean_ws;
+    struct workqueue_struct *cpu_wq;
+    struct afs_lock_table locks;
 
-    struct afs_engine_queue rebuild_eq;
+    // The scrubber walks the instance in the background on the rebuild
+    // queue, and rebuilds blocks with corrupted carriers. Blocks reads
+    // find corrupted are queued for repair on the same queue.
     struct workqueue_struct *rebuild_wq;
-    struct work_struct rebuild_ws;
-
-    // Map information.
-    uint8_t *afs_map;
-    uint8_t *afs_map_blocks;
+    struct afs_scrub scrub;
+    struct afs_repair repair;
+
+    // Requests for a bio live in the per-bio data device-mapper hands
+    // us, requests without a bio (rebuilds) come from the request pool.
+    // Every page a request needs is drawn from the page pool, so the
+    // steady state I/O path never calls into the general allocator and
+    // always makes forward progress under memory pressure.
+    mempool_t req_pool;
+    mempool_t page_pool;
+    mempool_t hedge_pool;
+    struct mutex page_pool_lock;
+
+    // Carrier bios. A private bio set keeps carrier I/O from competing
+    // with the rest of the system for the global bio pool.
+    struct bio_set carrier_bs;
+    struct afs_submit_queue submit;
+
+    // Hedges that still have carrier reads in flight, the last one to
+    // finish wakes hedges_wait.
+    atomic_t hedges;
+    wait_queue_head_t hedges_wait;
+
+    // Decoded data blocks, hits never reach the workqueues. In write-back
+    // mode the cache also holds dirty blocks, writeback_dw writes them
+    // out a while after they get dirty and under memory pressure, and
+    // flushes write them out before reaching the disk.
+    struct afs_cache cache;
+    struct workqueue_struct *writeback_wq;
+    struct delayed_work writeback_dw;
+
+    // Sequential read streams. prefetch_ws reads the blocks ahead of
+    // them into the cache.
+    struct afs_prefetch prefetch;
+    struct work_struct prefetch_ws;
+
+    // Writes a flush has to wait for.
+    struct afs_inflight inflight;
+
+    // Statistics reported through the target status.
+    struct afs_stats stats;
+
+    // Map information. Map blocks are read on demand, the map tracks
+    // which of them changed since they were last written. Updated
+    // entries go to the log, log_dw commits it a moment after the first
+    // update and flushes commit it before reaching the disk. map_dw
+    // checkpoints the dirty map blocks a while after they get dirty, or
+    // once the log or the map fills up.
+    struct afs_map afs_map;
+    uint8_t *map_flush_block;
+    struct mutex map_flush_lock;
+    struct delayed_work map_dw;
+    struct afs_log log;
+    struct delayed_work log_dw;
     uint8_t passphrase_hash[32];
     struct afs_ptr_block *afs_ptr_blocks;
 
+    // Which blocks carriers occupy is only known once every map block
+    // has been read. scan_ws reads them in the background after mount.
+    // Until then, allocations take carriers freed meanwhile or wait for
+    // scanned.
+    struct work_struct scan_ws;
+    struct completion scanned;
+    int scan_err;
+    bool scan_stop;
+    uint32_t scan_cursor;
+
     //Encoding stuff
     cauchy_encoder_params params;
     //picks shamir, AONT, or Reed-Solomon
@@ -90,7 +157,7 @@ struct afs_private {
 /**
  * Build the configuration for an instance.
  */
-void build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uint8_t num_entropy_blocks);
+void build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uint8_t num_entropy_blocks, uint8_t map_format);
 
 /**
  * Create the Artifice map and initialize it to
@@ -99,10 +166,15 @@ void build_configuration(struct afs_private *context, uint8_t num_carrier_blocks
 int afs_create_map(struct afs_private *context);
 
 /**
- * Fill an Artifice map with values from the
- * metadata.
+ * Free the Artifice map.
+ */
+void afs_free_map(struct afs_private *context);
+
+/**
+ * Read every map block and mark the carriers in use in the allocation
+ * vector.
  */
-int afs_fill_map(struct afs_super_block *sb, struct afs_private *context);
+int afs_scan_map(struct afs_private *context);
 
 /**
  * Process decoding and encoding things
@@ -110,14 +182,32 @@ int afs_fill_map(struct afs_super_block *sb, struct afs_private *context);
 void afs_cryptoq(struct work_struct *ws);
 
 /**
- * Create the Artifice map blocks.
+ * Write the map blocks of a new instance, and record them in the pointer
+ * blocks.
  */
-int afs_create_map_blocks(struct afs_private *context);
+int write_map_blocks(struct afs_private *context);
 
 /**
- * Write map blocks to pointer blocks.
+ * Mark the map block holding the entry of a block dirty. Called once the
+ * entry has been updated, with its page held.
  */
-int write_map_blocks(struct afs_private *context, bool update);
+void afs_map_dirty(struct afs_private *context, struct afs_map_page *page, uint32_t block);
+
+/**
+ * Write the dirty map blocks to disk, and move the tail of the log past
+ * the updates they hold.
+ */
+int afs_map_flush(struct afs_private *context);
+
+/**
+ * Make every map update made so far durable.
+ */
+int afs_map_commit(struct afs_private *context);
+
+/**
+ * Give an instance that has none a log of map updates.
+ */
+int afs_create_log(struct afs_private *context);
 
 /**
  * Write out the pointer blocks to disk.
@@ -129,6 +219,11 @@ int write_ptr_blocks(struct afs_super_block *sb, struct afs_passive_fs *fs, stru
  */
 int write_super_block(struct afs_super_block *sb, struct afs_passive_fs *fs, struct afs_private *context);
 
+/**
+ * Write the auxiliary block onto the disk. aux_lock must be held.
+ */
+int afs_write_aux_block(struct afs_private *context);
+
 /**
  * Find the super block on the disk.
  */
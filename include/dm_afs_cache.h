@@ -0,0 +1,200 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/bio.h>
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#ifndef DM_AFS_CACHE_H
+#define DM_AFS_CACHE_H
+
+enum {
+    AFS_CACHE_DEFAULT_BLKS = 1024, // 4MB of decoded blocks.
+    AFS_CACHE_GEN_BITS = 8,
+    AFS_CACHE_SKETCH_ROWS = 4,
+    AFS_CACHE_SKETCH_MAX = 15,
+
+    // Cache segments.
+    AFS_CACHE_WINDOW = 0,
+    AFS_CACHE_PROBATION = 1,
+    AFS_CACHE_PROTECTED = 2,
+    AFS_CACHE_SEGMENTS = 3,
+};
+
+// A decoded data block.
+struct afs_cache_entry {
+    struct hlist_node node; // Hash table linkage.
+    struct list_head lru;   // Segment linkage, most recent first.
+    struct list_head dirty; // Dirty list linkage, oldest first.
+    uint32_t block;         // Artifice block number.
+    uint8_t segment;        // Segment the entry is in.
+    bool is_dirty;          // Newer than what is on disk.
+    bool prefetched;        // Read ahead of a stream, not read yet.
+    bool evicted;           // Out of the cache, freed by its last user.
+    uint32_t refs;          // Copies to or from data in progress.
+    uint8_t *data;          // Plaintext of the block.
+};
+
+// Cache of decoded data blocks.
+//
+// Admission and eviction follow W-TinyLFU. New blocks enter a small LRU
+// window. Blocks falling out of the window only make it into the main
+// cache if a frequency sketch says they are accessed more often than the
+// block they would replace, so a large scan cannot flush the hot set.
+// The main cache is a segmented LRU, blocks hit a second time move from
+// probation to the protected segment.
+//
+// Reads that miss snapshot the generation of their block before going
+// to disk, and writes bump it. A decoded block is only inserted if the
+// generation is unchanged, so a slow read never overwrites newer data.
+//
+// Blocks prefetched for a sequential stream skip admission and go
+// straight onto probation. Once the stream has read one it is the first
+// to be evicted, so a stream never pushes blocks into the protected
+// segment.
+//
+// Block contents are never copied under the lock. An entry is looked
+// up and referenced under it, and the copy is made after the lock is
+// dropped. An entry evicted meanwhile is only freed once its last copy
+// is done. Copies racing on the same block are as undefined as the
+// overlapping I/O they serve, a write marks its block dirty again once
+// its copy is done, so a writeback racing with it is followed by another.
+//
+// In write-back mode writes are absorbed into dirty entries. Dirty
+// entries are never evicted, they are handed to the owner of the cache
+// for writeback through writeback_dw, which is kicked a while after
+// the first block gets dirty, when too many blocks are dirty, and under
+// memory pressure.
+struct afs_cache {
+    spinlock_t lock;
+    uint32_t capacity;
+    uint32_t count;
+
+    struct hlist_head *table;
+    uint32_t table_bits;
+    struct list_head segments[AFS_CACHE_SEGMENTS];
+    uint32_t sizes[AFS_CACHE_SEGMENTS];
+    uint32_t limits[AFS_CACHE_SEGMENTS];
+
+    // Count-min sketch of 4-bit access counters. Counters are halved
+    // every sketch_reset accesses so old popularity ages out.
+    uint8_t *sketch;
+    uint32_t sketch_mask;
+    uint32_t sketch_ops;
+    uint32_t sketch_reset;
+
+    uint32_t gens[1 << AFS_CACHE_GEN_BITS];
+    struct shrinker shrinker;
+
+    struct list_head dirty;
+    uint32_t nr_dirty;
+    uint32_t dirty_limit;
+    struct workqueue_struct *writeback_wq;
+    struct delayed_work *writeback_dw;
+    unsigned long writeback_delay;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/**
+ * Initialize a cache holding up to capacity blocks. A capacity of
+ * zero disables the cache.
+ */
+int afs_cache_init(struct afs_cache *cache, uint32_t capacity);
+
+/**
+ * Enable write-back. Dirty blocks are announced by queueing dw on wq,
+ * at the latest delay jiffies after a block gets dirty.
+ */
+void afs_cache_set_writeback(struct afs_cache *cache, struct workqueue_struct *wq, struct delayed_work *dw, unsigned long delay);
+
+/**
+ * Release a cache and all of its blocks. Dirty blocks must have been
+ * written back.
+ */
+void afs_cache_exit(struct afs_cache *cache);
+
+/**
+ * Serve a read bio entirely from the cache. Returns false if any block
+ * it covers is missing, in which case the bio contents are undefined.
+ */
+bool afs_cache_read_bio(struct afs_cache *cache, struct bio *bio);
+
+/**
+ * Copy part of a cached block into the part of a bio described by iter.
+ * Returns false if the block is not cached.
+ */
+bool afs_cache_read_iter(struct afs_cache *cache, uint32_t block, uint32_t offset, struct bio *bio, struct bvec_iter iter);
+
+/**
+ * Copy a whole cached block. Returns false if the block is not cached.
+ */
+bool afs_cache_read_block(struct afs_cache *cache, uint32_t block, uint8_t *data);
+
+/**
+ * Absorb a write bio into dirty blocks. Returns false if some part of
+ * it could not be absorbed, in which case it has to be written out.
+ */
+bool afs_cache_write_bio(struct afs_cache *cache, struct bio *bio);
+
+/**
+ * Pick the oldest dirty block for writeback, without taking it. Returns
+ * false if nothing is dirty.
+ */
+bool afs_cache_next_dirty(struct afs_cache *cache, uint32_t *block);
+
+/**
+ * Take a dirty block for writeback. Its contents are copied to data and
+ * it is marked clean. The caller holds the lock on the block, so no
+ * write to it can be acknowledged before the copy is written out.
+ * Returns false if the block is no longer dirty.
+ */
+bool afs_cache_writeback(struct afs_cache *cache, uint32_t block, uint8_t *data);
+
+/**
+ * Mark a block dirty again after its writeback failed.
+ */
+void afs_cache_redirty(struct afs_cache *cache, uint32_t block);
+
+/**
+ * Current generation of a block, to be passed to afs_cache_fill.
+ */
+uint32_t afs_cache_gen(struct afs_cache *cache, uint32_t block);
+
+/**
+ * Offer a block decoded by a read to the cache.
+ */
+void afs_cache_fill(struct afs_cache *cache, uint32_t block, const uint8_t *data, uint32_t gen);
+
+/**
+ * Offer a block prefetched for a sequential stream to the cache.
+ */
+void afs_cache_prefetch(struct afs_cache *cache, uint32_t block, const uint8_t *data, uint32_t gen);
+
+/**
+ * Check whether a block is cached, without counting it as an access.
+ */
+bool afs_cache_contains(struct afs_cache *cache, uint32_t block);
+
+/**
+ * Update the cache with the new contents of a block being written.
+ */
+void afs_cache_write(struct afs_cache *cache, uint32_t block, const uint8_t *data);
+
+/**
+ * Drop a block from the cache.
+ */
+void afs_cache_invalidate(struct afs_cache *cache, uint32_t block);
+
+/**
+ * Drop a block from the cache, even if it is dirty.
+ */
+void afs_cache_discard(struct afs_cache *cache, uint32_t block);
+
+#endif /* DM_AFS_CACHE_H */
@@ -81,6 +81,16 @@ enum {
     NUM_DEFAULT_CARRIER_BLKS = 4,
     NUM_MAX_CARRIER_BLKS = 8,
     NUM_SUPERBLOCK_REPLICAS = 8,
+    AFS_MIN_POOL_REQS = 16,
+    AFS_MAX_REQ_BLKS = 256,
+    AFS_WRITEBACK_DELAY_MS = 5000,
+    AFS_MAP_FLUSH_DELAY_MS = 5000,
+    AFS_MAP_LOAD_BATCH = 256,
+    AFS_LOG_BLKS = 256,
+    AFS_LOG_COMMIT_DELAY_MS = 1000,
+    AFS_MAX_DISCARD_BLKS = 1 << 20,
+    AFS_DISCARD_BATCH = 256,
+    AFS_ENCODE_CHUNK_BLKS = 16, // No more than AFS_MIN_POOL_REQS.
 
     // Array sizes.
     PASSPHRASE_SZ = 64,
@@ -88,6 +98,7 @@ enum {
     ENTROPY_DIR_SZ = 64,
     ENTROPY_HASH_SZ = 8,
     CARRIER_HASH_SZ = 32,
+    MAP_ENTRY_MAX_SZ = CARRIER_HASH_SZ + ENTROPY_HASH_SZ + (6 * NUM_MAX_CARRIER_BLKS),
 
     // Hash algorithms
     SHA1_SZ = 20,
@@ -110,7 +121,20 @@ enum {
     // Carrier block encoding types
     RS_ENTROPY = 0,
     SHAMIR = 1,
-    AONT_RS = 2
+    AONT_RS = 2,
+
+    // Carrier read modes.
+    READ_MODE_FULL = 0,      // Read every carrier block.
+    READ_MODE_THRESHOLD = 1, // Read the data shards, parity only when needed.
+    READ_MODE_HEDGED = 2,    // Read extra carriers, decode from the first valid ones.
+
+    // Map formats.
+    AFS_MAP_LEGACY = 0,  // Hash, entropy hash and carrier tuples per entry.
+    AFS_MAP_COMPACT = 1, // Carrier pointers and checksums only.
+
+    // Write modes.
+    WRITE_MODE_THROUGH = 0, // Encode and write every block as it comes.
+    WRITE_MODE_BACK = 1,    // Absorb writes in the block cache, write back later.
 };
 
 #endif /* DM_AFS_CONFIG_H */
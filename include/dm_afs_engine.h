@@ -3,9 +3,15 @@
  * Copyright: UC Santa Cruz, SSRC
  */
 #include <dm_afs_config.h>
+#include <dm_afs_lock.h>
+#include <dm_afs_map.h>
 #include <dm_afs_modules.h>
+#include <dm_afs_submit.h>
 #include <lib/libgfshare.h>
+#include <linux/blk_types.h>
+#include <linux/completion.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 
 #ifndef DM_AFS_ENGINE_H
 #define DM_AFS_ENGINE_H
@@ -16,49 +22,122 @@ enum {
     REQ_STATE_COMPLETED = 1 << 2,
 };
 
-struct afs_engine_queue;
+struct afs_hedge;
+struct afs_flush;
+struct afs_scrub;
+struct afs_repair;
+
+// Latency histograms have log2 buckets of microseconds.
+enum {
+    AFS_LAT_BUCKETS = 32,
+};
+
+// Per instance statistics, reported through the target status.
+struct afs_stats {
+    atomic64_t reads;
+    atomic64_t read_lat[AFS_LAT_BUCKETS];
+    atomic64_t parity_reads;
+    atomic64_t hedged_reads;
+    atomic64_t late_carriers;
+    atomic64_t rmw_reads;
+    atomic64_t prefetches;
+};
+
+// Write bios in flight, counted per epoch. A flush opens a new epoch and
+// waits for the count of the previous one to drop to zero, so it waits
+// for exactly the writes submitted before it. Flushes are serialized by
+// their caller.
+struct afs_inflight {
+    unsigned long epoch;
+    atomic_t writes[2];
+    wait_queue_head_t wait;
+};
 
 // A mapping request used to handle a single bio.
 struct afs_map_request {
 
     struct afs_private *afs_context;
-    // The array of pointers to blocks is populated by calling __get_free_page()
-    // as Artifice blocks are the same size as Linux memory pages we can easily 
-    // have aligned pages. On destruction these arrays should be cleaned by 
-    // calling free_page() on each member.
+    // Carrier blocks and the data block are pages drawn from the instance
+    // page pool by afs_req_alloc_pages(), and only once the request knows
+    // it needs them. As Artifice blocks are the same size as Linux memory
+    // pages they are always aligned. afs_req_clean() gives them back.
     uint8_t *carrier_blocks[NUM_MAX_CARRIER_BLKS];
-    uint8_t __attribute__((aligned(4096))) data_block[AFS_BLOCK_SIZE];
+    uint8_t *data_block;
 
     // Multiple requests to the same block will need to be synchronized.
     atomic64_t state;
 
-    // Parent data block bio and number of pending carrier block bios.
+    // CPU the request was mapped on, its decode is queued there.
+    int cpu;
+
+    // Parent data block bio.
     struct bio *bio;
-    atomic_t bios_pending;
     spinlock_t req_lock;
 
+    // A bio covering several blocks is handled as one request per block.
+    // The request in the per-bio data handles the first block and owns the
+    // bio, requests for the other blocks are children drawn from the request
+    // pool. The owner ends the bio once all of its blocks have completed.
+    struct afs_map_request *parent;
+    atomic_t blocks_pending;
+    uint32_t num_blocks;
+    blk_status_t status;
+    uint8_t epoch;
+
     // We need these from the instance context to process a request.
-    uint8_t *map;
+    struct afs_map *map;
     struct block_device *bdev;
     struct afs_config *config;
     struct afs_passive_fs *fs;
     struct afs_allocation_vector *vector;
 
-    struct afs_map_tuple *map_entry_tuple;
-    uint8_t *map_entry;
-    uint8_t *map_entry_hash;
-    uint8_t *map_entry_difference;
-    uint8_t *map_entry_entropy;
+    // Map entry of the block, in the map page held for it.
+    struct afs_map_page *map_page;
+    uint32_t *map_carriers;
+    uint16_t *map_checksums;
     size_t share_size;
 
-    // Write requests allocate a new page for a bio.
-    uint8_t *allocated_write_page;
-
     //encoding context and parameters (only needed for Shamir)
     gfshare_ctx *encoder;
     uint8_t encoding_type;
     uint8_t erasures[NUM_MAX_CARRIER_BLKS];
     uint8_t num_erasures;
+
+    // Carriers [0, carriers_read) have been read, and the bits of
+    // carrier_errors mark those whose bio failed.
+    uint8_t read_mode;
+    uint8_t carriers_read;
+    unsigned long carrier_errors;
+
+    // Hedged reads verify carriers as they arrive, carriers_valid holds
+    // the ones that were valid when decoding started.
+    struct afs_hedge *hedge;
+    unsigned long carriers_valid;
+    uint64_t start_ns;
+
+    // Cache generation of the block when the read was started.
+    uint32_t cache_gen;
+
+    // A partial write reading the block it modifies.
+    bool rmw;
+
+    // A write that allocated new carriers, rather than overwriting the
+    // ones the block had.
+    bool allocated;
+
+    // A read ahead of a sequential stream, it only fills the cache.
+    bool prefetch;
+
+    // Writebacks have no bio, they report to the flush they belong to.
+    struct afs_flush *flush;
+
+    // Scrubbed blocks have no bio either, they report to the scrubber,
+    // and repairs to the repair queue. Both move the carriers they find
+    // corrupted, carriers_lost, right away.
+    struct afs_scrub *scrub;
+    struct afs_repair *repair;
+    unsigned long carriers_lost;
+
     //TODO, this should be SHA256 size
     uint8_t iv[16];
 
@@ -66,6 +145,7 @@ struct afs_map_request {
     uint32_t block;
     uint32_t request_size;
     uint32_t sector_offset;
+    uint32_t bio_offset;
     uint32_t block_nums[NUM_MAX_CARRIER_BLKS];
   
     //flag to mark if rebuild is required and array to keep track of block status
@@ -74,82 +154,143 @@ struct afs_map_request {
     atomic_t rebuild_flag;
 
     struct work_struct req_ws;
-    //So that we can access the encapsulating engine queue struct
-    struct afs_engine_queue *eq;
 
-    //Intrusive red black tree node
-    struct rb_node node;
+    // The owner of a bio started from the map function creates the
+    // children from next_child on in the flight queue, once the pool
+    // ran dry. req_ws may be busy with the owner's own block by then.
+    uint32_t next_child;
+    struct work_struct children_ws;
+
+    // Link in a run of blocks started together. The head of a chunk
+    // handed to the crypto queue keeps the rest of the chunk here.
+    struct list_head batch;
+
+    // Held while the request works on its block.
+    struct afs_block_lock lock;
+};
+
+// Carrier bios are allocated from the instance bio set with this as front
+// pad, so their completion knows the request and carrier they are for.
+struct afs_carrier_bio {
+    struct afs_map_request *req;
+    uint8_t carrier;
+    struct afs_submit_link link;
+    struct bio bio; // Must be last.
 };
 
-// A map queue and its lock.
-struct afs_engine_queue {
-    struct afs_map_request mq;
-    struct rb_root mq_tree;
-    spinlock_t mq_lock;
+// Carrier reads of a hedged request. Late carrier bios may still be in
+// flight once the request has completed, so the carrier pages belong to
+// the hedge and are released when its last reference is dropped. The
+// request pointer is only valid for whoever starts the decode.
+// valid_mask holds the carriers that arrived intact, bad_mask those
+// whose bio failed or that failed their checksum.
+struct afs_hedge {
+    struct afs_map_request *req;
+    struct afs_private *afs_context;
+    atomic_t refs;
+    atomic_t valid;
+    atomic_t bios_pending;
+    unsigned long valid_mask;
+    unsigned long bad_mask;
+    unsigned long flags;
+    uint8_t threshold;
+    uint8_t num_issued;
+    uint16_t checksums[NUM_MAX_CARRIER_BLKS];
+    uint8_t *pages[NUM_MAX_CARRIER_BLKS];
+};
+
+enum {
+    AFS_HEDGE_DECODING = 0,
+};
+
+// Writebacks issued on behalf of a flush. The flush completes once every
+// one of them has.
+struct afs_flush {
+    atomic_t pending;
+    struct completion done;
+    blk_status_t status;
 };
 
+/**
+ * Acquire the data block and carrier block pages for a request.
+ */
+int afs_req_alloc_pages(struct afs_map_request *req);
+
 /**
  * Cleanup a completed request.
  */
 void afs_req_clean(struct afs_map_request *req);
 
 /**
- * Process decoding a read (assemble shards) 
- *
- * Because the crypto API cannot be called in an atomic context, which the endio functions are, we have to make another queue.
+ * Record an error for the bio a request belongs to.
  */
-int afs_read_decode(struct afs_map_request *req);
+void afs_req_error(struct afs_map_request *req, blk_status_t status);
 
 /**
- * Rebuild a set of corrupted blocks
- * Handles a read request and then starts a write request to remap blocks
+ * Initialize in-flight write accounting.
  */
-int rebuild_blocks(struct afs_map_request *req);
+void afs_inflight_init(struct afs_inflight *inflight);
 
 /**
- * Map a rebuild request from userspace 
+ * Account a write bio, returning the epoch it belongs to.
  */
-int afs_rebuild_request(struct afs_map_request *req);
+uint8_t afs_inflight_start(struct afs_inflight *inflight);
 
 /**
- * Map a read request from userspace.
+ * Account the completion of a write bio.
  */
-int afs_read_request(struct afs_map_request *req, struct bio *bio);
+void afs_inflight_end(struct afs_inflight *inflight, uint8_t epoch);
 
 /**
- * Map a write request from userspace.
+ * Open a new epoch and wait for the writes of the current one.
  */
-int afs_write_request(struct afs_map_request *req, struct bio *bio);
+void afs_inflight_drain(struct afs_inflight *inflight);
 
 /**
- * Initialize an engine queue.
+ * Drop a writeback from a flush, recording its status.
  */
-void afs_eq_init(struct afs_engine_queue *eq);
+void afs_flush_put(struct afs_flush *flush, blk_status_t status);
 
 /**
- * Add an element to an engine queue.
+ * Account the latency of a completed read.
  */
-void afs_eq_add(struct afs_engine_queue *eq, struct afs_map_request *element);
+void afs_stats_read_latency(struct afs_stats *stats, uint64_t start_ns);
 
 /**
- * Check if an engine queue is empty without locking.
+ * Latency percentile of reads in microseconds.
  */
-bool afs_eq_empty_unsafe(struct afs_engine_queue *eq);
+uint64_t afs_stats_read_percentile(struct afs_stats *stats, uint32_t percent);
 
 /**
- * Check if an engine queue.
+ * Process decoding a read (assemble shards) 
+ *
+ * Because the crypto API cannot be called in an atomic context, which the endio functions are, we have to make another queue.
  */
-bool afs_eq_empty(struct afs_engine_queue *eq);
+int afs_read_decode(struct afs_map_request *req);
 
 /**
- * Remove a specified request from the red/black tree.
+ * Map a rebuild request from userspace 
+ */
+int afs_rebuild_request(struct afs_map_request *req);
+
+/**
+ * Map a read request from userspace.
  */
-void inline afs_eq_remove(struct afs_engine_queue *eq, struct afs_map_request *req);
+int afs_read_request(struct afs_map_request *req, struct bio *bio);
+
+/**
+ * Read a block ahead of a sequential stream into the block cache.
+ */
+int afs_prefetch_request(struct afs_map_request *req);
+
+/**
+ * Map a write request from userspace.
+ */
+int afs_write_request(struct afs_map_request *req, struct bio *bio);
 
 /**
- * Check if an engine queue contains a request with a specified
- * bio.
+ * Map a discard request from userspace.
  */
-struct afs_map_request * afs_eq_req_exist(struct afs_engine_queue *eq, struct bio *bio);
+int afs_discard_request(struct afs_map_request *req, struct bio *bio);
 
 #endif /* DM_AFS_ENGINE_H */
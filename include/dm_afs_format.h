@@ -12,13 +12,52 @@ struct __attribute__((packed)) afs_super_block {
     uint8_t sb_hash[SHA256_SZ];                  // Hash of the superblock.
     uint8_t hash[SHA1_SZ];                       // Hash of the passphrase.
     uint64_t instance_size;                      // Size of this Artifice instance.
-    uint8_t reserved[4];                         // TODO: Replace with RS information.
+    uint32_t aux_block_ptr;                      // Pointer to the auxiliary block.
     char entropy_dir[ENTROPY_DIR_SZ];            // Entropy directory for this instance.
     char shadow_passphrase[PASSPHRASE_SZ];       // In case this instance is a nested instance.
     uint32_t map_block_ptrs[NUM_MAP_BLKS_IN_SB]; // The super block stores the pointers to the first 975 map blocks.
     uint32_t first_ptr_block;                    // Pointer to the first pointer block in the chain.
 };
 
+// Artifice auxiliary block. The super block is only written when an
+// instance is created, state that changes while the instance is in use
+// lives here instead.
+struct __attribute__((packed)) afs_aux_block {
+    uint8_t hash[SHA256_SZ];             // Hash of the rest of the block.
+    uint32_t scrub_cursor;               // Block the scrubber resumes from.
+    uint64_t scrub_passes;               // Scrub passes completed.
+    uint64_t log_id;                     // Random, tells the log blocks apart from stale ones.
+    uint64_t log_tail;                   // First log block replayed at mount.
+    uint32_t log_tail_count;             // Records of that block already in the map blocks.
+    uint32_t log_num_blocks;             // Zero if the instance has no log yet.
+    uint32_t log_blocks[AFS_LOG_BLKS];   // Log blocks, used in turn.
+    uint32_t map_format;                 // Layout of the map blocks.
+    uint8_t unused[AFS_BLOCK_SIZE - SHA256_SZ - 40 - (AFS_LOG_BLKS * 4)];
+};
+
+// Artifice log block header.
+struct __attribute__((packed)) afs_log_header {
+    uint8_t hash[SHA256_SZ]; // Hash of the rest of the block.
+    uint64_t id;             // Log the block belongs to.
+    uint64_t seq;            // Position of the block in the log.
+    uint32_t count;          // Records in the block.
+};
+
+// struct afs_log_block
+//
+// Overall Size: Exactly 4096 bytes.
+//
+// Structure:
+// afs_log_header (52 bytes)
+// record[0] (4 + map_entry_sz bytes)
+// .
+// .
+// .
+// record[count-1]
+//
+// A record is the number of a block followed by its map entry as it
+// was after the update.
+
 // Artifice pointer block.
 struct __attribute__((packed)) afs_ptr_block {
     // Each pointer block is 4KB. With 32 bit pointers,
@@ -75,14 +114,28 @@ struct __attribute__((packed)) afs_map_tuple {
 // .
 // .
 // afs_map_entry[num_map_entries_per_block-1] (map_entry_sz bytes)
+//
+// Neither the hash nor the entropy hash are used by the AONT-RS and
+// Shamir schemes, the AONT difference lives in the carriers too. The
+// compact map format keeps only what they need, with the carrier
+// pointers and checksums in separate arrays:
+//
+// hash (64 bytes)
+// unused space (unused_space_per_block bytes)
+// carrier_block_ptr[num_map_entries_per_block * num_carrier_blocks] (4 bytes each)
+// checksum[num_map_entries_per_block * num_carrier_blocks] (2 bytes each)
+//
+// A map entry in the log is an entry of the legacy layout, or the
+// pointers of the block followed by their checksums in the compact one.
 
 struct afs_config {
     uint8_t num_carrier_blocks; //Total number of carrier blocks
     uint8_t threshold;          //Reconstruction threshold
     uint8_t num_entropy_blocks; //if using the Reed-Solomon/Entropy scheme
+    uint8_t map_format;    //layout of the map blocks on the disk
     uint8_t map_entry_sz; //size of each map entry (for indexing purposes)
     uint8_t unused_space_per_block; //additional padding in each block
-    uint8_t num_map_entries_per_block;
+    uint16_t num_map_entries_per_block;
     uint32_t num_blocks;   //Total number of artifice blocks (data blocks)
     uint32_t num_map_blocks;
     uint32_t num_ptr_blocks;
@@ -12,7 +12,8 @@
 // I/O flags.
 enum afs_io_type {
     IO_READ = 0,
-    IO_WRITE
+    IO_WRITE,
+    IO_WRITE_FUA // Durable, and after everything completed before.
 };
 
 // Artifice Block Device I/O.
@@ -41,4 +42,20 @@ int read_page(void *page, struct block_device *bdev, uint32_t block_num, uint32_
  */
 int write_page(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset,  bool used_vmalloc);
 
+/**
+ * Write a single page with a preflush and FUA.
+ */
+int write_page_fua(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset, bool used_vmalloc);
+
+/**
+ * Flush the volatile write cache of a block device.
+ */
+int afs_blkdev_flush(struct block_device *bdev);
+
+/**
+ * Read or write a batch of pages, each to its own block. Every transfer
+ * is in flight before any is waited for. Pages must be aligned.
+ */
+int afs_blkdev_batch(uint8_t **pages, uint32_t *block_nums, uint32_t num_pages, struct block_device *bdev, uint32_t sector_offset, bool used_vmalloc, enum afs_io_type type);
+
 #endif /* DM_AFS_IO_H */
@@ -0,0 +1,101 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#ifndef DM_AFS_LOCK_H
+#define DM_AFS_LOCK_H
+
+enum {
+    AFS_LOCK_TABLE_BITS = 10,
+};
+
+// Lock on a single Artifice block, embedded in whatever works on the
+// block. A lock is either held, and then on the list of its bucket, or
+// waiting, and then on the waiters of the lock holding its block.
+struct afs_block_lock {
+    struct list_head node;
+    struct list_head waiters; // FIFO of locks waiting for this block.
+    uint32_t block;
+    struct work_struct work;  // Queued once a waiting lock is granted.
+};
+
+// A bucket only covers the blocks hashing to it, so requests for
+// different blocks rarely meet on the same lock.
+struct afs_lock_bucket {
+    spinlock_t lock;
+    struct list_head held;
+} ____cacheline_aligned_in_smp;
+
+// Hashed table of held block locks.
+//
+// Requests for the same block are serialized in the order they ask for
+// the lock, requests for different blocks go ahead in parallel. Nobody
+// sleeps on a lock, a request that has to wait is parked behind the
+// holder, and its work is queued on wq when the lock is handed to it.
+// The last unlock of a busy table wakes whoever waits for it to idle.
+struct afs_lock_table {
+    struct afs_lock_bucket *buckets;
+    uint32_t bits;
+    struct workqueue_struct *wq;
+    atomic_t nr_held;
+    wait_queue_head_t idle;
+};
+
+/**
+ * Initialize a lock table. Granted waiters are started on wq.
+ */
+int afs_lock_table_init(struct afs_lock_table *table, struct workqueue_struct *wq);
+
+/**
+ * Release a lock table. No lock may be held.
+ */
+void afs_lock_table_exit(struct afs_lock_table *table);
+
+/**
+ * Wait until no lock is held.
+ */
+void afs_lock_table_wait_idle(struct afs_lock_table *table);
+
+/**
+ * Initialize a lock. func runs when the lock is granted after waiting.
+ */
+void afs_block_lock_init(struct afs_block_lock *lock, work_func_t func);
+
+/**
+ * Take the lock on a block. Returns true if the lock was granted right
+ * away. Otherwise the lock waits behind the current holder and its work
+ * is queued once it is granted.
+ */
+bool afs_block_lock(struct afs_lock_table *table, struct afs_block_lock *lock, uint32_t block);
+
+/**
+ * Take the lock on a block only if it is free. Never waits.
+ */
+bool afs_block_trylock(struct afs_lock_table *table, struct afs_block_lock *lock, uint32_t block);
+
+/**
+ * Release a block lock, handing it to the oldest waiter. Does nothing
+ * if the lock is not held.
+ */
+void afs_block_unlock(struct afs_lock_table *table, struct afs_block_lock *lock);
+
+/**
+ * Whether a lock is held. A lock that waits for its block is neither
+ * held nor free, only its owner knows it is not running.
+ */
+static inline bool
+afs_block_locked(struct afs_block_lock *lock)
+{
+    return !list_empty(&lock->node);
+}
+
+#endif /* DM_AFS_LOCK_H */
@@ -0,0 +1,131 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/blk_types.h>
+#include <linux/mutex.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+
+#ifndef DM_AFS_LOG_H
+#define DM_AFS_LOG_H
+
+// What the caller of afs_log_append() has to arrange.
+enum {
+    AFS_LOG_COMMIT = 1 << 0,     // First record since the last commit.
+    AFS_LOG_CHECKPOINT = 1 << 1, // The log is filling up, the map blocks are due.
+};
+
+// Apply a replayed record.
+typedef int (*afs_log_apply_fn)(void *private, uint32_t block, const uint8_t *entry);
+
+// Position in the log a checkpoint covers.
+struct afs_log_mark {
+    uint64_t seq;
+    uint32_t count;
+    bool overflow;
+};
+
+// Log of map updates.
+//
+// Every update of a map entry appends a record holding the new entry to
+// the head of the log, in memory. A commit writes the log blocks filled
+// since the last one in a single batch, so any number of updates costs a
+// few blocks, and the map blocks themselves are only written by
+// checkpoints, once in a while. A committed block is never written again
+// until a checkpoint has covered it, the last block of a commit is
+// sealed even if it is not full.
+//
+// The log is a ring of blocks. A checkpoint marks the head, commits the
+// log, writes the dirty map blocks and moves the tail up to the mark,
+// everything before it is in the map blocks. At mount the blocks from
+// the tail on are read at once, and replayed in order up to the first
+// one missing, so replay never takes more than a read of the log. The
+// records are looked at once before they are applied, so whoever
+// applies them can fetch what they need for all of them at once.
+struct afs_log {
+    spinlock_t lock;
+    uint8_t *pages;          // The log blocks in memory, NULL without a log.
+    uint32_t *blocks;        // Where they live on the disk.
+    uint64_t id;
+    uint32_t num_blocks;
+    uint32_t record_sz;
+    uint32_t records_per_block;
+    uint64_t head;           // Block records are appended to.
+    uint32_t count;          // Records in the head block.
+    uint64_t tail;           // First block a checkpoint has not covered.
+    uint32_t tail_count;     // Records of the tail block covered.
+    bool dirty;              // Records were appended since the last commit.
+    bool overflow;           // Records were dropped, only a checkpoint helps.
+    bool checkpoint_due;
+
+    // Commits go one at a time.
+    struct mutex commit_lock;
+    uint64_t committed;      // Blocks before this one are on the disk.
+    uint64_t end;            // Blocks before this one were read at mount.
+    uint8_t **batch_pages;
+    uint32_t *batch_blocks;
+
+    struct block_device *bdev;
+    uint32_t sector_offset;
+
+    uint64_t commits;
+    uint64_t replayed;
+};
+
+/**
+ * Initialize a log with nowhere to write. Appends are ignored until it is
+ * opened.
+ */
+void afs_log_init(struct afs_log *log);
+
+/**
+ * Open a log kept in the given blocks, with the tail it was last
+ * checkpointed at.
+ */
+int afs_log_open(struct afs_log *log, uint64_t id, const uint32_t *blocks, uint32_t num_blocks, uint32_t record_sz,
+    uint64_t tail, uint32_t tail_count, struct block_device *bdev, uint32_t sector_offset);
+
+/**
+ * Release a log.
+ */
+void afs_log_exit(struct afs_log *log);
+
+/**
+ * Read an opened log, and pass every record after its tail to scan.
+ * Nothing is applied yet.
+ */
+int afs_log_read(struct afs_log *log, afs_log_apply_fn scan, void *private);
+
+/**
+ * Apply every record of a log read by afs_log_read(), in order. Appends
+ * continue after the last record replayed.
+ */
+int afs_log_replay(struct afs_log *log, afs_log_apply_fn apply, void *private);
+
+/**
+ * Append the updated entry of a block. May be called from any context.
+ * Returns AFS_LOG_* flags.
+ */
+int afs_log_append(struct afs_log *log, uint32_t block, const uint8_t *entry);
+
+/**
+ * Write the records appended so far to the disk. Returns -ENOENT without
+ * a log, and -ENOSPC if records were dropped, in which case only a
+ * checkpoint makes them durable.
+ */
+int afs_log_commit(struct afs_log *log);
+
+/**
+ * Mark the head for a checkpoint.
+ */
+void afs_log_mark(struct afs_log *log, struct afs_log_mark *mark);
+
+/**
+ * End a checkpoint. If done, the tail moves up to the mark, which has to
+ * be saved on the disk already.
+ */
+void afs_log_checkpoint(struct afs_log *log, struct afs_log_mark *mark, bool done);
+
+#endif /* DM_AFS_LOG_H */
@@ -0,0 +1,176 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/list.h>
+#include <linux/mempool.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+#ifndef DM_AFS_MAP_H
+#define DM_AFS_MAP_H
+
+enum {
+    AFS_MAP_CACHE_DEFAULT_BLKS = 4096, // 16MB of map blocks.
+    AFS_MAP_RESERVE_PAGES = AFS_MIN_POOL_REQS,
+
+    // States of a map page.
+    AFS_MAP_PAGE_READING = 0,
+    AFS_MAP_PAGE_UPTODATE = 1,
+    AFS_MAP_PAGE_ERROR = 2,
+};
+
+// The entries of a single map block.
+//
+// The carrier pointers of every block and their checksums are kept in
+// two separate arrays, each block owning num_carrier_blocks consecutive
+// slots in both. Finding out whether a block is mapped, and where its
+// carriers are, touches a single cache line of pointers. Only reads look
+// at the checksums. Nothing else is kept per block, the AONT difference
+// travels in the carriers themselves.
+struct afs_map_page {
+    struct hlist_node node; // Hash table linkage.
+    struct list_head lru;   // LRU linkage while unused, most recent first.
+    uint32_t index;         // Map block the entries belong to.
+    uint32_t refs;          // Users of the entries.
+    uint8_t state;
+    uint32_t *carriers;
+    uint16_t *checksums;
+};
+
+struct afs_map;
+
+// Read map block index from the disk into page.
+typedef int (*afs_map_read_fn)(struct afs_map *map, struct afs_map_page *page);
+
+// Read the map blocks of count pages from the disk at once.
+typedef int (*afs_map_read_many_fn)(struct afs_map *map, struct afs_map_page **pages, uint32_t count);
+
+// Artifice map.
+//
+// Only the map blocks in use are kept in memory, as pages. A page is
+// read on first access to any of its blocks, and stays pinned while a
+// request holds on to the entry of one of them. Unused pages go onto an
+// LRU, and the oldest clean one makes room for the next page read once
+// the map holds capacity of them. Dirty pages are never evicted, only a
+// checkpoint writes them back, after which they are clean again. Once
+// half the capacity is dirty the owner is told to checkpoint.
+//
+// A map page cannot be read from inside submit_bio(), a bio submitted
+// there is only dispatched once the submitter returns. Getting a page
+// that is not in memory from there fails with -EAGAIN instead, and the
+// caller retries from a workqueue.
+struct afs_map {
+    spinlock_t lock;
+    uint32_t num_blocks;
+    uint32_t num_map_blocks;
+    uint32_t entries_per_block;
+    uint8_t num_carrier_blocks;
+    afs_map_read_fn read;
+    afs_map_read_many_fn read_many;
+
+    struct hlist_head *table;
+    uint32_t table_bits;
+    struct list_head lru;
+    uint32_t count;
+    uint32_t capacity;
+    wait_queue_head_t wait; // Woken once a page is read.
+    mempool_t pool;         // Pages, with a reserve to read the map with.
+
+    // Map blocks whose entries changed since they were last written.
+    unsigned long *dirty;
+    atomic_t nr_dirty;
+    uint32_t dirty_limit;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/**
+ * Initialize a map of num_blocks blocks, keeping up to capacity map
+ * blocks in memory. Pages are read through read, or read_many when
+ * several are needed at once.
+ */
+int afs_map_init(struct afs_map *map, uint32_t num_blocks, uint8_t num_carrier_blocks, uint32_t entries_per_block,
+    uint32_t capacity, afs_map_read_fn read, afs_map_read_many_fn read_many);
+
+/**
+ * Release a map and all of its pages.
+ */
+void afs_map_exit(struct afs_map *map);
+
+/**
+ * Get the page holding the entry of a block, reading it if needed. The
+ * page stays in memory until it is put. Returns an ERR_PTR on failure,
+ * -EAGAIN if the page would have to be read from inside submit_bio().
+ */
+struct afs_map_page *afs_map_get(struct afs_map *map, uint32_t block);
+
+/**
+ * Get the pages of count map blocks, given by their index. Those not in
+ * memory are read all at once. Every page stays in memory until it is
+ * put. On failure no page is held. Never called from inside submit_bio().
+ */
+int afs_map_get_many(struct afs_map *map, const uint32_t *indices, uint32_t count, struct afs_map_page **pages);
+
+/**
+ * Put a page. May be called from any context.
+ */
+void afs_map_put(struct afs_map *map, struct afs_map_page *page);
+
+/**
+ * Whether a block has carriers. Returns a negative error if its page
+ * could not be read.
+ */
+int afs_map_mapped(struct afs_map *map, uint32_t block);
+
+/**
+ * Map block holding the entry of a block.
+ */
+static inline uint32_t
+afs_map_index(struct afs_map *map, uint32_t block)
+{
+    return block / map->entries_per_block;
+}
+
+/**
+ * Carrier pointers of a block, in the page holding its entry.
+ */
+static inline uint32_t *
+afs_map_carriers(struct afs_map *map, struct afs_map_page *page, uint32_t block)
+{
+    return page->carriers + ((block % map->entries_per_block) * map->num_carrier_blocks);
+}
+
+/**
+ * Carrier checksums of a block, in the page holding its entry.
+ */
+static inline uint16_t *
+afs_map_checksums(struct afs_map *map, struct afs_map_page *page, uint32_t block)
+{
+    return page->checksums + ((block % map->entries_per_block) * map->num_carrier_blocks);
+}
+
+/**
+ * Memory taken by the entries of a page.
+ */
+static inline size_t
+afs_map_page_size(struct afs_map *map)
+{
+    return (size_t)map->entries_per_block * map->num_carrier_blocks * (sizeof(uint32_t) + sizeof(uint16_t));
+}
+
+/**
+ * Memory taken by the pages of a map.
+ */
+static inline size_t
+afs_map_size(struct afs_map *map)
+{
+    return (size_t)READ_ONCE(map->count) * afs_map_page_size(map);
+}
+
+#endif /* DM_AFS_MAP_H */
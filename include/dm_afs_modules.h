@@ -5,6 +5,7 @@
 #include <dm_afs_io.h>
 #include <lib/bit_vector.h>
 #include <linux/bio.h>
+#include <linux/list.h>
 #include <linux/string.h>
 
 #ifndef DM_AFS_MODULES_H
@@ -12,9 +13,16 @@
 
 // Vector to keep a track of which blocks from the
 // passive OS have been allocated.
+//
+// While the map of a mounted instance is scanned, a stale map block read
+// by the scan may still hold a freed block. Freed blocks are kept on the
+// deferred list meanwhile, a page of them at a time, and only cleared once
+// the scan is done. Being known free, they are handed out again first.
 struct afs_allocation_vector {
     bit_vector_t *vector;
     spinlock_t lock;
+    bool deferring;
+    struct list_head deferred;
 };
 
 // Passive file system information.
@@ -48,9 +56,31 @@ bool allocation_set(struct afs_allocation_vector *vector, uint32_t index);
  */
 void allocation_free(struct afs_allocation_vector *vector, uint32_t index);
 
+/**
+ * Clear the usage of several blocks in the allocation vector at once.
+ */
+void allocation_free_many(struct afs_allocation_vector *vector, uint32_t *blocks, uint32_t num_blocks);
+
 /**
  * Get the state of a block in the allocation vector.
  */
 uint8_t allocation_get(struct afs_allocation_vector *vector, uint32_t index);
 
+/**
+ * Keep blocks freed from now on set, until allocation_apply_frees().
+ */
+void allocation_defer_frees(struct afs_allocation_vector *vector);
+
+/**
+ * Clear the blocks freed since allocation_defer_frees(), and clear freed
+ * blocks right away again.
+ */
+void allocation_apply_frees(struct afs_allocation_vector *vector);
+
+/**
+ * Take a block freed since allocation_defer_frees(), it stays set.
+ * Returns AFS_INVALID_BLOCK without one.
+ */
+uint32_t allocation_take_freed(struct afs_allocation_vector *vector);
+
 #endif /* DM_AFS_MODULES_H */
@@ -0,0 +1,65 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+
+#ifndef DM_AFS_PREFETCH_H
+#define DM_AFS_PREFETCH_H
+
+enum {
+    AFS_PREFETCH_STREAMS = 8,      // Streams tracked at once.
+    AFS_PREFETCH_TRIGGER = 2,      // Sequential reads before a stream is prefetched.
+    AFS_PREFETCH_MIN_WINDOW = 4,   // Blocks read ahead of a new stream.
+    AFS_PREFETCH_DEFAULT_WINDOW = 64,
+};
+
+// A sequential read stream. Blocks [next, ahead) have been prefetched
+// or are about to be, [pending_start, ahead) are still to be issued.
+struct afs_stream {
+    uint32_t next;
+    uint32_t ahead;
+    uint32_t window;
+    uint32_t hits;
+    uint32_t pending_start;
+    uint32_t pending;
+    unsigned long last;
+};
+
+// Sequential read detection.
+//
+// Reads are matched against a handful of recently seen streams by the
+// block each stream is expected to read next. Once a stream has read a
+// few blocks in a row, the blocks ahead of it are prefetched into the
+// block cache. The window starts small and doubles every time the
+// stream catches up with the second half of it, up to max_window. A
+// read that matches no stream starts a new one in place of the least
+// recently used.
+struct afs_prefetch {
+    spinlock_t lock;
+    struct afs_stream streams[AFS_PREFETCH_STREAMS];
+    uint32_t max_window;
+    uint32_t limit;
+};
+
+/**
+ * Initialize stream detection for an instance of limit blocks. A
+ * max_window of zero disables prefetching.
+ */
+void afs_prefetch_init(struct afs_prefetch *pf, uint32_t max_window, uint32_t limit);
+
+/**
+ * Account a read of blocks [block, block + num_blocks). Returns true if
+ * blocks became due for prefetching.
+ */
+bool afs_prefetch_read(struct afs_prefetch *pf, uint32_t block, uint32_t num_blocks);
+
+/**
+ * Take a range of blocks due for prefetching. Returns false if there is
+ * none.
+ */
+bool afs_prefetch_take(struct afs_prefetch *pf, uint32_t *start, uint32_t *count);
+
+#endif /* DM_AFS_PREFETCH_H */
@@ -0,0 +1,74 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#ifndef DM_AFS_REPAIR_H
+#define DM_AFS_REPAIR_H
+
+enum {
+    AFS_REPAIR_BATCH = 8,         // Blocks repaired at once.
+    AFS_REPAIR_DELAY_MS = 100,    // Time given to queue up a batch.
+};
+
+struct afs_repair;
+
+// Start repairing a block. Returns 0 if the block was issued, and has to
+// be reported through afs_repair_done(), 1 if there was nothing to repair.
+typedef int (*afs_repair_issue_fn)(struct afs_repair *repair, uint32_t block);
+
+// Deferred repair of degraded blocks.
+//
+// A read that finds corrupted carriers completes as soon as the block is
+// decoded, and only queues the block here. Queued blocks are marked in a
+// bitmap, so a block read many times before it is repaired is repaired
+// once. A while after the first block is queued, the worker takes a
+// batch of them in block order and issues their repairs, the next batch
+// goes once all of those have completed.
+struct afs_repair {
+    spinlock_t lock;
+    unsigned long *pending;
+    uint32_t nr_pending;
+    uint32_t num_blocks;
+    uint32_t cursor;    // Block the next batch starts from.
+    uint32_t inflight;
+
+    uint64_t repaired;
+    uint64_t errors;
+
+    struct workqueue_struct *wq;
+    struct delayed_work dw;
+    afs_repair_issue_fn issue;
+};
+
+/**
+ * Initialize a repair queue over num_blocks blocks. Repairs run on wq.
+ */
+int afs_repair_init(struct afs_repair *repair, struct workqueue_struct *wq, uint32_t num_blocks, afs_repair_issue_fn issue);
+
+/**
+ * Release a repair queue. The worker must have been stopped.
+ */
+void afs_repair_exit(struct afs_repair *repair);
+
+/**
+ * Queue a block for repair. May be called from any context.
+ */
+void afs_repair_add(struct afs_repair *repair, uint32_t block);
+
+/**
+ * Stop issuing repairs. Blocks still queued are dropped, the scrubber
+ * finds them again. Repairs in flight still complete.
+ */
+void afs_repair_stop(struct afs_repair *repair);
+
+/**
+ * Completion of a repair issued by the queue.
+ */
+void afs_repair_done(struct afs_repair *repair, bool error);
+
+#endif /* DM_AFS_REPAIR_H */
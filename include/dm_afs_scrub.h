@@ -0,0 +1,105 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#ifndef DM_AFS_SCRUB_H
+#define DM_AFS_SCRUB_H
+
+enum {
+    AFS_SCRUB_WINDOW = 8,              // Blocks scrubbed at once, well below the request pool.
+    AFS_SCRUB_SCAN_BLKS = 1024,        // Blocks looked at before the worker yields.
+    AFS_SCRUB_CHECKPOINT_BLKS = 4096,  // Blocks between checkpoints.
+    AFS_SCRUB_DEFAULT_RATE = 256,      // Blocks per second.
+};
+
+struct afs_scrub;
+
+// Start scrubbing a block. Returns 0 if the block was issued, and has to
+// be reported through afs_scrub_done(), 1 if there was nothing to scrub.
+typedef int (*afs_scrub_issue_fn)(struct afs_scrub *scrub, uint32_t block);
+
+// Persist the checkpoint and the number of completed passes.
+typedef void (*afs_scrub_save_fn)(struct afs_scrub *scrub, uint32_t checkpoint, uint64_t passes);
+
+// Background scrubber.
+//
+// Walks the blocks of an instance in order, reading every carrier of a
+// mapped block and rebuilding whatever turns out to be corrupted. At most
+// window blocks are in flight, and a rate of blocks per second, refilled
+// into a small bucket of tokens, keeps the scrubber from competing with
+// foreground I/O. Every AFS_SCRUB_CHECKPOINT_BLKS blocks the scrubber
+// waits for what it has in flight and saves its position, so a pass that
+// is interrupted resumes from there instead of starting over. A pass
+// ends the scrubber, it runs again once started.
+struct afs_scrub {
+    spinlock_t lock;
+    bool running;
+    uint32_t cursor;       // Next block to scrub.
+    uint32_t checkpoint;   // Cursor as of the last save.
+    uint32_t num_blocks;
+    uint32_t inflight;
+    uint32_t window;
+    uint32_t rate;         // Blocks per second, zero for no limit.
+    uint32_t tokens;
+    unsigned long refill;  // Jiffies the tokens were last refilled at.
+
+    uint64_t scrubbed;
+    uint64_t repaired;
+    uint64_t errors;
+    uint64_t passes;
+
+    struct workqueue_struct *wq;
+    struct delayed_work dw;
+    afs_scrub_issue_fn issue;
+    afs_scrub_save_fn save;
+};
+
+/**
+ * Initialize a scrubber over num_blocks blocks. The scrubber runs on wq,
+ * and stays idle until started.
+ */
+void afs_scrub_init(struct afs_scrub *scrub, struct workqueue_struct *wq, uint32_t num_blocks, uint32_t rate,
+    afs_scrub_issue_fn issue, afs_scrub_save_fn save);
+
+/**
+ * Continue from a saved checkpoint.
+ */
+void afs_scrub_restore(struct afs_scrub *scrub, uint32_t checkpoint, uint64_t passes);
+
+/**
+ * Start, or continue, a pass.
+ */
+void afs_scrub_start(struct afs_scrub *scrub);
+
+/**
+ * Stop issuing blocks. Blocks in flight still complete.
+ */
+void afs_scrub_pause(struct afs_scrub *scrub);
+
+/**
+ * Change the rate in blocks per second, zero for no limit.
+ */
+void afs_scrub_set_rate(struct afs_scrub *scrub, uint32_t rate);
+
+/**
+ * Pause and wait for the worker to finish. Blocks in flight still
+ * complete, the caller waits for them.
+ */
+void afs_scrub_stop(struct afs_scrub *scrub);
+
+/**
+ * Save the position of a stopped scrubber once nothing is in flight.
+ */
+void afs_scrub_save(struct afs_scrub *scrub);
+
+/**
+ * Completion of a block issued by the scrubber.
+ */
+void afs_scrub_done(struct afs_scrub *scrub, bool error, bool repaired);
+
+#endif /* DM_AFS_SCRUB_H */
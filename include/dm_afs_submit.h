@@ -0,0 +1,53 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs_config.h>
+#include <linux/blk_types.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock_types.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#ifndef DM_AFS_SUBMIT_H
+#define DM_AFS_SUBMIT_H
+
+// Link of a bio waiting in a submit queue, embedded in its front pad.
+struct afs_submit_link {
+    struct rb_node node;
+    struct bio *bio;
+};
+
+// Carrier bios on their way to the passive device.
+//
+// Carrier blocks are scattered over the whole device, so the carriers of
+// the requests in flight form a random stream. On a rotational device
+// bios are collected in a tree ordered by sector instead of being issued
+// right away, and ws submits whatever has gathered in ascending order
+// under a single plug. Batches form by themselves, the more requests are
+// in flight the more bios pile up while ws waits to run. On other devices
+// bios are submitted directly.
+struct afs_submit_queue {
+    spinlock_t lock;
+    struct rb_root root;
+    bool sorted;
+    struct workqueue_struct *wq;
+    struct work_struct ws;
+};
+
+/**
+ * Initialize a submit queue. Bios are sorted only if sorted is set.
+ */
+int afs_submit_init(struct afs_submit_queue *queue, bool sorted);
+
+/**
+ * Release a submit queue, submitting anything still queued.
+ */
+void afs_submit_exit(struct afs_submit_queue *queue);
+
+/**
+ * Submit a bio through a queue. The link has to live as long as the bio.
+ */
+void afs_submit_bio(struct afs_submit_queue *queue, struct afs_submit_link *link, struct bio *bio);
+
+#endif /* DM_AFS_SUBMIT_H */
@@ -32,6 +32,17 @@ int encrypt_payload(uint8_t *data, const size_t datasize, uint8_t *key, size_t k
  */
 int encode_aont_package(uint8_t *difference, const uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce);
 
+/**
+ * Regenerate the parity shares of a package from its data shares. The parity is the same as
+ * when the package was encoded, so lost parity shares can be replaced without touching the rest.
+ *
+ * shares: data_blocks data shares followed by parity_blocks parity shares to be overwritten
+ * data_length: length of the data the package was encoded from
+ * data_blocks: number of data shares (equal to the reconstruction threshold)
+ * parity_blocks: number of redundant shares
+ */
+int encode_aont_parity(uint8_t **shares, size_t data_length, size_t data_blocks, size_t parity_blocks);
+
 /**
  * Decodes a set of shares using AONT-RS and places the reconstructed data into the data buffer
  *
@@ -42,9 +53,10 @@ int encode_aont_package(uint8_t *difference, const uint8_t *data, size_t data_le
  * parity_blocks: number of redundant blocks
  * nonce: array of two 64 bit integers makes up a 128 bit nonce for encryption purposes
  * erasures: an array identifying erasures (used for reed-solomon decoding)
+ * recovery: the parity share used to recover each erasure, NULL to use them in order
  * num_erasures: the number of total known erasures.
  */
-int decode_aont_package(uint8_t *difference, uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce, uint8_t *erasures, uint8_t num_erasures);
+int decode_aont_package(uint8_t *difference, uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce, uint8_t *erasures, uint8_t *recovery, uint8_t num_erasures);
 
 
 #endif
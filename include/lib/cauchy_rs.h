@@ -267,12 +267,17 @@ void cauchy_rs_encode_block(
  * The length of the erasures array should be equal to the number of erasures
  * Each entry in that array is the index of an erased block in the original 
  * code word.
+ *
+ * The recovery array pairs each erasure with the parity block used to recover
+ * it, so any surviving parity blocks can be used. Passing NULL pairs erasure i
+ * with parity block i.
  */
 int cauchy_rs_decode(
     cauchy_encoder_params params, // Encoder parameters
     uint8_t** dataBlocks,         // array of pointers to data blocks
     uint8_t** parityBlocks,       // array of pointers to parity blocks
     uint8_t* erasures,            // array of erasures
+    uint8_t* recovery,            // parity block used for each erasure, or NULL
     uint8_t num_erasures);        // the number of erasures
 
 
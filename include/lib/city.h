@@ -113,8 +113,7 @@ static inline uint8_t* cityhash128_to_array(uint128 hash){
 }
 
 static inline uint16_t cityhash32_to_16(uint8_t *s, size_t len){
-    static uint32_t data = 0;
-    data = CityHash32(s, len);
+    uint32_t data = CityHash32(s, len);
     return (data & 0xffff) ^ ((data >> 16) & 0xffff);
 }
 
@@ -17,6 +17,16 @@
 #define sha_free(X) kfree(X)
 #endif
 
+// Incremental hashing state, the message is absorbed as it comes in
+// instead of being copied into a padded buffer first.
+struct sha3_ctx {
+    uint64_t s[25];
+    uint32_t pos;
+};
+
 void sha3_256(uint8_t*, uint64_t, uint8_t*);
+void sha3_256_init(struct sha3_ctx *ctx);
+void sha3_256_update(struct sha3_ctx *ctx, const uint8_t *message, uint64_t length);
+void sha3_256_final(struct sha3_ctx *ctx, uint8_t *digest);
 
 #endif
@@ -0,0 +1,220 @@
+//Written by Yash Gupta and Austen Barker
+
+// Same-block contention benchmark. A number of threads write single
+// blocks to a small set of hot blocks (or, with zero hot blocks, to
+// blocks of their own) as fast as they can. Every block written is
+// filled with a tag naming the thread and write, so once all threads are
+// done each hot block has to hold exactly one complete write.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// 4KB, one Artifice block.
+#define BLOCK_SIZE (1 << 12)
+
+// Blocks a thread writes to when there are no hot blocks.
+#define PRIVATE_BLOCKS 256
+
+// Time.
+#define INIT_TIME(x) _initTime(x)
+#define GET_TIME(x) _getTime(x)
+
+// Conversions.
+#define TO_MB(x) (x / (1024.0 * 1024.0))
+
+static inline void
+_initTime(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, start);
+}
+
+static inline double
+_getTime(struct timespec start)
+{
+    double time_passed;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    time_passed = (int64_t)1000000000L * (int64_t)(now.tv_sec - start.tv_sec);
+    time_passed += (int64_t)(now.tv_nsec - start.tv_nsec);
+
+    return time_passed / 1000000000.0;
+}
+
+struct thread_ctx {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    int errors;
+};
+
+int fd;
+int n_threads = 32;
+int n_hot = 4;
+int n_writes = 4096;
+pthread_barrier_t barrier;
+
+/**
+ * Fill a block with the tag of a write.
+ */
+static void
+fill_block(uint64_t *block, uint64_t tag)
+{
+    size_t i;
+
+    for (i = 0; i < BLOCK_SIZE / sizeof(*block); i++) {
+        block[i] = tag;
+    }
+}
+
+void *
+thread_write(void *t_arg)
+{
+    struct thread_ctx *ctx = t_arg;
+    uint64_t *buf;
+    off_t offset;
+    ssize_t ret;
+    int i;
+
+    if (posix_memalign((void **)&buf, BLOCK_SIZE, BLOCK_SIZE)) {
+        fprintf(stderr, "[%d] could not allocate buffer\n", ctx->id);
+        ctx->errors++;
+        pthread_barrier_wait(&barrier);
+        return NULL;
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < n_writes; i++) {
+        if (n_hot) {
+            offset = (off_t)(rand_r(&ctx->seed) % n_hot) * BLOCK_SIZE;
+        } else {
+            offset = ((off_t)ctx->id * PRIVATE_BLOCKS + (rand_r(&ctx->seed) % PRIVATE_BLOCKS)) * BLOCK_SIZE;
+        }
+
+        fill_block(buf, ((uint64_t)ctx->id << 32) | (uint32_t)i);
+        ret = pwrite(fd, buf, BLOCK_SIZE, offset);
+        if (ret != BLOCK_SIZE) {
+            perror("could not write block");
+            ctx->errors++;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Check that every hot block holds a single complete write.
+ */
+static int
+verify_blocks(void)
+{
+    uint64_t *buf;
+    int bad = 0;
+    int i;
+    size_t j;
+
+    if (posix_memalign((void **)&buf, BLOCK_SIZE, BLOCK_SIZE)) {
+        return -1;
+    }
+
+    for (i = 0; i < n_hot; i++) {
+        if (pread(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) != BLOCK_SIZE) {
+            perror("could not read block");
+            bad++;
+            continue;
+        }
+        for (j = 1; j < BLOCK_SIZE / sizeof(*buf); j++) {
+            if (buf[j] != buf[0]) {
+                fprintf(stderr, "block %d is torn at word %zu\n", i, j);
+                bad++;
+                break;
+            }
+        }
+    }
+
+    free(buf);
+    return bad;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct thread_ctx *threads;
+    struct timespec time_ctx;
+    double duration;
+    int errors = 0;
+    int bad;
+    int i;
+
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "usage: %s <device> [threads] [hot blocks] [writes per thread]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 2) {
+        n_threads = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        n_hot = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        n_writes = atoi(argv[4]);
+    }
+    if (n_threads < 1 || n_hot < 0 || n_writes < 1) {
+        fprintf(stderr, "incorrect arguments\n");
+        return -1;
+    }
+
+    // Go around the page cache, every write has to reach the target.
+    fd = open(argv[1], O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        perror("could not open file");
+        return -1;
+    }
+
+    threads = calloc(n_threads, sizeof(*threads));
+    if (!threads) {
+        fprintf(stderr, "could not allocate threads\n");
+        return -1;
+    }
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+
+    for (i = 0; i < n_threads; i++) {
+        threads[i].id = i;
+        threads[i].seed = time(0) + i;
+        if (pthread_create(&threads[i].thread, NULL, thread_write, &threads[i])) {
+            perror("could not create thread");
+            return -1;
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    INIT_TIME(&time_ctx);
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        errors += threads[i].errors;
+    }
+    duration = GET_TIME(time_ctx);
+
+    bad = verify_blocks();
+
+    fprintf(stdout, "Threads: %d, Hot blocks: %d\n", n_threads, n_hot);
+    fprintf(stdout, "IOPS: %.1f\n", ((double)n_threads * n_writes) / duration);
+    fprintf(stdout, "Write Throughput: %.4f MB/s\n", TO_MB(((double)n_threads * n_writes * BLOCK_SIZE) / duration));
+    fprintf(stdout, "Write errors: %d, Torn blocks: %d\n", errors, bad);
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    close(fd);
+    return (errors || bad) ? 1 : 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+#Written by Austen Barker and Yash Gupta
+
+# Sequential write throughput against the number of CPUs encoding. The
+# crypto queue of the instance is restricted to the first n CPUs through
+# its sysfs cpumask, and 1MB to 64MB sequential writes are run for every
+# n. The flight worker starting a run encodes its first chunk as well, so
+# n CPUs on the crypto queue means up to n + 1 encoding.
+#
+# usage: cores.sh [device] [span MB]
+
+DEV=${1:-/dev/mapper/artifice}
+SPAN=${2:-256}
+SIZES="1 4 16 64"
+
+WQ=$(ls -d /sys/devices/virtual/workqueue/afs_crypt_* 2>/dev/null | head -1)
+if [ -z "$WQ" ]; then
+    echo "no Artifice instance found"
+    exit 1
+fi
+CPUS=$(nproc)
+SAVED=$(cat $WQ/cpumask)
+
+printf "%-6s" "cores"
+for size in $SIZES; do
+    printf "%12s" "${size}MB"
+done
+printf "\n"
+
+for n in $(seq 1 $CPUS); do
+    printf "%x" $(( (1 << n) - 1 )) | sudo tee $WQ/cpumask > /dev/null
+    printf "%-6s" $n
+    for size in $SIZES; do
+        mbps=$(sudo ./seqwrite $DEV $size $SPAN | sed 's/.*: \([0-9.]*\) MB\/s/\1/')
+        printf "%12s" $mbps
+    done
+    printf "\n"
+done
+
+echo $SAVED | sudo tee $WQ/cpumask > /dev/null
@@ -0,0 +1,140 @@
+//Written by Austen Barker and Yash Gupta
+
+// Memory traffic of the AONT encode of one block. Runs the encrypt and
+// hash stages of encode_aont_package() over a set of blocks, once the way
+// the encode used to buffer them (bio page to data block to plaintext
+// buffer, ciphertext buffer to shares) and once straight from the source
+// page into the shares. Parity generation is the same in both and left
+// out. The working set is larger than the last level cache, so the
+// numbers reflect memory bandwidth rather than cache bandwidth.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/sha3.h"
+#include "lib/speck.h"
+
+#define BLOCK_SIZE 4096
+#define KEY_SIZE 32
+#define DATA_SHARES 2
+#define SHARE_SIZE ((BLOCK_SIZE + KEY_SIZE) / DATA_SHARES)
+
+// 64MB of source blocks.
+#define NUM_BLOCKS (1 << 14)
+
+// Time.
+#define INIT_TIME(x) _initTime(x)
+#define GET_TIME(x) _getTime(x)
+
+static inline void
+_initTime(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, start);
+}
+
+static inline double
+_getTime(struct timespec start)
+{
+    double time_passed;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    time_passed = (int64_t)1000000000L * (int64_t)(now.tv_sec - start.tv_sec);
+    time_passed += (int64_t)(now.tv_nsec - start.tv_nsec);
+
+    return time_passed / 1000000000.0;
+}
+
+uint8_t *blocks;
+uint8_t *shares;
+uint8_t data_block[BLOCK_SIZE];
+uint8_t plaintext[BLOCK_SIZE + KEY_SIZE];
+uint8_t ciphertext[BLOCK_SIZE + KEY_SIZE];
+uint64_t key[4] = {1, 2, 3, 4};
+uint64_t nonce[2] = {5, 6};
+
+/**
+ * Encode through intermediate buffers. Returns the bytes copied.
+ */
+static size_t
+encode_buffered(uint8_t *src, uint8_t *dst)
+{
+    uint64_t hash[4];
+    int i;
+
+    memcpy(data_block, src, BLOCK_SIZE);
+    memcpy(plaintext, data_block, BLOCK_SIZE);
+    speck_ctr((uint64_t *)plaintext, (uint64_t *)ciphertext, BLOCK_SIZE, key, nonce);
+    sha3_256(ciphertext, BLOCK_SIZE, (uint8_t *)hash);
+    memcpy(&ciphertext[BLOCK_SIZE], hash, KEY_SIZE);
+    for (i = 0; i < DATA_SHARES; i++) {
+        memcpy(&dst[i * BLOCK_SIZE], &ciphertext[i * SHARE_SIZE], SHARE_SIZE);
+    }
+    return BLOCK_SIZE * 2 + SHARE_SIZE * DATA_SHARES;
+}
+
+/**
+ * Encode straight into the shares. Returns the bytes copied.
+ */
+static size_t
+encode_direct(uint8_t *src, uint8_t *dst)
+{
+    struct sha3_ctx ctx;
+    uint64_t hash[4];
+    size_t length;
+    int i;
+
+    sha3_256_init(&ctx);
+    for (i = 0; i < DATA_SHARES; i++) {
+        length = (i == DATA_SHARES - 1) ? BLOCK_SIZE - i * SHARE_SIZE : SHARE_SIZE;
+        speck_ctr_offset(&src[i * SHARE_SIZE], &dst[i * BLOCK_SIZE], length, key, nonce, i * SHARE_SIZE);
+        sha3_256_update(&ctx, &dst[i * BLOCK_SIZE], length);
+    }
+    sha3_256_final(&ctx, (uint8_t *)hash);
+    memcpy(&dst[(DATA_SHARES - 1) * BLOCK_SIZE + BLOCK_SIZE - (DATA_SHARES - 1) * SHARE_SIZE], hash, KEY_SIZE);
+    return KEY_SIZE;
+}
+
+static void
+run(const char *name, size_t (*encode)(uint8_t *, uint8_t *))
+{
+    struct timespec time_ctx;
+    double duration;
+    size_t copied = 0;
+    int i;
+
+    INIT_TIME(&time_ctx);
+    for (i = 0; i < NUM_BLOCKS; i++) {
+        copied += encode(&blocks[(size_t)i * BLOCK_SIZE], &shares[(size_t)(i % 256) * DATA_SHARES * BLOCK_SIZE]);
+    }
+    duration = GET_TIME(time_ctx);
+
+    fprintf(stdout, "%-9s %8.1f ns/block, %6zu bytes copied/block, %8.1f MB/s\n", name,
+            duration * 1e9 / NUM_BLOCKS, copied / NUM_BLOCKS, (NUM_BLOCKS * (double)BLOCK_SIZE) / duration / (1024.0 * 1024.0));
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t i;
+
+    blocks = malloc((size_t)NUM_BLOCKS * BLOCK_SIZE);
+    shares = malloc(256 * DATA_SHARES * BLOCK_SIZE);
+    if (!blocks || !shares) {
+        fprintf(stderr, "could not allocate buffers\n");
+        return -1;
+    }
+    for (i = 0; i < (size_t)NUM_BLOCKS * BLOCK_SIZE; i++) {
+        blocks[i] = rand();
+    }
+
+    run("buffered", encode_buffered);
+    run("direct", encode_direct);
+
+    free(blocks);
+    free(shares);
+    return 0;
+}
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+#Written by Austen Barker and Yash Gupta
+
+# Random carrier I/O on an emulated hard disk. A FAT32 image on a loop
+# device is marked rotational and put behind dm-delay, which adds a fixed
+# latency to every request the way a seek would. Artifice is created on
+# top of it, and the contention benchmark runs a random write load on
+# private blocks followed by a threaded random read pass.
+#
+# Run it against a build with and without sorted carrier submission to
+# compare, MODULE points at the build to load. ROTATIONAL=0 marks the
+# loop device non-rotational instead, so the same build can be compared
+# with and without sorting. The instance reports which one it uses in
+# the kernel log.
+#
+# usage: [MODULE=path] [ROTATIONAL=0|1] hdd.sh [delay ms] [threads] [writes per thread]
+
+DELAY=${1:-4}
+THREADS=${2:-32}
+WRITES=${3:-512}
+
+MODULE=${MODULE:-../../dm_afs.ko}
+ROTATIONAL=${ROTATIONAL:-1}
+
+IMAGE=/tmp/afs_hdd.img
+IMAGE_MB=2048
+# 256MB Artifice instance.
+SECTORS=524288
+
+set -e
+
+cleanup() {
+    sudo dmsetup remove artifice 2>/dev/null || true
+    sudo rmmod dm_afs 2>/dev/null || true
+    sudo dmsetup remove afs_hdd 2>/dev/null || true
+    [ -n "$LOOP" ] && sudo losetup -d $LOOP
+    rm -f $IMAGE
+}
+trap cleanup EXIT
+
+truncate -s ${IMAGE_MB}M $IMAGE
+mkfs.vfat -F 32 $IMAGE > /dev/null
+LOOP=$(sudo losetup --find --show $IMAGE)
+
+# The loop device takes after the file backing it, make it look like a disk.
+echo $ROTATIONAL | sudo tee /sys/block/$(basename $LOOP)/queue/rotational > /dev/null
+echo 0 $(sudo blockdev --getsz $LOOP) delay $LOOP 0 $DELAY | sudo dmsetup create afs_hdd
+
+if [ "$MODULE" = "../../dm_afs.ko" ]; then
+    (cd ../..; make > /dev/null)
+fi
+sudo insmod $MODULE afs_debug_mode=1
+echo 0 $SECTORS artifice 0 pass /dev/mapper/afs_hdd | sudo dmsetup create artifice
+dmesg | grep "sorted carrier submission" | tail -1
+
+make contend bench > /dev/null
+echo "Delay: ${DELAY}ms, rotational: $ROTATIONAL"
+sudo ./contend /dev/mapper/artifice $THREADS 0 $WRITES
+sudo ./bench r rand /dev/mapper/artifice
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+#Written by Austen Barker and Yash Gupta
+
+# Map memory and map lookup cache misses. An instance is created on an
+# ext4 image on a loop device and the span read is written first. Random
+# reads then go over the span with the block cache off, under perf
+# counting CPU cache references and misses. The instance reports the
+# memory its map takes and how often map blocks were found in memory.
+#
+# Run it against a build before and after a change to compare, MODULE
+# points at the build to load.
+#
+# usage: [MODULE=path] map.sh [reads per thread] [span blocks]
+
+READS=${1:-4096}
+SPAN=${2:-65536}
+
+MODULE=${MODULE:-../../dm_afs.ko}
+IMAGE=/tmp/afs_map.img
+IMAGE_GB=32
+# 16GB Artifice instance.
+SECTORS=33554432
+
+set -e
+
+cleanup() {
+    sudo dmsetup remove artifice 2>/dev/null || true
+    sudo rmmod dm_afs 2>/dev/null || true
+    [ -n "$LOOP" ] && sudo losetup -d $LOOP
+    rm -f $IMAGE
+}
+trap cleanup EXIT
+
+truncate -s ${IMAGE_GB}G $IMAGE
+mkfs.ext4 -q $IMAGE
+LOOP=$(sudo losetup --find --show $IMAGE)
+
+if [ "$MODULE" = "../../dm_afs.ko" ]; then
+    (cd ../..; make > /dev/null)
+fi
+sudo insmod $MODULE
+echo 0 $SECTORS artifice 0 pass $LOOP --cache_blocks 0 | sudo dmsetup create artifice
+sudo dd if=/dev/urandom of=/dev/mapper/artifice bs=4096 count=$SPAN oflag=direct status=none
+
+make qd > /dev/null
+sync
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+sudo perf stat -a -e cache-references,cache-misses ./qd /dev/mapper/artifice 16 $READS $SPAN
+sudo dmsetup status artifice | grep -o "map_format.*"
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+#Written by Austen Barker and Yash Gupta
+
+# Mount time against instance size. An instance of each size is created
+# on a sparse ext4 image on a loop device, removed, and mounted again,
+# the time to create the mapping is the time to read its metadata and
+# replay its log, map blocks are only read once they are accessed. Caches
+# are dropped before each mount so everything comes off the device.
+#
+# Run it against a build before and after a change to compare, MODULE
+# points at the build to load.
+#
+# usage: [MODULE=path] [IMAGE_GB=n] mount.sh [sizes in GB...]
+
+SIZES=${@:-1 2 4 8 16}
+
+MODULE=${MODULE:-../../dm_afs.ko}
+IMAGE=/tmp/afs_mount.img
+IMAGE_GB=${IMAGE_GB:-64}
+
+set -e
+
+cleanup() {
+    sudo dmsetup remove artifice 2>/dev/null || true
+    sudo rmmod dm_afs 2>/dev/null || true
+    [ -n "$LOOP" ] && sudo losetup -d $LOOP
+    rm -f $IMAGE
+}
+trap cleanup EXIT
+
+truncate -s ${IMAGE_GB}G $IMAGE
+mkfs.ext4 -q $IMAGE
+LOOP=$(sudo losetup --find --show $IMAGE)
+
+if [ "$MODULE" = "../../dm_afs.ko" ]; then
+    (cd ../..; make > /dev/null)
+fi
+sudo insmod $MODULE
+
+echo "size_gb mount_s"
+for GB in $SIZES; do
+    SECTORS=$((GB * 2097152))
+    echo 0 $SECTORS artifice 0 pass $LOOP | sudo dmsetup create artifice
+    sudo dmsetup remove artifice
+
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+    START=$(date +%s.%N)
+    echo 0 $SECTORS artifice 1 pass $LOOP | sudo dmsetup create artifice
+    END=$(date +%s.%N)
+    sudo dmsetup remove artifice
+    echo "$GB $(echo "$END - $START" | bc)"
+done
@@ -0,0 +1,203 @@
+//Written by Yash Gupta and Austen Barker
+
+// Random 4KB reads at a given queue depth. Every thread keeps one read
+// outstanding, so the number of threads is the queue depth. Reports the
+// mean and tail latency and the throughput. Blocks are picked over a
+// span that should have been written before, unmapped blocks never
+// reach the carriers.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// 4KB, one Artifice block.
+#define BLOCK_SIZE (1 << 12)
+
+// Latency histogram, 1us buckets up to 100ms.
+#define LAT_BUCKETS 100000
+
+// Time.
+#define INIT_TIME(x) _initTime(x)
+#define GET_TIME(x) _getTime(x)
+
+// Conversions.
+#define TO_MB(x) (x / (1024.0 * 1024.0))
+
+static inline void
+_initTime(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, start);
+}
+
+static inline double
+_getTime(struct timespec start)
+{
+    double time_passed;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    time_passed = (int64_t)1000000000L * (int64_t)(now.tv_sec - start.tv_sec);
+    time_passed += (int64_t)(now.tv_nsec - start.tv_nsec);
+
+    return time_passed / 1000000000.0;
+}
+
+struct thread_ctx {
+    pthread_t thread;
+    unsigned int seed;
+    uint64_t *lat;
+    double total;
+    int errors;
+};
+
+int fd;
+int depth = 1;
+int n_reads = 4096;
+int span = 65536;
+pthread_barrier_t barrier;
+
+void *
+thread_read(void *t_arg)
+{
+    struct thread_ctx *ctx = t_arg;
+    struct timespec time_ctx;
+    double latency;
+    uint64_t bucket;
+    void *buf;
+    off_t offset;
+    int i;
+
+    if (posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE)) {
+        ctx->errors++;
+        pthread_barrier_wait(&barrier);
+        return NULL;
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < n_reads; i++) {
+        offset = (off_t)(rand_r(&ctx->seed) % span) * BLOCK_SIZE;
+
+        INIT_TIME(&time_ctx);
+        if (pread(fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+            ctx->errors++;
+            continue;
+        }
+        latency = GET_TIME(time_ctx);
+
+        ctx->total += latency;
+        bucket = latency * 1000000.0;
+        ctx->lat[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Latency in microseconds below which percent of the reads completed.
+ */
+static uint64_t
+percentile(uint64_t *lat, uint64_t count, int percent)
+{
+    uint64_t seen = 0;
+    uint64_t i;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += lat[i];
+        if (seen * 100 >= count * percent) {
+            return i;
+        }
+    }
+    return LAT_BUCKETS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct thread_ctx *threads;
+    struct timespec time_ctx;
+    double duration, total = 0;
+    uint64_t *lat;
+    uint64_t count;
+    int errors = 0;
+    int i, j;
+
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "usage: %s <device> [queue depth] [reads per thread] [span blocks]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 2) {
+        depth = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        n_reads = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        span = atoi(argv[4]);
+    }
+    if (depth < 1 || n_reads < 1 || span < 1) {
+        fprintf(stderr, "incorrect arguments\n");
+        return -1;
+    }
+
+    // Go around the page cache, every read has to reach the target.
+    fd = open(argv[1], O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        perror("could not open file");
+        return -1;
+    }
+
+    threads = calloc(depth, sizeof(*threads));
+    lat = calloc(LAT_BUCKETS, sizeof(*lat));
+    if (!threads || !lat) {
+        fprintf(stderr, "could not allocate threads\n");
+        return -1;
+    }
+    pthread_barrier_init(&barrier, NULL, depth + 1);
+
+    for (i = 0; i < depth; i++) {
+        threads[i].seed = time(0) + i;
+        threads[i].lat = calloc(LAT_BUCKETS, sizeof(*lat));
+        if (!threads[i].lat || pthread_create(&threads[i].thread, NULL, thread_read, &threads[i])) {
+            perror("could not create thread");
+            return -1;
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    INIT_TIME(&time_ctx);
+    for (i = 0; i < depth; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    duration = GET_TIME(time_ctx);
+
+    for (i = 0; i < depth; i++) {
+        for (j = 0; j < LAT_BUCKETS; j++) {
+            lat[j] += threads[i].lat[j];
+        }
+        total += threads[i].total;
+        errors += threads[i].errors;
+        free(threads[i].lat);
+    }
+    count = (uint64_t)depth * n_reads - errors;
+
+    fprintf(stdout, "Queue depth: %d\n", depth);
+    fprintf(stdout, "Latency: mean %.1f us, p50 %lu us, p99 %lu us\n", count ? total * 1000000.0 / count : 0.0,
+            percentile(lat, count, 50), percentile(lat, count, 99));
+    fprintf(stdout, "IOPS: %.1f\n", count / duration);
+    fprintf(stdout, "Read Throughput: %.4f MB/s\n", TO_MB(((double)count * BLOCK_SIZE) / duration));
+    fprintf(stdout, "Read errors: %d\n", errors);
+
+    pthread_barrier_destroy(&barrier);
+    free(lat);
+    free(threads);
+    close(fd);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+#Written by Austen Barker and Yash Gupta
+
+# Random read latency at queue depth 1 and throughput at queue depth 64.
+# An instance is created on an ext4 image on a loop device and the span
+# read is written first, unmapped blocks never reach the carriers. The
+# block cache is off, every read goes to the carriers.
+#
+# Run it against a build before and after a change to compare, MODULE
+# points at the build to load.
+#
+# usage: [MODULE=path] qd.sh [reads per thread] [span blocks]
+
+READS=${1:-4096}
+SPAN=${2:-65536}
+
+MODULE=${MODULE:-../../dm_afs.ko}
+IMAGE=/tmp/afs_qd.img
+IMAGE_GB=8
+# 1GB Artifice instance.
+SECTORS=2097152
+
+set -e
+
+cleanup() {
+    sudo dmsetup remove artifice 2>/dev/null || true
+    sudo rmmod dm_afs 2>/dev/null || true
+    [ -n "$LOOP" ] && sudo losetup -d $LOOP
+    rm -f $IMAGE
+}
+trap cleanup EXIT
+
+truncate -s ${IMAGE_GB}G $IMAGE
+mkfs.ext4 -q $IMAGE
+LOOP=$(sudo losetup --find --show $IMAGE)
+
+if [ "$MODULE" = "../../dm_afs.ko" ]; then
+    (cd ../..; make > /dev/null)
+fi
+sudo insmod $MODULE
+echo 0 $SECTORS artifice 0 pass $LOOP --cache_blocks 0 | sudo dmsetup create artifice
+sudo dd if=/dev/urandom of=/dev/mapper/artifice bs=4096 count=$SPAN oflag=direct status=none
+
+make qd > /dev/null
+for DEPTH in 1 64; do
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+    sudo ./qd /dev/mapper/artifice $DEPTH $READS $SPAN
+done
@@ -0,0 +1,98 @@
+//Written by Yash Gupta and Austen Barker
+
+// Large sequential writes. Writes a span of the device from the start
+// in writes of the given size and reports the throughput. The data is
+// random, blocks of zeroes are never encoded.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// 4KB, one Artifice block.
+#define BLOCK_SIZE (1 << 12)
+
+// Time.
+#define INIT_TIME(x) _initTime(x)
+#define GET_TIME(x) _getTime(x)
+
+// Conversions.
+#define TO_MB(x) (x / (1024.0 * 1024.0))
+#define FROM_MB(x) ((size_t)(x) * 1024 * 1024)
+
+static inline void
+_initTime(struct timespec *start)
+{
+    clock_gettime(CLOCK_MONOTONIC_RAW, start);
+}
+
+static inline double
+_getTime(struct timespec start)
+{
+    double time_passed;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    time_passed = (int64_t)1000000000L * (int64_t)(now.tv_sec - start.tv_sec);
+    time_passed += (int64_t)(now.tv_nsec - start.tv_nsec);
+
+    return time_passed / 1000000000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct timespec time_ctx;
+    double duration;
+    size_t write_size, span, done;
+    uint32_t *buf;
+    size_t i;
+    int fd;
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s <device> <write size MB> [span MB]\n", argv[0]);
+        return -1;
+    }
+    write_size = FROM_MB(atoi(argv[2]));
+    span = (argc > 3) ? FROM_MB(atoi(argv[3])) : 4 * write_size;
+    if (!write_size || span < write_size) {
+        fprintf(stderr, "incorrect arguments\n");
+        return -1;
+    }
+
+    if (posix_memalign((void **)&buf, BLOCK_SIZE, write_size)) {
+        fprintf(stderr, "could not allocate buffer\n");
+        return -1;
+    }
+    srand(time(0));
+    for (i = 0; i < write_size / sizeof(*buf); i++) {
+        buf[i] = rand();
+    }
+
+    fd = open(argv[1], O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        perror("could not open file");
+        return -1;
+    }
+
+    INIT_TIME(&time_ctx);
+    for (done = 0; done + write_size <= span; done += write_size) {
+        if (pwrite(fd, buf, write_size, done) != (ssize_t)write_size) {
+            perror("could not write");
+            return -1;
+        }
+    }
+    fsync(fd);
+    duration = GET_TIME(time_ctx);
+
+    fprintf(stdout, "Write size: %zu MB, Write Throughput: %.4f MB/s\n", write_size / FROM_MB(1), TO_MB(done / duration));
+
+    close(fd);
+    free(buf);
+    return 0;
+}
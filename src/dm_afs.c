@@ -6,10 +6,14 @@
 #include <dm_afs_engine.h>
 #include <dm_afs_io.h>
 #include <dm_afs_modules.h>
+#include <linux/blkdev.h>
 #include <linux/delay.h>
 #include "lib/cauchy_rs.h"
 #include "lib/sha3.h"
 
+// Backing cache for the per-instance request pools.
+static struct kmem_cache *afs_req_cache;
+
 /**
  * A procedure to detect the existing file system on a block
  * device or a block device partition.
@@ -78,6 +82,11 @@ parse_afs_args(struct afs_args *args, unsigned int argc, char *argv[])
 
     afs_assert(argc >= 3, err, "not enough arguments");
     memset(args, 0, sizeof(*args));
+    args->read_mode = READ_MODE_THRESHOLD;
+    args->cache_blocks = AFS_CACHE_DEFAULT_BLKS;
+    args->prefetch_blocks = AFS_PREFETCH_DEFAULT_WINDOW;
+    args->scrub_rate = AFS_SCRUB_DEFAULT_RATE;
+    args->map_cache_blocks = AFS_MAP_CACHE_DEFAULT_BLKS;
 
     // These three are always required.
     afs_assert(!kstrtou8(argv[TYPE], BASE_10, &args->instance_type), err, "instance type not integer");
@@ -96,12 +105,55 @@ parse_afs_args(struct afs_args *args, unsigned int argc, char *argv[])
         } else if (!strcmp(argv[i], "--shadow_passphrase")) {
             afs_assert(++i < argc, err, "missing value [shadow passphrase]");
             strncpy(args->shadow_passphrase, argv[i], PASSPHRASE_SZ - 1);
+        } else if (!strcmp(argv[i], "--read_mode")) {
+            afs_assert(++i < argc, err, "missing value [read mode]");
+            if (!strcmp(argv[i], "full")) {
+                args->read_mode = READ_MODE_FULL;
+            } else if (!strcmp(argv[i], "threshold")) {
+                args->read_mode = READ_MODE_THRESHOLD;
+            } else if (!strcmp(argv[i], "hedged")) {
+                args->read_mode = READ_MODE_HEDGED;
+            } else {
+                afs_assert(0, err, "unknown read mode [%s]", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "--hedge_width")) {
+            afs_assert(++i < argc, err, "missing value [hedge width]");
+            afs_assert(!kstrtou8(argv[i], BASE_10, &args->hedge_width), err, "hedge width not integer");
+        } else if (!strcmp(argv[i], "--cache_blocks")) {
+            afs_assert(++i < argc, err, "missing value [cache blocks]");
+            afs_assert(!kstrtou32(argv[i], BASE_10, &args->cache_blocks), err, "cache blocks not integer");
+        } else if (!strcmp(argv[i], "--prefetch_blocks")) {
+            afs_assert(++i < argc, err, "missing value [prefetch blocks]");
+            afs_assert(!kstrtou32(argv[i], BASE_10, &args->prefetch_blocks), err, "prefetch blocks not integer");
+        } else if (!strcmp(argv[i], "--scrub_rate")) {
+            afs_assert(++i < argc, err, "missing value [scrub rate]");
+            afs_assert(!kstrtou32(argv[i], BASE_10, &args->scrub_rate), err, "scrub rate not integer");
+        } else if (!strcmp(argv[i], "--map_cache_blocks")) {
+            afs_assert(++i < argc, err, "missing value [map cache blocks]");
+            afs_assert(!kstrtou32(argv[i], BASE_10, &args->map_cache_blocks), err, "map cache blocks not integer");
+        } else if (!strcmp(argv[i], "--write_mode")) {
+            afs_assert(++i < argc, err, "missing value [write mode]");
+            if (!strcmp(argv[i], "through")) {
+                args->write_mode = WRITE_MODE_THROUGH;
+            } else if (!strcmp(argv[i], "back")) {
+                args->write_mode = WRITE_MODE_BACK;
+            } else {
+                afs_assert(0, err, "unknown write mode [%s]", argv[i]);
+            }
         } else {
             afs_assert(0, err, "unknown argument");
         }
     }
     afs_debug("Entropy: %s", args->entropy_dir);
     afs_debug("Shadow Passphrase: %s", args->shadow_passphrase);
+    afs_debug("Read mode: %d", args->read_mode);
+    afs_debug("Hedge width: %d", args->hedge_width);
+    afs_debug("Cache blocks: %u", args->cache_blocks);
+    afs_debug("Write mode: %d", args->write_mode);
+    afs_debug("Prefetch blocks: %u", args->prefetch_blocks);
+    afs_debug("Scrub rate: %u", args->scrub_rate);
+    afs_debug("Map cache blocks: %u", args->map_cache_blocks);
+    afs_assert(args->write_mode != WRITE_MODE_BACK || args->cache_blocks, err, "write-back needs the block cache");
 
     // Now that we have all the arguments, we need to make sure
     // that they semantically make sense.
@@ -130,36 +182,34 @@ err:
     return -EINVAL;
 }
 
+static struct afs_map_request *init_request(struct afs_private *context, struct afs_map_request *req);
+
 /**
- * Flight queue.
+ * Start processing a single block of a request.
  */
-static void
-afs_flightq(struct work_struct *ws)
+static int
+afs_flight_block(struct afs_map_request *req)
 {
-    struct afs_map_request *req = NULL;
     int ret = 0;
 
-    req = container_of(ws, struct afs_map_request, req_ws);
+    atomic64_set(&req->state, REQ_STATE_FLIGHT);
 
-    if(work_pending(ws)){
-        return;
+    if (req->prefetch) {
+        return afs_prefetch_request(req);
+    }
+
+    // Writebacks carry their data instead of a bio.
+    if (!req->bio) {
+        return afs_write_request(req, NULL);
     }
 
     switch (bio_op(req->bio)) {
     case REQ_OP_READ:
-        //if ((existing_req = afs_eq_req_exist(req->eq, req->bio))) {
-        //    memcpy(req->data_block, existing_req->data_block, AFS_BLOCK_SIZE);
-        //    afs_req_clean(req);
-        //    return;
-        //} else {
-            atomic64_set(&req->state, REQ_STATE_FLIGHT);
-            ret = afs_read_request(req, req->bio);
-        //}
+        ret = afs_read_request(req, req->bio);
         break;
 
     case REQ_OP_WRITE:
-        //afs_eq_add(req->eq, req);
-        atomic64_set(&req->state, REQ_STATE_FLIGHT);
+    case REQ_OP_WRITE_ZEROES:
         ret = afs_write_request(req, req->bio);
         break;
 
@@ -167,41 +217,348 @@ afs_flightq(struct work_struct *ws)
         ret = -EINVAL;
         afs_debug("This case should never be encountered!");
     }
-    afs_assert(!ret, done, "could not perform operation [%d:%d]", ret, bio_op(req->bio));
-    return;
+    return ret;
+}
 
-done:
+/**
+ * Fail a block that could not be started.
+ */
+static void
+afs_flight_error(struct afs_map_request *req, int ret)
+{
+    afs_alert("could not perform operation [%d:%u]", ret, req->block);
+    if (!req->bio && !req->prefetch) {
+        afs_cache_redirty(&req->afs_context->cache, req->block);
+    }
+    afs_req_error(req, BLK_STS_IOERR);
     afs_req_clean(req);
-    return;
 }
 
 /**
- * Work queue for the rebuild operation
- * Iterates through all the blocks 
+ * Start a block whose lock is held. A block whose map entry could not be
+ * read where it was started goes back to the flight queue, still
+ * holding its lock.
+ */
+static void
+afs_flight_start(struct afs_map_request *req)
+{
+    int ret;
+
+    ret = afs_flight_block(req);
+    if (ret == -EAGAIN) {
+        queue_work(req->afs_context->flight_wq, &req->lock.work);
+    } else if (ret) {
+        afs_flight_error(req, ret);
+    }
+}
+
+/**
+ * Start a block once the lock on it has been handed over by the
+ * request before it.
+ */
+static void
+afs_lockq(struct work_struct *ws)
+{
+    struct afs_map_request *req = container_of(ws, struct afs_map_request, lock.work);
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    afs_flight_start(req);
+    blk_finish_plug(&plug);
+}
+
+/**
+ * Initialize the request for one of the trailing blocks of a bio.
+ */
+static struct afs_map_request *
+init_child_request(struct afs_map_request *owner, uint32_t index)
+{
+    struct afs_map_request *req;
+    uint32_t bio_size = owner->bio->bi_iter.bi_size;
+
+    // The map function cannot wait for the pool.
+    req = mempool_alloc(&owner->afs_context->req_pool, current->bio_list ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_NOIO);
+    if (!req) {
+        return NULL;
+    }
+    init_request(owner->afs_context, req);
+    req->bio = owner->bio;
+    req->parent = owner;
+    req->cpu = owner->cpu;
+    req->block = owner->block + index;
+    req->sector_offset = 0;
+    req->bio_offset = owner->request_size + ((index - 1) * AFS_BLOCK_SIZE);
+    req->request_size = min_t(uint32_t, AFS_BLOCK_SIZE, bio_size - req->bio_offset);
+    return req;
+}
+
+/**
+ * Start a chunk of blocks whose locks are held. The carrier bios of all
+ * of them are submitted under one plug.
+ */
+static void
+afs_flight_chunk(struct list_head *chunk)
+{
+    struct afs_map_request *req, *next;
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    list_for_each_entry_safe (req, next, chunk, batch) {
+        // A started request may be gone by the time it returns.
+        list_del_init(&req->batch);
+        afs_flight_start(req);
+    }
+    blk_finish_plug(&plug);
+}
+
+/**
+ * Encode queue. Starts a chunk of a run, on behalf of the request
+ * heading it.
+ */
+static void
+afs_encodeq(struct work_struct *ws)
+{
+    struct afs_map_request *head = container_of(ws, struct afs_map_request, req_ws);
+    LIST_HEAD(chunk);
+
+    list_splice_init(&head->batch, &chunk);
+    list_add(&head->batch, &chunk);
+    afs_flight_chunk(&chunk);
+}
+
+/**
+ * A run of blocks whose locks are held, started a chunk at a time.
+ */
+struct afs_flight_run {
+    struct list_head chunk;
+    uint32_t length;
+    bool encode;
+};
+
+/**
+ * Start a run.
+ */
+static void
+afs_flight_run_init(struct afs_flight_run *run, bool encode)
+{
+    INIT_LIST_HEAD(&run->chunk);
+    run->length = 0;
+    run->encode = encode;
+}
+
+/**
+ * Add a block to a run.
+ *
+ * Encoding a block is purely CPU bound and independent of every other
+ * block, so a run of writes is cut into chunks that are spread over
+ * the crypto queue. Reads only issue carrier bios and are started right
+ * here. Either way a chunk is on its way before the next request is
+ * allocated. Chunks are no larger than the reserve of the request pool,
+ * so requests waiting for the pool never wait on requests that are not
+ * started yet.
+ */
+static void
+afs_flight_run_add(struct afs_private *context, struct afs_flight_run *run, struct afs_map_request *req)
+{
+    struct afs_map_request *head;
+
+    list_add_tail(&req->batch, &run->chunk);
+    if (++run->length < AFS_ENCODE_CHUNK_BLKS) {
+        return;
+    }
+
+    if (run->encode) {
+        head = list_first_entry(&run->chunk, struct afs_map_request, batch);
+        list_del_init(&head->batch);
+        list_splice_init(&run->chunk, &head->batch);
+        INIT_WORK(&head->req_ws, afs_encodeq);
+        queue_work(context->crypto_wq, &head->req_ws);
+    } else {
+        afs_flight_chunk(&run->chunk);
+    }
+    run->length = 0;
+}
+
+/**
+ * Start what is left of a run right here.
  */
 static void
-afs_rebuildq(struct work_struct *ws)
+afs_flight_run_finish(struct afs_flight_run *run)
+{
+    afs_flight_chunk(&run->chunk);
+    run->length = 0;
+}
+
+static void afs_childrenq(struct work_struct *ws);
+
+/**
+ * Start the blocks of a bio.
+ *
+ * Every block of a bio is locked by the request owning it, and the
+ * blocks that could be locked right away are started as one run.
+ * Started from the map function nothing here may wait for memory.
+ */
+static void
+afs_flight_bio(struct afs_map_request *owner)
 {
     struct afs_map_request *req = NULL;
-    int ret = 0;
+    struct afs_private *context;
+    struct afs_flight_run run;
+    uint32_t num_blocks;
+    uint32_t i;
+
+    // The owner may be released as soon as its last block completes,
+    // which can happen before the run is finished. Blocks not created
+    // yet keep it around.
+    context = owner->afs_context;
+    num_blocks = owner->num_blocks;
+    afs_flight_run_init(&run, op_is_write(bio_op(owner->bio)));
+
+    for (i = owner->next_child; i < num_blocks; i++) {
+        req = (i == 0) ? owner : init_child_request(owner, i);
+
+        // Out of requests in the map function, the rest of the bio is
+        // created from the flight queue.
+        if (!req) {
+            owner->next_child = i;
+            INIT_WORK(&owner->children_ws, afs_childrenq);
+            queue_work(context->flight_wq, &owner->children_ws);
+            break;
+        }
 
-    req = container_of(ws, struct afs_map_request, req_ws);
+        // Blocks another request is working on are started once it is
+        // done with them.
+        if (afs_block_lock(&context->locks, &req->lock, req->block)) {
+            afs_flight_run_add(context, &run, req);
+        }
+    }
+    afs_flight_run_finish(&run);
+}
+
+/**
+ * Flight queue. Creates the rest of the blocks of a bio started from
+ * the map function.
+ */
+static void
+afs_childrenq(struct work_struct *ws)
+{
+    afs_flight_bio(container_of(ws, struct afs_map_request, children_ws));
+}
+
+/**
+ * Flight queue.
+ */
+static void
+afs_flightq(struct work_struct *ws)
+{
+    struct afs_map_request *owner = container_of(ws, struct afs_map_request, req_ws);
 
     if(work_pending(ws)){
         return;
     }
+    afs_flight_bio(owner);
+}
+
+/**
+ * Prefetch queue. Reads the blocks due ahead of sequential streams into
+ * the cache. Blocks that are cached or that somebody is working on are
+ * skipped, the stream gets them from the cache either way.
+ */
+static void
+afs_prefetchq(struct work_struct *ws)
+{
+    struct afs_private *context = container_of(ws, struct afs_private, prefetch_ws);
+    struct afs_map_request *req = NULL;
+    struct blk_plug plug;
+    uint32_t start, count;
+    uint32_t i;
+
+    blk_start_plug(&plug);
+    while (afs_prefetch_take(&context->prefetch, &start, &count)) {
+        for (i = start; i < start + count; i++) {
+            if (afs_cache_contains(&context->cache, i)) {
+                continue;
+            }
+
+            req = init_request(context, NULL);
+            req->block = i;
+            req->sector_offset = 0;
+            req->request_size = AFS_BLOCK_SIZE;
+            req->prefetch = true;
+            if (!afs_block_trylock(&context->locks, &req->lock, req->block)) {
+                mempool_free(req, &context->req_pool);
+                continue;
+            }
+            afs_flight_start(req);
+        }
+    }
+    blk_finish_plug(&plug);
+}
+
+/**
+ * Start a discard, or go on with one.
+ */
+static void
+afs_discard_start(struct afs_map_request *req)
+{
+    int ret;
+
+    ret = afs_discard_request(req, req->bio);
+    if (ret) {
+        afs_alert("could not perform discard [%d]", ret);
+        afs_req_error(req, BLK_STS_IOERR);
+        afs_req_clean(req);
+    }
+}
+
+/**
+ * Discard queue.
+ */
+static void
+afs_discardq(struct work_struct *ws)
+{
+    afs_discard_start(container_of(ws, struct afs_map_request, req_ws));
+}
+
+/**
+ * Go on with a discard once the lock on the block it waited for has
+ * been handed over.
+ */
+static void
+afs_discard_lockq(struct work_struct *ws)
+{
+    afs_discard_start(container_of(ws, struct afs_map_request, lock.work));
+}
+
+/**
+ * Rebuild a single block.
+ */
+static void
+afs_rebuild_block(struct afs_map_request *req)
+{
+    int ret = 0;
 
     atomic64_set(&req->state, REQ_STATE_FLIGHT);
     ret = afs_rebuild_request(req);
 
-    afs_assert(!ret, done, "could not perform operation [%d:%d]", ret, bio_op(req->bio));
+    afs_assert(!ret, done, "could not perform rebuild [%d:%u]", ret, req->block);
     return;
 
 done:
+    afs_req_error(req, BLK_STS_IOERR);
     afs_req_clean(req);
     return;
 }
 
+/**
+ * Rebuild a block once the lock on it has been handed over.
+ */
+static void
+afs_rebuild_lockq(struct work_struct *ws)
+{
+    afs_rebuild_block(container_of(ws, struct afs_map_request, lock.work));
+}
+
 void
 afs_cryptoq(struct work_struct *ws){
     struct afs_map_request *req = NULL;
@@ -213,126 +570,82 @@ afs_cryptoq(struct work_struct *ws){
     }
     ret = afs_read_decode(req);
 
-    afs_assert(!ret, done, "could not perform operation [%d:%d]", ret, bio_op(req->bio));
+    afs_assert(!ret, done, "could not decode block [%d:%u]", ret, req->block);
     return;
 
 done:
+    afs_req_error(req, BLK_STS_IOERR);
     afs_req_clean(req);
     return;
 
 }
 
-/**
- * Allocate a new bio and copy in the contents from another
- * one.
- * 
- * NO-OP for read requests.
- */
-static struct bio *
-__clone_bio(struct bio *bio_src, uint8_t **allocated_page, bool end_bio_src)
-{
-    // TODO: Override is enabled because without it, there is too much
-    // lock contention, leading to overall worse performance.
-    const int override = 1;
-
-    struct bio_vec bv;
-    struct bvec_iter iter;
-    struct bio *bio_ret = NULL;
-    uint8_t *page = NULL;
-    uint8_t *bio_data = NULL;
-    uint32_t sector_offset;
-    uint32_t segment_offset;
-    uint32_t req_size;
-
-    // Read requests are not cloned.
-    if (bio_op(bio_src) == REQ_OP_READ || override) {
-        return bio_src;
-    }
-
-    bio_ret = bio_alloc(GFP_NOIO, 1);
-    afs_assert(!IS_ERR(bio_ret), alloc_err, "could not allocate bio [%ld]", PTR_ERR(bio_ret));
-
-    page = kmalloc(AFS_BLOCK_SIZE, GFP_KERNEL);
-    afs_assert(page, page_err, "could not allocate page [%d]", -ENOMEM);
-
-    // Copy in the data from the segments.
-    sector_offset = bio_src->bi_iter.bi_sector % (AFS_BLOCK_SIZE / AFS_SECTOR_SIZE);
-    req_size = bio_sectors(bio_src) * AFS_SECTOR_SIZE;
-    afs_assert(req_size <= AFS_BLOCK_SIZE, size_err, "cannot handle requested size [%u]", req_size);
-
-    segment_offset = 0;
-    bio_for_each_segment (bv, bio_src, iter) {
-        bio_data = kmap(bv.bv_page);
-        if (bv.bv_len <= (req_size - segment_offset)) {
-            memcpy(page + (sector_offset * AFS_SECTOR_SIZE) + segment_offset, bio_data + bv.bv_offset, bv.bv_len);
-        } else {
-            memcpy(page + (sector_offset * AFS_SECTOR_SIZE) + segment_offset, bio_data + bv.bv_offset, req_size - segment_offset);
-            kunmap(bv.bv_page);
-            break;
-        }
-        segment_offset += bv.bv_len;
-        kunmap(bv.bv_page);
-    }
-
-    bio_add_page(bio_ret, virt_to_page(page), req_size, sector_offset * AFS_SECTOR_SIZE);
-    bio_ret->bi_opf = bio_src->bi_opf;
-    bio_ret->bi_iter.bi_sector = bio_src->bi_iter.bi_sector;
-    bio_ret->bi_iter.bi_size = req_size;
-    bio_ret->bi_iter.bi_idx = 0;
-    bio_ret->bi_iter.bi_bvec_done = 0;
-
-    // End bio if specified.
-    if (end_bio_src) {
-        bio_endio(bio_src);
-    }
-    *allocated_page = page;
-
-    return bio_ret;
-
-size_err:
-    kfree(page);
-
-page_err:
-    bio_endio(bio_ret);
-
-alloc_err:
-    return NULL;
-}
-
 /**
  * Initialize an afs_map_request struct.
  * Returns NULL on error.
  *
+ * Requests which belong to a bio are handed in from the per-bio data
+ * of that bio. Requests without one (rebuilds) are taken from the
+ * instance request pool.
+ *
  * @context: AFS private context struct.
+ * @req:     Request from the per-bio data, or NULL.
  * 
  * @return afs_map_request struct pointer.
  */
 static struct afs_map_request*
-init_request(struct afs_private *context) {
-    struct afs_map_request *req;
+init_request(struct afs_private *context, struct afs_map_request *req) {
     int i;
 
-    req = kmalloc(sizeof(*req), GFP_KERNEL);
-    if(req == NULL){
-        return req;
+    if (req == NULL) {
+        req = mempool_alloc(&context->req_pool, GFP_NOIO);
+        if (req == NULL) {
+            return req;
+        }
     }
     
     req->afs_context = context;
+    req->bio = NULL;
+    req->parent = NULL;
+    req->num_blocks = 1;
+    atomic_set(&req->blocks_pending, 1);
+    req->status = BLK_STS_OK;
+    req->epoch = 0;
+    req->bio_offset = 0;
     req->bdev = context->bdev;
-    req->map = context->afs_map;
+    req->map = &context->afs_map;
     req->config = &context->config;
     req->fs = &context->passive_fs;
     req->vector = &context->vector;
-    req->allocated_write_page = NULL;
     req->encoder = NULL;
+    req->map_page = NULL;
     req->num_erasures = 0;
+    req->carriers_read = 0;
+    req->carrier_errors = 0;
+    req->carriers_valid = 0;
+    req->read_mode = READ_MODE_FULL;
+    req->hedge = NULL;
+    req->flush = NULL;
+    req->scrub = NULL;
+    req->repair = NULL;
+    req->carriers_lost = 0;
+    req->rmw = false;
+    req->allocated = false;
+    req->prefetch = false;
+    req->next_child = 0;
+    req->cpu = raw_smp_processor_id();
     req->encoding_type = context->encoding_type;
     memcpy(req->iv, context->passphrase_hash, 16);
     atomic_set(&req->rebuild_flag, 0);
     spin_lock_init(&req->req_lock);
     atomic64_set(&req->state, REQ_STATE_GROUND);
-    for(i = 0; i < req->config->num_carrier_blocks; i++) {
-        req->carrier_blocks[i] = (uint8_t*)__get_free_page(GFP_KERNEL);
+    afs_block_lock_init(&req->lock, afs_lockq);
+    INIT_LIST_HEAD(&req->batch);
+
+    // Pages are only acquired once the request knows it needs them.
+    req->data_block = NULL;
+    for(i = 0; i < NUM_MAX_CARRIER_BLKS; i++) {
+        req->carrier_blocks[i] = NULL;
     }
 
     return req;
@@ -353,26 +666,245 @@ static void print_bio_info(struct bio *bio){
 }
 
 /**
- * Iterate through the Map and rebuild blocks one by one
+ * Start rebuilding a block for the scrubber or the repair queue, once
+ * the lock on it is free. Blocks that were never written have nothing
+ * to verify.
+ *
+ * @return  0  Rebuild started.
+ * @return  1  Block not mapped, or its map entry could not be read.
  */
 static int
-afs_rebuild(struct dm_target *ti){
-    int i = 0;
-    struct afs_private *context = ti->private;
+afs_rebuild_issue(struct afs_private *context, uint32_t block, struct afs_scrub *scrub, struct afs_repair *repair)
+{
     struct afs_map_request *req = NULL;
 
-    for(i = 0; i < context->config.num_blocks; i++){
-        req = init_request(context);
-        req->block = i;
-	req->sector_offset = 0;
-	req->request_size = AFS_BLOCK_SIZE;
+    if (afs_map_mapped(&context->afs_map, block) <= 0) {
+        return 1;
+    }
+
+    req = init_request(context, NULL);
+    req->block = block;
+    req->sector_offset = 0;
+    req->request_size = AFS_BLOCK_SIZE;
+    req->scrub = scrub;
+    req->repair = repair;
 
-	req->eq = &context->rebuild_eq;
-	INIT_WORK(&req->req_ws, afs_rebuildq);
-	queue_work(context->rebuild_wq, &req->req_ws);
+    afs_block_lock_init(&req->lock, afs_rebuild_lockq);
+    if (afs_block_lock(&context->locks, &req->lock, req->block)) {
+        afs_rebuild_block(req);
     }
     return 0;
-};
+}
+
+/**
+ * Scrub a single block.
+ */
+static int
+afs_scrub_issue(struct afs_scrub *scrub, uint32_t block)
+{
+    return afs_rebuild_issue(container_of(scrub, struct afs_private, scrub), block, scrub, NULL);
+}
+
+/**
+ * Repair a single block.
+ */
+static int
+afs_repair_issue(struct afs_repair *repair, uint32_t block)
+{
+    return afs_rebuild_issue(container_of(repair, struct afs_private, repair), block, NULL, repair);
+}
+
+/**
+ * Save the scrub checkpoint in the aux block.
+ */
+static void
+afs_scrub_checkpoint(struct afs_scrub *scrub, uint32_t checkpoint, uint64_t passes)
+{
+    struct afs_private *context = container_of(scrub, struct afs_private, scrub);
+    int ret;
+
+    mutex_lock(&context->aux_lock);
+    context->aux_block.scrub_cursor = checkpoint;
+    context->aux_block.scrub_passes = passes;
+    ret = afs_write_aux_block(context);
+    mutex_unlock(&context->aux_lock);
+    if (ret) {
+        afs_alert("could not save scrub checkpoint [%d:%u]", ret, checkpoint);
+    }
+}
+
+/**
+ * Write back the blocks that are dirty in the cache, and wait for them
+ * to reach the disk. Blocks that get dirty while this runs are left for
+ * the next writeback.
+ */
+static int
+afs_writeback(struct afs_private *context)
+{
+    struct afs_map_request *req = NULL;
+    struct afs_flight_run run;
+    struct afs_flush flush;
+    uint32_t nr_dirty;
+    uint32_t i;
+
+    atomic_set(&flush.pending, 1);
+    init_completion(&flush.done);
+    flush.status = BLK_STS_OK;
+
+    // Dirty blocks are picked oldest first, and a picked block goes to
+    // the back, so these are all blocks dirty right now.
+    nr_dirty = READ_ONCE(context->cache.nr_dirty);
+
+    // Blocks are spread over the crypto queue like a large write. The
+    // contents of a block are only taken once its lock is held, in
+    // afs_write_request().
+    afs_flight_run_init(&run, true);
+    for (i = 0; i < nr_dirty; i++) {
+        req = init_request(context, NULL);
+        if (!afs_cache_next_dirty(&context->cache, &req->block)) {
+            mempool_free(req, &context->req_pool);
+            break;
+        }
+        req->sector_offset = 0;
+        req->request_size = AFS_BLOCK_SIZE;
+        req->flush = &flush;
+        atomic_inc(&flush.pending);
+
+        if (afs_block_lock(&context->locks, &req->lock, req->block)) {
+            afs_flight_run_add(context, &run, req);
+        }
+    }
+    afs_flight_run_finish(&run);
+
+    afs_flush_put(&flush, BLK_STS_OK);
+    wait_for_completion(&flush.done);
+    return blk_status_to_errno(flush.status);
+}
+
+/**
+ * Delayed writeback of dirty blocks.
+ */
+static void
+afs_writebackq(struct work_struct *ws)
+{
+    struct afs_private *context = container_of(to_delayed_work(ws), struct afs_private, writeback_dw);
+    int ret;
+
+    ret = afs_writeback(context);
+    if (ret) {
+        afs_alert("writeback failed [%d]", ret);
+    }
+}
+
+/**
+ * Delayed write of dirty map blocks.
+ */
+static void
+afs_mapq(struct work_struct *ws)
+{
+    struct afs_private *context = container_of(to_delayed_work(ws), struct afs_private, map_dw);
+
+    afs_map_flush(context);
+}
+
+/**
+ * Scan of the map blocks after mount. Allocations wait for it.
+ */
+static void
+afs_scanq(struct work_struct *ws)
+{
+    struct afs_private *context = container_of(ws, struct afs_private, scan_ws);
+    int ret;
+
+    ret = afs_scan_map(context);
+    if (ret) {
+        afs_alert("could not scan Artifice map, no blocks can be allocated [%d]", ret);
+    }
+    allocation_apply_frees(&context->vector);
+    WRITE_ONCE(context->scan_err, ret);
+    complete_all(&context->scanned);
+}
+
+/**
+ * Stop the scan of the map blocks. Anybody still waiting for it gives
+ * up.
+ */
+static void
+afs_scan_stop(struct afs_private *context)
+{
+    WRITE_ONCE(context->scan_stop, true);
+    cancel_work_sync(&context->scan_ws);
+    allocation_apply_frees(&context->vector);
+    if (!completion_done(&context->scanned)) {
+        WRITE_ONCE(context->scan_err, -EINTR);
+        complete_all(&context->scanned);
+    }
+}
+
+/**
+ * Delayed commit of the log.
+ */
+static void
+afs_logq(struct work_struct *ws)
+{
+    struct afs_private *context = container_of(to_delayed_work(ws), struct afs_private, log_dw);
+
+    afs_log_commit(&context->log);
+}
+
+/**
+ * Flush queue. Once the writes submitted before the flush have completed
+ * and dirty blocks are written back, the map updates are committed to
+ * the log and the flush is passed on to the passive device. Flushes run
+ * one at a time on the ordered writeback queue.
+ */
+static void
+afs_flushq(struct work_struct *ws)
+{
+    struct afs_map_request *req = container_of(ws, struct afs_map_request, req_ws);
+    struct afs_private *context = req->afs_context;
+    struct bio *bio = req->bio;
+    int ret;
+
+    afs_inflight_drain(&context->inflight);
+    ret = afs_writeback(context);
+    if (!ret) {
+        ret = afs_map_commit(context);
+    }
+    bio->bi_status = errno_to_blk_status(ret);
+    bio_endio(bio);
+}
+
+/**
+ * Complete a bio from the block cache if possible.
+ */
+static bool
+afs_map_cached(struct afs_private *context, struct bio *bio)
+{
+    uint64_t start_ns = ktime_get_ns();
+
+    switch (bio_op(bio)) {
+    case REQ_OP_READ:
+        if (!afs_cache_read_bio(&context->cache, bio)) {
+            return false;
+        }
+        afs_stats_read_latency(&context->stats, start_ns);
+        break;
+
+    case REQ_OP_WRITE:
+        // FUA writes have to be on the disk before they complete.
+        if ((bio->bi_opf & REQ_FUA) || !afs_cache_write_bio(&context->cache, bio)) {
+            return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    bio_endio(bio);
+    return true;
+}
 
 /**
  * Map function for this target. This is the heart and soul
@@ -402,21 +934,15 @@ afs_map(struct dm_target *ti, struct bio *bio) {
     struct afs_private *context = ti->private;
     struct afs_map_request *req = NULL;
     uint32_t sector_offset;
-    uint32_t max_sector_count;
+    uint32_t num_blocks;
     int ret;
 
-
-    // We only support bio's with a maximum length of 8 sectors (4KB).
-    // Moreover, we only support processing a single block per bio.
-    // Hence, a request such as (length: 4KB, sector: 1) crosses
-    // a block boundary and involves two blocks. For all such requests,
-    // we truncate the bio to within the single page.
-
+    // A bio may cover several blocks (device-mapper splits it at
+    // AFS_MAX_REQ_BLKS), and need not start or end on a block boundary.
+    // The request in the per-bio data covers the first, possibly partial,
+    // block and the remaining blocks are handled as children of it.
     sector_offset = bio->bi_iter.bi_sector % (AFS_SECTORS_PER_BLOCK);
-    max_sector_count = (AFS_SECTORS_PER_BLOCK) - sector_offset;
-    if (bio_sectors(bio) > max_sector_count) {
-        dm_accept_partial_bio(bio, max_sector_count);
-    }
+    num_blocks = DIV_ROUND_UP((sector_offset * AFS_SECTOR_SIZE) + bio->bi_iter.bi_size, AFS_BLOCK_SIZE);
 
     if (override) {
         bio_set_dev(bio, context->bdev);
@@ -425,32 +951,67 @@ afs_map(struct dm_target *ti, struct bio *bio) {
         return DM_MAPIO_SUBMITTED;
     }
 
-    req = init_request(context);
-    afs_action(req, ret = DM_MAPIO_KILL, done, "could not allocate memory for request");
+    // Flushes arrive as empty writes. They have to wait for the writes
+    // before them, so they are never handled inline.
+    if ((bio->bi_opf & REQ_PREFLUSH) && !bio_has_data(bio)) {
+        req = init_request(context, dm_per_bio_data(bio, sizeof(*req)));
+        req->bio = bio;
+        INIT_WORK(&req->req_ws, afs_flushq);
+        queue_work(context->writeback_wq, &req->req_ws);
+        return DM_MAPIO_SUBMITTED;
+    }
 
     switch (bio_op(bio)) {
     case REQ_OP_READ:
     case REQ_OP_WRITE:
-        req->bio = __clone_bio(bio, &req->allocated_write_page, true);
-        afs_action(req->bio, ret = DM_MAPIO_KILL, done, "could not clone bio");
+    case REQ_OP_WRITE_ZEROES:
+        // Streams are followed through reads served by the cache too,
+        // those are the ones prefetching pays off for.
+        if (bio_op(bio) == REQ_OP_READ && afs_prefetch_read(&context->prefetch, bio->bi_iter.bi_sector / AFS_SECTORS_PER_BLOCK, num_blocks)) {
+            queue_work(context->flight_wq, &context->prefetch_ws);
+        }
 
+        // Blocks in the cache need neither carriers nor coding, so the
+        // bio is completed right here.
+        if (afs_map_cached(context, bio)) {
+            ret = DM_MAPIO_SUBMITTED;
+            break;
+        }
+
+        req = init_request(context, dm_per_bio_data(bio, sizeof(*req)));
+        req->bio = bio;
+        req->start_ns = ktime_get_ns();
         req->block = bio->bi_iter.bi_sector / AFS_SECTORS_PER_BLOCK;
-        req->sector_offset = bio->bi_iter.bi_sector % (AFS_BLOCK_SIZE / AFS_SECTOR_SIZE);
-        req->request_size = bio_sectors(bio) * AFS_SECTOR_SIZE;
+        req->sector_offset = sector_offset;
+        req->request_size = min_t(uint32_t, bio->bi_iter.bi_size, AFS_BLOCK_SIZE - (sector_offset * AFS_SECTOR_SIZE));
+        req->num_blocks = num_blocks;
+        atomic_set(&req->blocks_pending, num_blocks);
+        if (op_is_write(bio_op(bio))) {
+            req->epoch = afs_inflight_start(&context->inflight);
+        }
 
-        req->eq = &context->flight_eq;
-        INIT_WORK(&req->req_ws, afs_flightq);
-        queue_work(context->flight_wq, &req->req_ws);
+        // A read only has to issue its carrier bios, which is done right
+        // here unless the submitter cannot wait for memory. Writes are
+        // CPU bound in the encode and go through the flight queue.
+        if (bio_op(bio) == REQ_OP_READ && !(bio->bi_opf & REQ_NOWAIT)) {
+            afs_flight_bio(req);
+        } else {
+            INIT_WORK(&req->req_ws, afs_flightq);
+            queue_work(context->flight_wq, &req->req_ws);
+        }
 
         ret = DM_MAPIO_SUBMITTED;
         break;
 
-    case REQ_OP_FLUSH:
-        while (afs_eq_req_exist(&context->flight_eq, bio)) {
-            afs_debug("stuck waiting for flush");
-            msleep(1);
-        }
-        bio_endio(bio);
+    case REQ_OP_DISCARD:
+        req = init_request(context, dm_per_bio_data(bio, sizeof(*req)));
+        req->bio = bio;
+        req->epoch = afs_inflight_start(&context->inflight);
+        req->block = DIV_ROUND_UP_ULL(bio->bi_iter.bi_sector, AFS_SECTORS_PER_BLOCK);
+        afs_block_lock_init(&req->lock, afs_discard_lockq);
+
+        INIT_WORK(&req->req_ws, afs_discardq);
+        queue_work(context->flight_wq, &req->req_ws);
         ret = DM_MAPIO_SUBMITTED;
         break;
 
@@ -459,13 +1020,6 @@ afs_map(struct dm_target *ti, struct bio *bio) {
         ret = DM_MAPIO_KILL;
     }
 
-done:
-    if (ret == DM_MAPIO_KILL) {
-        bio_endio(bio);
-        if (req) {
-            kfree(req);
-        }
-    }
     return ret;
 }
 
@@ -506,11 +1060,17 @@ afs_ctr(struct dm_target *ti, unsigned int argc, char **argv)
     // Confirm our structure sizes.
     afs_action(sizeof(*sb) == AFS_BLOCK_SIZE, ret = -EINVAL, err, "super block structure incorrect size [%lu]", sizeof(*sb));
     afs_action(sizeof(struct afs_ptr_block) == AFS_BLOCK_SIZE, ret = -EINVAL, err, "pointer block structure incorrect size [%lu]", sizeof(struct afs_ptr_block));
+    afs_action(sizeof(struct afs_aux_block) == AFS_BLOCK_SIZE, ret = -EINVAL, err, "aux block structure incorrect size [%lu]", sizeof(struct afs_aux_block));
 
     context = kmalloc(sizeof(*context), GFP_KERNEL);
     afs_action(context, ret = -ENOMEM, err, "kmalloc failure [%d]", ret);
     memset(context, 0, sizeof(*context));
     context->config.instance_size = instance_size;
+    mutex_init(&context->aux_lock);
+    init_waitqueue_head(&context->hedges_wait);
+    afs_log_init(&context->log);
+    INIT_WORK(&context->scan_ws, afs_scanq);
+    init_completion(&context->scanned);
 
     // Parge instance arguments.
     args = &context->args;
@@ -572,13 +1132,14 @@ afs_ctr(struct dm_target *ti, unsigned int argc, char **argv)
     context->vector.vector = bit_vector_create((uint64_t)U32_MAX);
     afs_action(context->vector.vector, ret = -ENOMEM, vec_err, "could not allocate allocation vector");
     spin_lock_init(&context->vector.lock);
+    INIT_LIST_HEAD(&context->vector.deferred);
     allocation_set(&context->vector, AFS_INVALID_BLOCK);
 
     sb = &context->super_block;
     switch (args->instance_type) {
     case TYPE_CREATE:
         // TODO: Acquire carrier block count from RS parameters.
-        build_configuration(context, 4, 1);
+        build_configuration(context, 4, 1, AFS_MAP_COMPACT);
         ret = write_super_block(sb, fs, context);
         afs_assert(!ret, sb_err, "could not write super block [%d]", ret);
         break;
@@ -593,32 +1154,147 @@ afs_ctr(struct dm_target *ti, unsigned int argc, char **argv)
         break;
     }
     afs_debug("List length %d", fs->list_len);
+
+    // Requests for bios are carried in the per-bio data, everything else
+    // a request needs comes out of the instance pools.
+    ti->per_io_data_size = sizeof(struct afs_map_request);
+    ret = dm_set_target_max_io_len(ti, AFS_MAX_REQ_BLKS * AFS_SECTORS_PER_BLOCK);
+    afs_assert(!ret, fwq_err, "could not set maximum I/O length [%d]", ret);
+    ret = mempool_init_slab_pool(&context->req_pool, AFS_MIN_POOL_REQS, afs_req_cache);
+    afs_assert(!ret, pool_err, "could not create request pool [%d]", ret);
+    ret = mempool_init_page_pool(&context->page_pool, AFS_MIN_POOL_REQS * (context->config.num_carrier_blocks + 1), 0);
+    afs_assert(!ret, pool_err, "could not create page pool [%d]", ret);
+    ret = mempool_init_kmalloc_pool(&context->hedge_pool, AFS_MIN_POOL_REQS, sizeof(struct afs_hedge));
+    afs_assert(!ret, pool_err, "could not create hedge pool [%d]", ret);
+    // Reads allocate carrier bios from the map function, where bios already
+    // submitted wait until it returns, so the bio set needs a rescuer.
+    ret = bioset_init(&context->carrier_bs, AFS_MIN_POOL_REQS * context->config.num_carrier_blocks, offsetof(struct afs_carrier_bio, bio), BIOSET_NEED_RESCUER);
+    afs_assert(!ret, pool_err, "could not create carrier bio set [%d]", ret);
+    ret = afs_submit_init(&context->submit, !blk_queue_nonrot(bdev_get_queue(context->bdev)));
+    afs_assert(!ret, pool_err, "could not create submit queue [%d]", ret);
+    afs_debug("sorted carrier submission: %d", context->submit.sorted);
+    mutex_init(&context->page_pool_lock);
+    ret = afs_cache_init(&context->cache, args->cache_blocks);
+    afs_assert(!ret, pool_err, "could not create block cache [%d]", ret);
+
     // We are now ready to process map requests.
     //afs_action(!IS_ERR(context->ground_wq), ret = PTR_ERR(context->ground_wq), gwq_err, "could not create gwq [%d]", ret);
 
     context->flight_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, num_online_cpus(), "Artifice Flight WQ");
-    context->rebuild_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 2, "Artifice Rebuild WQ");
-    context->crypto_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, num_online_cpus(), "Artifice Crypt WQ");
+    // Scrubs and repairs are background work, and never run ahead of
+    // foreground requests.
+    context->rebuild_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 2, "Artifice Rebuild WQ");
+    // Per-CPU queue, reads are decoded where they were mapped.
+    context->cpu_wq = alloc_workqueue("%s", WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0, "Artifice CPU WQ");
+    afs_action(context->cpu_wq, ret = -ENOMEM, pool_err, "could not create cpu wq [%d]", ret);
+
+    // The crypto queue shows up in sysfs, so the CPUs encoding and decoding
+    // blocks can be picked through its cpumask.
+    context->crypto_wq = alloc_workqueue("afs_crypt_%s", WQ_UNBOUND | WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM | WQ_SYSFS, num_online_cpus(), dm_table_device_name(ti->table));
     //context->flight_wq = alloc_ordered_workqueue("%s", WQ_HIGHPRI, "Artifice Flight WQ");
-    afs_action(!IS_ERR(context->flight_wq), ret = PTR_ERR(context->flight_wq), fwq_err, "could not create fwq [%d]", ret);
-    afs_action(!IS_ERR(context->rebuild_wq), ret = PTR_ERR(context->rebuild_wq), fwq_err, "could not create rebuild wq [%d]", ret);
-    afs_action(!IS_ERR(context->crypto_wq), ret = PTR_ERR(context->crypto_wq), fwq_err, "could not create crypto wq [%d]", ret);
+    afs_action(context->flight_wq, ret = -ENOMEM, pool_err, "could not create fwq [%d]", ret);
+    afs_action(context->rebuild_wq, ret = -ENOMEM, pool_err, "could not create rebuild wq [%d]", ret);
+    afs_action(context->crypto_wq, ret = -ENOMEM, pool_err, "could not create crypto wq [%d]", ret);
+    ret = afs_lock_table_init(&context->locks, context->flight_wq);
+    afs_assert(!ret, pool_err, "could not create block lock table [%d]", ret);
+
+    // Writebacks and flushes are handled one at a time.
+    context->writeback_wq = alloc_ordered_workqueue("%s", WQ_MEM_RECLAIM, "Artifice Writeback WQ");
+    afs_action(context->writeback_wq, ret = -ENOMEM, pool_err, "could not create writeback wq [%d]", ret);
+    INIT_DELAYED_WORK(&context->writeback_dw, afs_writebackq);
+    INIT_DELAYED_WORK(&context->map_dw, afs_mapq);
+    INIT_DELAYED_WORK(&context->log_dw, afs_logq);
+    mutex_init(&context->map_flush_lock);
+    context->map_flush_block = kmalloc(AFS_BLOCK_SIZE, GFP_KERNEL);
+    afs_action(context->map_flush_block, ret = -ENOMEM, pool_err, "could not allocate map flush block [%d]", ret);
+
+    // A mounted instance finds the carriers in use in the background,
+    // every carrier of a new one is allocated from here on.
+    if (args->instance_type == TYPE_MOUNT) {
+        allocation_defer_frees(&context->vector);
+        queue_work(context->rebuild_wq, &context->scan_ws);
+    } else {
+        complete_all(&context->scanned);
+    }
+
+    // Map blocks the log replayed into are checkpointed right away, so
+    // the log starts out empty. An instance without a log still works,
+    // with its map only written by checkpoints.
+    if (atomic_read(&context->afs_map.nr_dirty)) {
+        queue_delayed_work(context->writeback_wq, &context->map_dw, 0);
+    }
+    ret = afs_create_log(context);
+    if (ret) {
+        afs_alert("no log, map updates are only kept by checkpoints [%d]", ret);
+    }
+    if (args->write_mode == WRITE_MODE_BACK) {
+        afs_cache_set_writeback(&context->cache, context->writeback_wq, &context->writeback_dw, msecs_to_jiffies(AFS_WRITEBACK_DELAY_MS));
+    }
+    afs_inflight_init(&context->inflight);
+
+    // Prefetched blocks wait on probation, a window larger than half of
+    // it would evict its own blocks before the stream gets to them.
+    afs_prefetch_init(&context->prefetch, min_t(uint32_t, args->prefetch_blocks, context->cache.limits[AFS_CACHE_PROBATION] / 2), context->config.num_blocks);
+    INIT_WORK(&context->prefetch_ws, afs_prefetchq);
 
-    afs_eq_init(&context->flight_eq);
-    afs_eq_init(&context->rebuild_eq);
+    // A mounted instance may have been damaged while it was away, the
+    // scrubber goes over it from where it last stopped.
+    afs_scrub_init(&context->scrub, context->rebuild_wq, context->config.num_blocks, args->scrub_rate, afs_scrub_issue, afs_scrub_checkpoint);
+    afs_scrub_restore(&context->scrub, context->aux_block.scrub_cursor, context->aux_block.scrub_passes);
+    ret = afs_repair_init(&context->repair, context->rebuild_wq, context->config.num_blocks, afs_repair_issue);
+    afs_assert(!ret, pool_err, "could not create repair queue [%d]", ret);
+    ti->num_flush_bios = 1;
+
+    // Discards release carrier blocks, whether or not the passive device
+    // supports them.
+    ti->num_discard_bios = 1;
+    ti->discards_supported = true;
+
+    // Zeroed blocks are simply unmapped.
+    ti->num_write_zeroes_bios = 1;
 
     afs_debug("constructor completed");
     ti->private = context;
 
-    //Start the repair process if we are mounting an existing volume
-    if(args->instance_type == TYPE_MOUNT){
-        afs_rebuild(ti);
+    if (args->instance_type == TYPE_MOUNT) {
+        afs_scrub_start(&context->scrub);
     }
     return 0;
 
+pool_err:
+    afs_scan_stop(context);
+    if (context->writeback_wq) {
+        cancel_delayed_work_sync(&context->writeback_dw);
+        cancel_delayed_work_sync(&context->map_dw);
+        cancel_delayed_work_sync(&context->log_dw);
+        destroy_workqueue(context->writeback_wq);
+    }
+    if (context->flight_wq) {
+        destroy_workqueue(context->flight_wq);
+    }
+    if (context->rebuild_wq) {
+        destroy_workqueue(context->rebuild_wq);
+    }
+    if (context->crypto_wq) {
+        destroy_workqueue(context->crypto_wq);
+    }
+    if (context->cpu_wq) {
+        destroy_workqueue(context->cpu_wq);
+    }
+    kfree(context->map_flush_block);
+    afs_repair_exit(&context->repair);
+    afs_lock_table_exit(&context->locks);
+    afs_cache_exit(&context->cache);
+    afs_submit_exit(&context->submit);
+    bioset_exit(&context->carrier_bs);
+    mempool_exit(&context->hedge_pool);
+    mempool_exit(&context->page_pool);
+    mempool_exit(&context->req_pool);
+
 fwq_err:
+    afs_log_exit(&context->log);
     kfree(context->afs_ptr_blocks);
-    vfree(context->afs_map);
+    afs_free_map(context);
 
 sb_err:
     bit_vector_free(context->vector.vector);
@@ -649,29 +1325,48 @@ afs_dtr(struct dm_target *ti)
     struct afs_private *context = ti->private;
     int err;
 
-    // Wait for all requests to have processed. DO NOT busy wait.
-    while(!afs_eq_empty(&context->flight_eq) && !afs_eq_empty(&context->rebuild_eq)) {
-        msleep(1);
+    // No more streams are followed, and no more blocks scrubbed or
+    // repaired.
+    cancel_work_sync(&context->prefetch_ws);
+    afs_scan_stop(context);
+    afs_scrub_stop(&context->scrub);
+    afs_repair_stop(&context->repair);
+
+    // Wait for all requests to have processed, the last one to release
+    // its block wakes us up.
+    afs_lock_table_wait_idle(&context->locks);
+
+    // Late carriers of hedged reads still hold carrier bios and pages.
+    wait_event(context->hedges_wait, !atomic_read(&context->hedges));
+
+    // Dirty blocks have to be on the disk before the map describing them.
+    cancel_delayed_work_sync(&context->writeback_dw);
+    err = afs_writeback(context);
+    if (err) {
+        afs_alert("could not write back dirty blocks [%d]", err);
     }
 
-    // Update the Artifice map on the disk.
-    err = afs_create_map_blocks(context);
+    // Only the map blocks that changed since they were last written
+    // are left to update.
+    cancel_delayed_work_sync(&context->map_dw);
+    cancel_delayed_work_sync(&context->log_dw);
+    err = afs_map_flush(context);
+    cancel_delayed_work_sync(&context->map_dw);
     if (err) {
-        afs_alert("could not create Artifice map blocks [%d]", err);
-    } else {
-        err = write_map_blocks(context, true);
-        if (err) {
-            afs_alert("could not update Artifice map on disk [%d]", err);
-        }
-        vfree(context->afs_map_blocks);
+        afs_alert("could not update Artifice map on disk [%d]", err);
     }
-    
 
-    // Free the Artifice pointer blocks.
+    // Everything the scrubber issued has completed, and the map holds
+    // whatever it rebuilt.
+    afs_scrub_save(&context->scrub);
+
+    // Free the log, the Artifice pointer blocks and the map flush block.
+    afs_log_exit(&context->log);
     kfree(context->afs_ptr_blocks);
+    kfree(context->map_flush_block);
 
     // Free the Artifice map.
-    vfree(context->afs_map);
+    afs_free_map(context);
 
     // Free the bit vector allocation.
     bit_vector_free(context->vector.vector);
@@ -686,12 +1381,187 @@ afs_dtr(struct dm_target *ti)
     destroy_workqueue(context->flight_wq);
     destroy_workqueue(context->rebuild_wq);
     destroy_workqueue(context->crypto_wq);
+    destroy_workqueue(context->cpu_wq);
+    destroy_workqueue(context->writeback_wq);
+
+    // Release the repair queue, the block cache, the lock table, the
+    // request pools, the submit queue and the carrier bio set.
+    afs_repair_exit(&context->repair);
+    afs_lock_table_exit(&context->locks);
+    afs_cache_exit(&context->cache);
+    afs_submit_exit(&context->submit);
+    bioset_exit(&context->carrier_bs);
+    mempool_exit(&context->hedge_pool);
+    mempool_exit(&context->page_pool);
+    mempool_exit(&context->req_pool);
 
     // Free storage used by context.
     kfree(context);
     afs_debug("destructor completed");
 }
 
+/**
+ * Status function for this target. Reports read statistics and
+ * the table line the instance was created with.
+ *
+ * @ti      Target instance.
+ * @type    Kind of status requested.
+ * @result  Buffer to write the status into.
+ * @maxlen  Size of the buffer.
+ */
+static void
+afs_status(struct dm_target *ti, status_type_t type, unsigned status_flags, char *result, unsigned maxlen)
+{
+    struct afs_private *context = ti->private;
+    struct afs_stats *stats = &context->stats;
+    struct afs_args *args = &context->args;
+    static const char *read_modes[] = { "full", "threshold", "hedged" };
+    unsigned sz = 0;
+
+    switch (type) {
+    case STATUSTYPE_INFO:
+        DMEMIT("reads %lld p50_us %llu p99_us %llu parity_reads %lld hedged_reads %lld late_carriers %lld rmw_reads %lld",
+            atomic64_read(&stats->reads),
+            afs_stats_read_percentile(stats, 50),
+            afs_stats_read_percentile(stats, 99),
+            atomic64_read(&stats->parity_reads),
+            atomic64_read(&stats->hedged_reads),
+            atomic64_read(&stats->late_carriers),
+            atomic64_read(&stats->rmw_reads));
+        DMEMIT(" prefetches %lld", atomic64_read(&stats->prefetches));
+        DMEMIT(" cache_blocks %u cache_hits %llu cache_misses %llu",
+            READ_ONCE(context->cache.count),
+            READ_ONCE(context->cache.hits),
+            READ_ONCE(context->cache.misses));
+        DMEMIT(" scrub %s scrub_cursor %u/%u scrubbed %llu repaired %llu scrub_errors %llu scrub_passes %llu",
+            READ_ONCE(context->scrub.running) ? "running" : "paused",
+            READ_ONCE(context->scrub.cursor),
+            context->scrub.num_blocks,
+            READ_ONCE(context->scrub.scrubbed),
+            READ_ONCE(context->scrub.repaired),
+            READ_ONCE(context->scrub.errors),
+            READ_ONCE(context->scrub.passes));
+        DMEMIT(" repairs_queued %u repairs %llu repair_errors %llu",
+            READ_ONCE(context->repair.nr_pending),
+            READ_ONCE(context->repair.repaired),
+            READ_ONCE(context->repair.errors));
+        DMEMIT(" log_commits %llu log_replayed %llu",
+            READ_ONCE(context->log.commits),
+            READ_ONCE(context->log.replayed));
+        DMEMIT(" map_format %s map_bytes %zu",
+            (context->config.map_format == AFS_MAP_COMPACT) ? "compact" : "legacy",
+            afs_map_size(&context->afs_map));
+        DMEMIT(" map_cached %u/%u map_hits %llu map_misses %llu map_scan %u/%u",
+            READ_ONCE(context->afs_map.count),
+            context->afs_map.capacity,
+            READ_ONCE(context->afs_map.hits),
+            READ_ONCE(context->afs_map.misses),
+            READ_ONCE(context->scan_cursor),
+            context->config.num_map_blocks);
+        break;
+
+    case STATUSTYPE_TABLE:
+        // Never leak the passphrase.
+        DMEMIT("%u - %s --read_mode %s", args->instance_type, args->passive_dev, read_modes[args->read_mode]);
+        if (args->hedge_width) {
+            DMEMIT(" --hedge_width %u", args->hedge_width);
+        }
+        DMEMIT(" --cache_blocks %u", args->cache_blocks);
+        DMEMIT(" --prefetch_blocks %u", args->prefetch_blocks);
+        DMEMIT(" --scrub_rate %u", args->scrub_rate);
+        DMEMIT(" --map_cache_blocks %u", args->map_cache_blocks);
+        if (args->write_mode == WRITE_MODE_BACK) {
+            DMEMIT(" --write_mode back");
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * Message function for this target. Controls the scrubber:
+ *
+ *   scrub start      Start a pass, or continue the current one.
+ *   scrub pause      Stop issuing blocks, the position is kept.
+ *   scrub rate <n>   Scrub n blocks per second, zero for no limit.
+ *
+ * @ti      Target instance.
+ * @argc    Number of words in the message.
+ * @argv    Words of the message.
+ * @result  Buffer for a reply, unused.
+ * @maxlen  Size of the buffer.
+ */
+static int
+afs_message(struct dm_target *ti, unsigned argc, char **argv, char *result, unsigned maxlen)
+{
+    struct afs_private *context = ti->private;
+    uint32_t rate;
+
+    if (argc < 2 || strcasecmp(argv[0], "scrub")) {
+        return -EINVAL;
+    }
+
+    if (argc == 2 && !strcasecmp(argv[1], "start")) {
+        afs_scrub_start(&context->scrub);
+    } else if (argc == 2 && !strcasecmp(argv[1], "pause")) {
+        afs_scrub_pause(&context->scrub);
+    } else if (argc == 3 && !strcasecmp(argv[1], "rate")) {
+        if (kstrtou32(argv[2], 10, &rate)) {
+            return -EINVAL;
+        }
+        context->args.scrub_rate = rate;
+        afs_scrub_set_rate(&context->scrub, rate);
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * I/O hints for this target. Discards are only useful in whole blocks,
+ * and zeroing goes through the write path one block at a time.
+ *
+ * @ti      Target instance.
+ * @limits  Queue limits to adjust.
+ */
+static void
+afs_io_hints(struct dm_target *ti, struct queue_limits *limits)
+{
+    limits->discard_granularity = AFS_BLOCK_SIZE;
+    limits->max_discard_sectors = AFS_MAX_DISCARD_BLKS * AFS_SECTORS_PER_BLOCK;
+    limits->max_hw_discard_sectors = AFS_MAX_DISCARD_BLKS * AFS_SECTORS_PER_BLOCK;
+    limits->max_write_zeroes_sectors = AFS_MAX_REQ_BLKS * AFS_SECTORS_PER_BLOCK;
+}
+
+/**
+ * Post suspend function for this target. Once I/O has stopped, dirty
+ * blocks are written back so that whatever comes after the suspend
+ * finds them on the disk.
+ *
+ * @ti  Target instance being suspended.
+ */
+static void
+afs_postsuspend(struct dm_target *ti)
+{
+    struct afs_private *context = ti->private;
+    int ret;
+
+    cancel_delayed_work_sync(&context->writeback_dw);
+    ret = afs_writeback(context);
+    if (ret) {
+        afs_alert("could not write back dirty blocks [%d]", ret);
+    }
+
+    // So does the map describing them.
+    cancel_delayed_work_sync(&context->map_dw);
+    ret = afs_map_flush(context);
+    if (ret) {
+        afs_alert("could not update Artifice map on disk [%d]", ret);
+    }
+}
+
 /** ----------------------------------------------------------- DO-NOT-CROSS ------------------------------------------------------------------- **/
 
 static struct target_type afs_target = {
@@ -700,7 +1570,11 @@ static struct target_type afs_target = {
     .module = THIS_MODULE,
     .ctr = afs_ctr,
     .dtr = afs_dtr,
-    .map = afs_map
+    .map = afs_map,
+    .postsuspend = afs_postsuspend,
+    .io_hints = afs_io_hints,
+    .status = afs_status,
+    .message = afs_message
 };
 
 /**
@@ -716,8 +1590,11 @@ afs_init(void)
 {
     int ret;
 
+    afs_req_cache = KMEM_CACHE(afs_map_request, 0);
+    afs_action(afs_req_cache, ret = -ENOMEM, done, "could not create request cache [%d]", ret);
+
     ret = dm_register_target(&afs_target);
-    afs_assert(ret >= 0, done, "registration failed [%d]", ret);
+    afs_action(ret >= 0, kmem_cache_destroy(afs_req_cache), done, "registration failed [%d]", ret);
     afs_debug("registration successful");
 
 done:
@@ -736,6 +1613,7 @@ static void
 afs_exit(void)
 {
     dm_unregister_target(&afs_target);
+    kmem_cache_destroy(afs_req_cache);
     afs_debug("unregistered dm_afs");
 }
 
@@ -5,7 +5,16 @@
 #include <dm_afs.h>
 #include <dm_afs_modules.h>
 #include <linux/random.h>
+#include <linux/slab.h>
 
+// A page of blocks freed while frees are deferred.
+struct afs_deferred_frees {
+    struct list_head list;
+    uint32_t count;
+    uint32_t blocks[];
+};
+
+#define AFS_DEFERRED_PER_PAGE ((PAGE_SIZE - sizeof(struct afs_deferred_frees)) / sizeof(uint32_t))
 
 /**
  * Pick an index at random within the allocation vector
@@ -59,10 +68,10 @@ err:
 }
 
 /**
- * Clear the usage of a block in the allocation vector.
+ * Clear a block in the bit vector.
  */
-void
-allocation_free(struct afs_allocation_vector *vector, uint32_t index)
+static void
+allocation_clear(struct afs_allocation_vector *vector, uint32_t index)
 {
     int ret = bit_vector_clear(vector->vector, index);
 
@@ -72,31 +81,168 @@ allocation_free(struct afs_allocation_vector *vector, uint32_t index)
     }
 }
 
+/**
+ * Free a block, or keep it on the deferred list. Lock must be held.
+ *
+ * Without memory for the list the block is cleared after all, at worst
+ * the scan marks it used again until the next mount.
+ */
+static void
+allocation_free_locked(struct afs_allocation_vector *vector, uint32_t index)
+{
+    struct afs_deferred_frees *frees = NULL;
+
+    if (!vector->deferring) {
+        allocation_clear(vector, index);
+        return;
+    }
+
+    if (!list_empty(&vector->deferred)) {
+        frees = list_last_entry(&vector->deferred, struct afs_deferred_frees, list);
+    }
+    if (!frees || frees->count == AFS_DEFERRED_PER_PAGE) {
+        frees = kmalloc(PAGE_SIZE, GFP_ATOMIC | __GFP_NOWARN);
+        if (!frees) {
+            allocation_clear(vector, index);
+            return;
+        }
+        frees->count = 0;
+        list_add_tail(&frees->list, &vector->deferred);
+    }
+    frees->blocks[frees->count++] = index;
+}
+
+/**
+ * Clear the usage of a block in the allocation vector. May be called from
+ * any context.
+ */
+void
+allocation_free(struct afs_allocation_vector *vector, uint32_t index)
+{
+    unsigned long flags;
+
+    if (!READ_ONCE(vector->deferring)) {
+        allocation_clear(vector, index);
+        return;
+    }
+
+    spin_lock_irqsave(&vector->lock, flags);
+    allocation_free_locked(vector, index);
+    spin_unlock_irqrestore(&vector->lock, flags);
+}
+
+/**
+ * Clear the usage of several blocks in the allocation vector at once.
+ */
+void
+allocation_free_many(struct afs_allocation_vector *vector, uint32_t *blocks, uint32_t num_blocks)
+{
+    unsigned long flags;
+    uint32_t i;
+
+    spin_lock_irqsave(&vector->lock, flags);
+    for (i = 0; i < num_blocks; i++) {
+        allocation_free_locked(vector, blocks[i]);
+    }
+    spin_unlock_irqrestore(&vector->lock, flags);
+}
+
+/**
+ * Keep blocks freed from now on set, until allocation_apply_frees().
+ */
+void
+allocation_defer_frees(struct afs_allocation_vector *vector)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&vector->lock, flags);
+    WRITE_ONCE(vector->deferring, true);
+    spin_unlock_irqrestore(&vector->lock, flags);
+}
+
+/**
+ * Clear the blocks freed since allocation_defer_frees(), and clear freed
+ * blocks right away again.
+ */
+void
+allocation_apply_frees(struct afs_allocation_vector *vector)
+{
+    struct afs_deferred_frees *frees, *next;
+    unsigned long flags;
+    uint32_t i;
+    LIST_HEAD(deferred);
+
+    spin_lock_irqsave(&vector->lock, flags);
+    WRITE_ONCE(vector->deferring, false);
+    list_splice_init(&vector->deferred, &deferred);
+    spin_unlock_irqrestore(&vector->lock, flags);
+
+    list_for_each_entry_safe (frees, next, &deferred, list) {
+        for (i = 0; i < frees->count; i++) {
+            allocation_clear(vector, frees->blocks[i]);
+        }
+        list_del(&frees->list);
+        kfree(frees);
+    }
+}
+
+/**
+ * Take a block freed since allocation_defer_frees(), it stays set.
+ * Returns AFS_INVALID_BLOCK without one.
+ */
+uint32_t
+allocation_take_freed(struct afs_allocation_vector *vector)
+{
+    struct afs_deferred_frees *frees;
+    uint32_t ret = AFS_INVALID_BLOCK;
+    unsigned long flags;
+
+    if (!READ_ONCE(vector->deferring)) {
+        return ret;
+    }
+
+    spin_lock_irqsave(&vector->lock, flags);
+    if (!list_empty(&vector->deferred)) {
+        frees = list_last_entry(&vector->deferred, struct afs_deferred_frees, list);
+        ret = frees->blocks[--frees->count];
+        if (!frees->count) {
+            list_del(&frees->list);
+            kfree(frees);
+        }
+    }
+    spin_unlock_irqrestore(&vector->lock, flags);
+    return ret;
+}
+
 /**
  * Acquire a free block from the free list.
  * TODO just have it randomly select a block
+ *
+ * The allocation vector is indexed by block number, the same as the map
+ * and the metadata, so that is what gets marked as used.
  */
 uint32_t
 acquire_block(struct afs_passive_fs *fs, struct afs_allocation_vector *vector)
 {
     static uint32_t block_num = 0;
     uint32_t current_num;
+    unsigned long flags;
     uint32_t ret;
 
-    spin_lock(&vector->lock);
+    spin_lock_irqsave(&vector->lock, flags);
     block_num = random_block_index(fs, vector);
     current_num = block_num;
     do {
-        if (allocation_set(vector, block_num)) {
+        if (allocation_set(vector, fs->block_list[block_num])) {
             ret = fs->block_list[block_num];
             //block_num = (block_num + 1) % fs->list_len;
-            spin_unlock(&vector->lock);
+            spin_unlock_irqrestore(&vector->lock, flags);
             return ret;
         }
 	block_num = random_block_index(fs, vector);
         //block_num = (block_num + 1) % fs->list_len;
     } while (block_num != current_num);
-    spin_unlock(&vector->lock);
+    spin_unlock_irqrestore(&vector->lock, flags);
 
     return AFS_INVALID_BLOCK;
 }
@@ -0,0 +1,928 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_cache.h>
+#include <linux/gfp.h>
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+/**
+ * Bump the sketch counters of a block.
+ */
+static void
+afs_cache_sketch_inc(struct afs_cache *cache, uint32_t block) {
+    uint32_t width = cache->sketch_mask + 1;
+    uint8_t *counter;
+    uint32_t i;
+
+    for (i = 0; i < AFS_CACHE_SKETCH_ROWS; i++) {
+        counter = &cache->sketch[(i * width) + (jhash_1word(block, i) & cache->sketch_mask)];
+        if (*counter < AFS_CACHE_SKETCH_MAX) {
+            (*counter)++;
+        }
+    }
+
+    if (++cache->sketch_ops >= cache->sketch_reset) {
+        for (i = 0; i < AFS_CACHE_SKETCH_ROWS * width; i++) {
+            cache->sketch[i] >>= 1;
+        }
+        cache->sketch_ops /= 2;
+    }
+}
+
+/**
+ * Estimated access frequency of a block.
+ */
+static uint8_t
+afs_cache_sketch_freq(struct afs_cache *cache, uint32_t block) {
+    uint32_t width = cache->sketch_mask + 1;
+    uint8_t freq = AFS_CACHE_SKETCH_MAX;
+    uint32_t i;
+
+    for (i = 0; i < AFS_CACHE_SKETCH_ROWS; i++) {
+        freq = min(freq, cache->sketch[(i * width) + (jhash_1word(block, i) & cache->sketch_mask)]);
+    }
+    return freq;
+}
+
+/**
+ * Find the entry for a block.
+ */
+static struct afs_cache_entry *
+afs_cache_lookup(struct afs_cache *cache, uint32_t block) {
+    struct afs_cache_entry *entry;
+
+    hlist_for_each_entry(entry, &cache->table[hash_32(block, cache->table_bits)], node) {
+        if (entry->block == block) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Move an entry to the head of a segment.
+ */
+static void
+afs_cache_move(struct afs_cache *cache, struct afs_cache_entry *entry, uint8_t segment) {
+    cache->sizes[entry->segment]--;
+    entry->segment = segment;
+    cache->sizes[segment]++;
+    list_move(&entry->lru, &cache->segments[segment]);
+}
+
+/**
+ * Queue the writeback work of the cache owner.
+ */
+static void
+afs_cache_kick(struct afs_cache *cache, unsigned long delay) {
+    if (!cache->writeback_dw) {
+        return;
+    }
+
+    if (delay) {
+        queue_delayed_work(cache->writeback_wq, cache->writeback_dw, delay);
+    } else {
+        mod_delayed_work(cache->writeback_wq, cache->writeback_dw, 0);
+    }
+}
+
+/**
+ * Mark an entry dirty.
+ */
+static void
+afs_cache_dirty(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    if (entry->is_dirty) {
+        return;
+    }
+
+    entry->is_dirty = true;
+    list_add_tail(&entry->dirty, &cache->dirty);
+    if (cache->nr_dirty++ == 0) {
+        afs_cache_kick(cache, cache->writeback_delay);
+    }
+    if (cache->nr_dirty >= cache->dirty_limit) {
+        afs_cache_kick(cache, 0);
+    }
+}
+
+/**
+ * Mark an entry clean.
+ */
+static void
+afs_cache_clean(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    if (!entry->is_dirty) {
+        return;
+    }
+
+    entry->is_dirty = false;
+    list_del_init(&entry->dirty);
+    cache->nr_dirty--;
+}
+
+/**
+ * Remove an entry from the cache and free it. An entry that is being
+ * copied is freed by the last copy instead.
+ */
+static void
+afs_cache_evict(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    afs_cache_clean(cache, entry);
+    hlist_del(&entry->node);
+    list_del(&entry->lru);
+    cache->sizes[entry->segment]--;
+    cache->count--;
+
+    if (entry->refs) {
+        entry->evicted = true;
+        return;
+    }
+    free_page((unsigned long)entry->data);
+    kfree(entry);
+}
+
+/**
+ * Drop the reference of a copy that is done. Lock must be held.
+ */
+static void
+afs_cache_release(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    if (--entry->refs || !entry->evicted) {
+        return;
+    }
+    free_page((unsigned long)entry->data);
+    kfree(entry);
+}
+
+/**
+ * Drop the reference of a write that is done copying into an entry. The
+ * entry is marked dirty again, a writeback that took it meanwhile may
+ * have missed part of the write. Lock must be held.
+ */
+static void
+afs_cache_written(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    if (!entry->evicted) {
+        afs_cache_dirty(cache, entry);
+    }
+    afs_cache_release(cache, entry);
+}
+
+/**
+ * Drop the reference of a copy that is done.
+ */
+static void
+afs_cache_put(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&cache->lock, flags);
+    afs_cache_release(cache, entry);
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Oldest clean entry of a segment.
+ */
+static struct afs_cache_entry *
+afs_cache_oldest_in(struct afs_cache *cache, uint8_t segment) {
+    struct afs_cache_entry *entry;
+
+    list_for_each_entry_reverse(entry, &cache->segments[segment], lru) {
+        if (!entry->is_dirty) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Oldest clean entry of the cache, preferring the segments that are
+ * cheapest to lose.
+ */
+static struct afs_cache_entry *
+afs_cache_oldest(struct afs_cache *cache) {
+    static const uint8_t order[] = { AFS_CACHE_PROBATION, AFS_CACHE_WINDOW, AFS_CACHE_PROTECTED };
+    struct afs_cache_entry *entry;
+    uint32_t i;
+
+    for (i = 0; i < ARRAY_SIZE(order); i++) {
+        entry = afs_cache_oldest_in(cache, order[i]);
+        if (entry) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Account a hit on an entry.
+ */
+static void
+afs_cache_touch(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    struct afs_cache_entry *demoted;
+
+    cache->hits++;
+
+    // A stream reads a prefetched block once, so it is not counted and
+    // goes first once read.
+    if (entry->prefetched) {
+        entry->prefetched = false;
+        list_move_tail(&entry->lru, &cache->segments[entry->segment]);
+        return;
+    }
+
+    afs_cache_sketch_inc(cache, entry->block);
+    if (entry->segment != AFS_CACHE_PROBATION) {
+        list_move(&entry->lru, &cache->segments[entry->segment]);
+        return;
+    }
+
+    // A second hit promotes a block. The protected segment makes room by
+    // giving its oldest block another chance on probation.
+    afs_cache_move(cache, entry, AFS_CACHE_PROTECTED);
+    if (cache->sizes[AFS_CACHE_PROTECTED] > cache->limits[AFS_CACHE_PROTECTED]) {
+        demoted = list_last_entry(&cache->segments[AFS_CACHE_PROTECTED], struct afs_cache_entry, lru);
+        afs_cache_move(cache, demoted, AFS_CACHE_PROBATION);
+    }
+}
+
+/**
+ * Add a new entry to the cache, evicting as needed.
+ */
+static void
+afs_cache_insert(struct afs_cache *cache, struct afs_cache_entry *entry) {
+    struct afs_cache_entry *candidate;
+    struct afs_cache_entry *victim;
+
+    hlist_add_head(&entry->node, &cache->table[hash_32(entry->block, cache->table_bits)]);
+    entry->segment = AFS_CACHE_WINDOW;
+    list_add(&entry->lru, &cache->segments[AFS_CACHE_WINDOW]);
+    cache->sizes[AFS_CACHE_WINDOW]++;
+    cache->count++;
+
+    if (cache->sizes[AFS_CACHE_WINDOW] <= cache->limits[AFS_CACHE_WINDOW]) {
+        return;
+    }
+
+    // The block leaving the window competes with the oldest block on
+    // probation, and only the more frequently used one stays. Dirty
+    // blocks always stay.
+    candidate = list_last_entry(&cache->segments[AFS_CACHE_WINDOW], struct afs_cache_entry, lru);
+    afs_cache_move(cache, candidate, AFS_CACHE_PROBATION);
+    if (cache->count > cache->capacity) {
+        victim = afs_cache_oldest_in(cache, AFS_CACHE_PROBATION);
+        if (victim == candidate) {
+            afs_cache_evict(cache, candidate);
+        } else if (victim && (candidate->is_dirty || afs_cache_sketch_freq(cache, candidate->block) > afs_cache_sketch_freq(cache, victim->block))) {
+            afs_cache_evict(cache, victim);
+        } else if (!candidate->is_dirty) {
+            afs_cache_evict(cache, candidate);
+        }
+    }
+
+    while (cache->count > cache->capacity && (victim = afs_cache_oldest(cache))) {
+        afs_cache_evict(cache, victim);
+    }
+}
+
+/**
+ * Allocate an entry holding a copy of a block, if data is given, or
+ * zeroes otherwise. Whatever the page held before must never be seen
+ * by a read racing with the copy that fills it.
+ * Returns NULL if memory is short, the cache never waits for it.
+ */
+static struct afs_cache_entry *
+afs_cache_entry_alloc(uint32_t block, const uint8_t *data) {
+    struct afs_cache_entry *entry;
+
+    entry = kmalloc(sizeof(*entry), GFP_NOWAIT | __GFP_NOWARN);
+    if (!entry) {
+        return NULL;
+    }
+    entry->data = (uint8_t *)__get_free_page(GFP_NOWAIT | __GFP_NOWARN | ((data) ? 0 : __GFP_ZERO));
+    if (!entry->data) {
+        kfree(entry);
+        return NULL;
+    }
+    entry->block = block;
+    entry->is_dirty = false;
+    entry->prefetched = false;
+    entry->evicted = false;
+    entry->refs = 0;
+    INIT_LIST_HEAD(&entry->dirty);
+    if (data) {
+        memcpy(entry->data, data, AFS_BLOCK_SIZE);
+    }
+    return entry;
+}
+
+/**
+ * Free an entry that never made it into the cache.
+ */
+static void
+afs_cache_entry_free(struct afs_cache_entry *entry) {
+    free_page((unsigned long)entry->data);
+    kfree(entry);
+}
+
+/**
+ * Serve a read bio entirely from the cache. The lock is only taken to
+ * look up each block, blocks are copied outside of it.
+ */
+bool
+afs_cache_read_bio(struct afs_cache *cache, struct bio *bio) {
+    struct afs_cache_entry *entry = NULL;
+    struct bio_vec bv;
+    struct bvec_iter iter;
+    uint64_t pos = bio->bi_iter.bi_sector * AFS_SECTOR_SIZE;
+    unsigned long flags;
+    uint32_t block, offset, len, done;
+    uint8_t *bio_data;
+    bool hit = true;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    bio_for_each_segment (bv, bio, iter) {
+        // A segment may straddle two blocks.
+        for (done = 0; done < bv.bv_len; done += len, pos += len) {
+            block = pos / AFS_BLOCK_SIZE;
+            offset = pos % AFS_BLOCK_SIZE;
+            len = min_t(uint32_t, bv.bv_len - done, AFS_BLOCK_SIZE - offset);
+
+            if (!entry || entry->block != block) {
+                spin_lock_irqsave(&cache->lock, flags);
+                if (entry) {
+                    afs_cache_release(cache, entry);
+                }
+                entry = afs_cache_lookup(cache, block);
+                if (!entry) {
+                    afs_cache_sketch_inc(cache, block);
+                    cache->misses++;
+                    spin_unlock_irqrestore(&cache->lock, flags);
+                    hit = false;
+                    goto done;
+                }
+                afs_cache_touch(cache, entry);
+                entry->refs++;
+                spin_unlock_irqrestore(&cache->lock, flags);
+            }
+
+            bio_data = kmap_atomic(bv.bv_page);
+            memcpy(bio_data + bv.bv_offset + done, entry->data + offset, len);
+            kunmap_atomic(bio_data);
+        }
+    }
+    if (entry) {
+        afs_cache_put(cache, entry);
+    }
+done:
+    return hit;
+}
+
+/**
+ * Copy part of a cached block into the part of a bio described by iter.
+ */
+bool
+afs_cache_read_iter(struct afs_cache *cache, uint32_t block, uint32_t offset, struct bio *bio, struct bvec_iter iter) {
+    struct afs_cache_entry *entry;
+    struct bio_vec bv;
+    struct bvec_iter it;
+    unsigned long flags;
+    uint8_t *bio_data;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    entry = afs_cache_lookup(cache, block);
+    if (entry) {
+        afs_cache_touch(cache, entry);
+        entry->refs++;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    if (!entry) {
+        return false;
+    }
+
+    __bio_for_each_segment (bv, bio, it, iter) {
+        bio_data = kmap_atomic(bv.bv_page);
+        memcpy(bio_data + bv.bv_offset, entry->data + offset, bv.bv_len);
+        kunmap_atomic(bio_data);
+        offset += bv.bv_len;
+    }
+    afs_cache_put(cache, entry);
+    return true;
+}
+
+/**
+ * Copy a whole cached block.
+ */
+bool
+afs_cache_read_block(struct afs_cache *cache, uint32_t block, uint8_t *data) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    entry = afs_cache_lookup(cache, block);
+    if (entry) {
+        entry->refs++;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    if (!entry) {
+        return false;
+    }
+
+    memcpy(data, entry->data, AFS_BLOCK_SIZE);
+    afs_cache_put(cache, entry);
+    return true;
+}
+
+/**
+ * Absorb a write bio into dirty blocks.
+ *
+ * Blocks already in the cache take any part of the write. A block that
+ * is not cached can only be created by a write covering all of it.
+ */
+bool
+afs_cache_write_bio(struct afs_cache *cache, struct bio *bio) {
+    struct afs_cache_entry *entry = NULL;
+    struct afs_cache_entry *spare = NULL;
+    struct bio_vec bv;
+    struct bvec_iter iter;
+    uint64_t pos = bio->bi_iter.bi_sector * AFS_SECTOR_SIZE;
+    uint64_t end = pos + bio->bi_iter.bi_size;
+    unsigned long flags;
+    uint32_t block, offset, len, done;
+    uint8_t *bio_data;
+    bool absorbed = true;
+
+    if (!cache->capacity || !cache->writeback_dw) {
+        return false;
+    }
+
+    bio_for_each_segment (bv, bio, iter) {
+        for (done = 0; done < bv.bv_len; done += len, pos += len) {
+            block = pos / AFS_BLOCK_SIZE;
+            offset = pos % AFS_BLOCK_SIZE;
+            len = min_t(uint32_t, bv.bv_len - done, AFS_BLOCK_SIZE - offset);
+
+            if (!entry || entry->block != block) {
+                spin_lock_irqsave(&cache->lock, flags);
+                if (entry) {
+                    afs_cache_written(cache, entry);
+                    entry = NULL;
+                }
+
+                absorbed = cache->nr_dirty < cache->dirty_limit;
+                if (!absorbed) {
+                    goto unlock;
+                }
+
+                entry = afs_cache_lookup(cache, block);
+                if (!entry) {
+                    absorbed = !offset && (end - pos) >= AFS_BLOCK_SIZE;
+                    if (!absorbed) {
+                        goto unlock;
+                    }
+
+                    // A new entry starts out as zeroes, reads racing
+                    // with the copy may see it.
+                    if (!spare) {
+                        spin_unlock_irqrestore(&cache->lock, flags);
+                        spare = afs_cache_entry_alloc(block, NULL);
+                        spin_lock_irqsave(&cache->lock, flags);
+                        absorbed = spare != NULL;
+                        if (!absorbed) {
+                            goto unlock;
+                        }
+                    }
+
+                    // Somebody may have cached it while we were allocating.
+                    entry = afs_cache_lookup(cache, block);
+                    if (!entry) {
+                        entry = spare;
+                        spare = NULL;
+                        entry->block = block;
+                        afs_cache_dirty(cache, entry);
+                        afs_cache_insert(cache, entry);
+                    }
+                }
+
+                cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)]++;
+                afs_cache_sketch_inc(cache, block);
+                afs_cache_dirty(cache, entry);
+                list_move(&entry->lru, &cache->segments[entry->segment]);
+                entry->refs++;
+                spin_unlock_irqrestore(&cache->lock, flags);
+            }
+
+            bio_data = kmap_atomic(bv.bv_page);
+            memcpy(entry->data + offset, bio_data + bv.bv_offset + done, len);
+            kunmap_atomic(bio_data);
+        }
+    }
+    spin_lock_irqsave(&cache->lock, flags);
+    if (entry) {
+        afs_cache_written(cache, entry);
+    }
+unlock:
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (spare) {
+        afs_cache_entry_free(spare);
+    }
+    return absorbed;
+}
+
+/**
+ * Pick the oldest dirty block for writeback. It stays dirty, and moves
+ * to the back of the dirty list so the next call picks another one.
+ */
+bool
+afs_cache_next_dirty(struct afs_cache *cache, uint32_t *block) {
+    struct afs_cache_entry *entry = NULL;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    if (!list_empty(&cache->dirty)) {
+        entry = list_first_entry(&cache->dirty, struct afs_cache_entry, dirty);
+        list_move_tail(&entry->dirty, &cache->dirty);
+        *block = entry->block;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return entry != NULL;
+}
+
+/**
+ * Take a dirty block for writeback.
+ */
+bool
+afs_cache_writeback(struct afs_cache *cache, uint32_t block, uint8_t *data) {
+    struct afs_cache_entry *entry = NULL;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    entry = afs_cache_lookup(cache, block);
+    if (entry && !entry->is_dirty) {
+        entry = NULL;
+    }
+    if (entry) {
+        afs_cache_clean(cache, entry);
+        entry->refs++;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    if (!entry) {
+        return false;
+    }
+
+    // A write absorbed while we copy dirties the block again.
+    memcpy(data, entry->data, AFS_BLOCK_SIZE);
+    afs_cache_put(cache, entry);
+    return true;
+}
+
+/**
+ * Mark a block dirty again after its writeback failed.
+ */
+void
+afs_cache_redirty(struct afs_cache *cache, uint32_t block) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    entry = afs_cache_lookup(cache, block);
+    if (entry) {
+        afs_cache_dirty(cache, entry);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Current generation of a block.
+ */
+uint32_t
+afs_cache_gen(struct afs_cache *cache, uint32_t block) {
+    return READ_ONCE(cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)]);
+}
+
+/**
+ * Offer a block decoded by a read to the cache. The block is dropped
+ * if it was written since the read looked at its generation.
+ */
+void
+afs_cache_fill(struct afs_cache *cache, uint32_t block, const uint8_t *data, uint32_t gen) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    entry = afs_cache_entry_alloc(block, data);
+    if (!entry) {
+        return;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    if (cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)] == gen && !afs_cache_lookup(cache, block)) {
+        afs_cache_insert(cache, entry);
+        entry = NULL;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (entry) {
+        afs_cache_entry_free(entry);
+    }
+}
+
+/**
+ * Offer a block prefetched for a sequential stream to the cache. The
+ * block is dropped if it was written since its read looked at its
+ * generation.
+ */
+void
+afs_cache_prefetch(struct afs_cache *cache, uint32_t block, const uint8_t *data, uint32_t gen) {
+    struct afs_cache_entry *entry;
+    struct afs_cache_entry *victim;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    entry = afs_cache_entry_alloc(block, data);
+    if (!entry) {
+        return;
+    }
+    entry->prefetched = true;
+
+    spin_lock_irqsave(&cache->lock, flags);
+    if (cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)] == gen && !afs_cache_lookup(cache, block)) {
+        hlist_add_head(&entry->node, &cache->table[hash_32(block, cache->table_bits)]);
+        entry->segment = AFS_CACHE_PROBATION;
+        list_add(&entry->lru, &cache->segments[AFS_CACHE_PROBATION]);
+        cache->sizes[AFS_CACHE_PROBATION]++;
+        cache->count++;
+        entry = NULL;
+
+        while (cache->count > cache->capacity && (victim = afs_cache_oldest(cache))) {
+            afs_cache_evict(cache, victim);
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (entry) {
+        afs_cache_entry_free(entry);
+    }
+}
+
+/**
+ * Check whether a block is cached.
+ */
+bool
+afs_cache_contains(struct afs_cache *cache, uint32_t block) {
+    unsigned long flags;
+    bool cached;
+
+    if (!cache->capacity) {
+        return false;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    cached = afs_cache_lookup(cache, block) != NULL;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return cached;
+}
+
+/**
+ * Update the cache with the new contents of a block being written.
+ */
+void
+afs_cache_write(struct afs_cache *cache, uint32_t block, const uint8_t *data) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+    uint32_t gen;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    gen = ++cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)];
+    afs_cache_sketch_inc(cache, block);
+    entry = afs_cache_lookup(cache, block);
+    if (entry) {
+        list_move(&entry->lru, &cache->segments[entry->segment]);
+        entry->refs++;
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    // Not cached yet, insert it like a read would. Another write in the
+    // meantime takes precedence.
+    if (!entry) {
+        afs_cache_fill(cache, block, data, gen);
+        return;
+    }
+    memcpy(entry->data, data, AFS_BLOCK_SIZE);
+    afs_cache_put(cache, entry);
+}
+
+/**
+ * Drop a block from the cache. Dirty blocks are kept, they are still
+ * going to be written back.
+ */
+void
+afs_cache_invalidate(struct afs_cache *cache, uint32_t block) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)]++;
+    entry = afs_cache_lookup(cache, block);
+    if (entry && !entry->is_dirty) {
+        afs_cache_evict(cache, entry);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Drop a block from the cache, even if it is dirty. Its contents are
+ * of no interest to anybody anymore.
+ */
+void
+afs_cache_discard(struct afs_cache *cache, uint32_t block) {
+    struct afs_cache_entry *entry;
+    unsigned long flags;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    spin_lock_irqsave(&cache->lock, flags);
+    cache->gens[hash_32(block, AFS_CACHE_GEN_BITS)]++;
+    entry = afs_cache_lookup(cache, block);
+    if (entry) {
+        afs_cache_evict(cache, entry);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Shrinker callback, number of blocks that can be given back.
+ */
+static unsigned long
+afs_cache_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+    struct afs_cache *cache = container_of(shrinker, struct afs_cache, shrinker);
+    uint32_t count = READ_ONCE(cache->count);
+
+    return count ? count : SHRINK_EMPTY;
+}
+
+/**
+ * Shrinker callback, give back the least valuable blocks. Dirty blocks
+ * cannot be given back until they are written, so writeback is started.
+ */
+static unsigned long
+afs_cache_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+    struct afs_cache *cache = container_of(shrinker, struct afs_cache, shrinker);
+    struct afs_cache_entry *entry;
+    unsigned long freed = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&cache->lock, flags);
+    while (freed < sc->nr_to_scan && (entry = afs_cache_oldest(cache))) {
+        afs_cache_evict(cache, entry);
+        freed++;
+    }
+    if (cache->nr_dirty) {
+        afs_cache_kick(cache, 0);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return freed ? freed : SHRINK_STOP;
+}
+
+/**
+ * Initialize a cache.
+ */
+int
+afs_cache_init(struct afs_cache *cache, uint32_t capacity) {
+    uint32_t width;
+    uint32_t main;
+    int ret = 0;
+    int i;
+
+    memset(cache, 0, sizeof(*cache));
+    spin_lock_init(&cache->lock);
+    for (i = 0; i < AFS_CACHE_SEGMENTS; i++) {
+        INIT_LIST_HEAD(&cache->segments[i]);
+    }
+    INIT_LIST_HEAD(&cache->dirty);
+    if (!capacity) {
+        return 0;
+    }
+
+    cache->table_bits = ilog2(roundup_pow_of_two(capacity));
+    cache->table = vzalloc(sizeof(*cache->table) << cache->table_bits);
+    afs_action(cache->table, ret = -ENOMEM, err, "could not allocate cache table [%d]", ret);
+
+    width = roundup_pow_of_two(max_t(uint32_t, capacity, 16));
+    cache->sketch = vzalloc(AFS_CACHE_SKETCH_ROWS * width);
+    afs_action(cache->sketch, ret = -ENOMEM, sketch_err, "could not allocate cache sketch [%d]", ret);
+    cache->sketch_mask = width - 1;
+    cache->sketch_reset = 10 * capacity;
+
+    // 1% window, the rest is split 20/80 between probation and protected.
+    cache->limits[AFS_CACHE_WINDOW] = max_t(uint32_t, capacity / 100, 1);
+    main = capacity - cache->limits[AFS_CACHE_WINDOW];
+    cache->limits[AFS_CACHE_PROTECTED] = (main * 4) / 5;
+    cache->limits[AFS_CACHE_PROBATION] = main - cache->limits[AFS_CACHE_PROTECTED];
+    cache->dirty_limit = max_t(uint32_t, capacity / 2, 1);
+
+    cache->shrinker.count_objects = afs_cache_shrink_count;
+    cache->shrinker.scan_objects = afs_cache_shrink_scan;
+    cache->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    ret = register_shrinker(&cache->shrinker, "dm-afs-cache");
+#else
+    ret = register_shrinker(&cache->shrinker);
+#endif
+    afs_assert(!ret, shrinker_err, "could not register cache shrinker [%d]", ret);
+
+    // Only enable the cache once it is fully set up.
+    cache->capacity = capacity;
+    return 0;
+
+shrinker_err:
+    vfree(cache->sketch);
+
+sketch_err:
+    vfree(cache->table);
+
+err:
+    cache->table = NULL;
+    cache->sketch = NULL;
+    return ret;
+}
+
+/**
+ * Enable write-back.
+ */
+void
+afs_cache_set_writeback(struct afs_cache *cache, struct workqueue_struct *wq, struct delayed_work *dw, unsigned long delay) {
+    cache->writeback_wq = wq;
+    cache->writeback_delay = delay;
+    cache->writeback_dw = dw;
+}
+
+/**
+ * Release a cache.
+ */
+void
+afs_cache_exit(struct afs_cache *cache) {
+    struct afs_cache_entry *entry, *next;
+    int i;
+
+    if (!cache->capacity) {
+        return;
+    }
+
+    unregister_shrinker(&cache->shrinker);
+    if (cache->nr_dirty) {
+        afs_alert("dropping %u dirty blocks", cache->nr_dirty);
+    }
+    for (i = 0; i < AFS_CACHE_SEGMENTS; i++) {
+        list_for_each_entry_safe(entry, next, &cache->segments[i], lru) {
+            afs_cache_evict(cache, entry);
+        }
+    }
+    vfree(cache->sketch);
+    vfree(cache->table);
+    cache->capacity = 0;
+}
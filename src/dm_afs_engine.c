@@ -7,8 +7,11 @@
 #include <dm_afs_engine.h>
 #include <dm_afs_io.h>
 #include <linux/delay.h>
+#include <linux/err.h>
 #include <linux/timekeeping.h>
 #include <linux/hardirq.h>
+#include <linux/highmem.h>
+#include <linux/random.h>
 #include "lib/libgfshare.h"
 #include "lib/city.h"
 #include "lib/aont.h"
@@ -16,200 +19,626 @@
 #define CONTAINER_OF(MemberPtr, StrucType, MemberName) ((StrucType*)( (char*)(MemberPtr) - offsetof(StrucType, MemberName)))
 
 /**
- * Initialize an engine queue.
+ * Point a request at the map entry of its block. The page holding it
+ * stays in memory until the request is cleaned up, and the block lock
+ * keeps anybody else off the entry meanwhile.
+ */
+static int
+afs_req_map_entry(struct afs_map_request *req) {
+    struct afs_map_page *page;
+
+    page = afs_map_get(req->map, req->block);
+    if (IS_ERR(page)) {
+        return PTR_ERR(page);
+    }
+    req->map_page = page;
+    req->map_carriers = afs_map_carriers(req->map, page, req->block);
+    req->map_checksums = afs_map_checksums(req->map, page, req->block);
+    return 0;
+}
+
+/**
+ * Acquire a carrier. Until the map has been scanned, only carriers freed
+ * meanwhile are known to be free. Without one we wait for the scan.
+ */
+static int
+afs_acquire_carrier(struct afs_map_request *req, uint32_t *block_num) {
+    struct afs_private *context = req->afs_context;
+    int ret;
+
+    *block_num = allocation_take_freed(req->vector);
+    if (*block_num != AFS_INVALID_BLOCK) {
+        return 0;
+    }
+
+    wait_for_completion(&context->scanned);
+    ret = READ_ONCE(context->scan_err);
+    if (ret) {
+        return ret;
+    }
+    *block_num = acquire_block(req->fs, req->vector);
+    return (*block_num != AFS_INVALID_BLOCK) ? 0 : -ENOSPC;
+}
+
+/**
+ * Acquire the data block and carrier block pages for a request.
+ *
+ * A request needs all of its pages before it can make progress, so we
+ * first try to take them from the pool without blocking. If the pool is
+ * running dry we hand back what we took and retry while holding the pool
+ * lock. This way only a single request ever waits on the pool while
+ * holding a partial set, and the reserve is always enough for it to finish.
+ * From the map function we never wait and return -EAGAIN instead.
+ */
+int
+afs_req_alloc_pages(struct afs_map_request *req) {
+    struct afs_private *context = req->afs_context;
+    uint8_t *pages[NUM_MAX_CARRIER_BLKS + 1];
+    uint32_t num_pages = req->config->num_carrier_blocks + 1;
+    gfp_t gfp_mask = GFP_NOWAIT | __GFP_NOWARN;
+    struct page *page;
+    bool locked = false;
+    uint32_t i, j;
+
+retry:
+    for (i = 0; i < num_pages; i++) {
+        page = mempool_alloc(&context->page_pool, gfp_mask);
+        if (!page) {
+            for (j = 0; j < i; j++) {
+                mempool_free(virt_to_page(pages[j]), &context->page_pool);
+            }
+            // The map function cannot wait for the pool, the request is
+            // started again from the flight queue.
+            if (current->bio_list) {
+                return -EAGAIN;
+            }
+            mutex_lock(&context->page_pool_lock);
+            locked = true;
+            gfp_mask = GFP_NOIO;
+            goto retry;
+        }
+        pages[i] = page_address(page);
+    }
+    if (locked) {
+        mutex_unlock(&context->page_pool_lock);
+    }
+
+    req->data_block = pages[0];
+    for (i = 0; i < req->config->num_carrier_blocks; i++) {
+        req->carrier_blocks[i] = pages[i + 1];
+    }
+    return 0;
+}
+
+/**
+ * Initialize in-flight write accounting.
  */
 void
-afs_eq_init(struct afs_engine_queue *eq) {
-    eq->mq_tree = RB_ROOT;
-    spin_lock_init(&eq->mq_lock);
+afs_inflight_init(struct afs_inflight *inflight) {
+    inflight->epoch = 0;
+    atomic_set(&inflight->writes[0], 0);
+    atomic_set(&inflight->writes[1], 0);
+    init_waitqueue_head(&inflight->wait);
+}
+
+/**
+ * Account a write bio.
+ *
+ * A write racing with a flush may land in the epoch that flush is
+ * draining. That only makes the flush wait a little longer.
+ */
+uint8_t
+afs_inflight_start(struct afs_inflight *inflight) {
+    uint8_t epoch = READ_ONCE(inflight->epoch) & 1;
+
+    atomic_inc(&inflight->writes[epoch]);
+    return epoch;
 }
 
 /**
- * Add a map element to a map queue.
+ * Account the completion of a write bio.
  */
 void
-afs_eq_add(struct afs_engine_queue *eq, struct afs_map_request *element) {
-    struct rb_node **new = &(eq->mq_tree.rb_node), *parent = NULL;
-    
-    spin_lock_irq(&eq->mq_lock);
-    while (*new) {
-        struct afs_map_request *this = container_of(*new, struct afs_map_request, node);
-        
-        parent = *new;
-        if (element->block < this->block) {
-            new = &(*new)->rb_left;
-        } else if (element->block > this->block) {
-            new = &(*new)->rb_right;
-        } else {
-            afs_debug("could not insert into tree");       
-        }
+afs_inflight_end(struct afs_inflight *inflight, uint8_t epoch) {
+    if (atomic_dec_and_test(&inflight->writes[epoch])) {
+        wake_up(&inflight->wait);
     }
-    // add new node and rebalance tree
-    rb_link_node(&element->node, parent, new);
-    rb_insert_color(&element->node, &eq->mq_tree);
-    spin_unlock_irq(&eq->mq_lock);
 }
 
 /**
- * Check if an engine queue is empty without locking.
+ * Open a new epoch and wait for the writes of the current one.
  */
-bool
-afs_eq_empty_unsafe(struct afs_engine_queue *eq) {
-    if (RB_EMPTY_ROOT(&eq->mq_tree)) {
-        return true;
-    } else {
-        return false;
+void
+afs_inflight_drain(struct afs_inflight *inflight) {
+    uint8_t epoch = inflight->epoch & 1;
+
+    WRITE_ONCE(inflight->epoch, inflight->epoch + 1);
+    smp_mb();
+    wait_event(inflight->wait, !atomic_read(&inflight->writes[epoch]));
+}
+
+/**
+ * Drop a writeback from a flush.
+ */
+void
+afs_flush_put(struct afs_flush *flush, blk_status_t status) {
+    if (status != BLK_STS_OK) {
+        flush->status = status;
+    }
+    if (atomic_dec_and_test(&flush->pending)) {
+        complete(&flush->done);
     }
 }
 
 /**
- * Check if an engine queue is empty.
+ * Account the latency of a completed read.
  */
-bool
-afs_eq_empty(struct afs_engine_queue *eq) {
-    bool ret = false;
+void
+afs_stats_read_latency(struct afs_stats *stats, uint64_t start_ns) {
+    uint64_t latency_us = (ktime_get_ns() - start_ns) / NSEC_PER_USEC;
+    uint32_t bucket = min_t(uint32_t, fls64(latency_us), AFS_LAT_BUCKETS - 1);
 
-    spin_lock(&eq->mq_lock);
-    ret = afs_eq_empty_unsafe(eq);
-    spin_unlock(&eq->mq_lock);
+    atomic64_inc(&stats->reads);
+    atomic64_inc(&stats->read_lat[bucket]);
+}
 
-    return ret;
+/**
+ * Latency percentile of reads in microseconds. The result is the upper
+ * bound of the histogram bucket the percentile falls into.
+ */
+uint64_t
+afs_stats_read_percentile(struct afs_stats *stats, uint32_t percent) {
+    uint64_t counts[AFS_LAT_BUCKETS];
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    uint64_t target;
+    uint32_t i;
+
+    for (i = 0; i < AFS_LAT_BUCKETS; i++) {
+        counts[i] = atomic64_read(&stats->read_lat[i]);
+        total += counts[i];
+    }
+    if (!total) {
+        return 0;
+    }
+
+    target = DIV_ROUND_UP_ULL(total * percent, 100);
+    for (i = 0; i < AFS_LAT_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return 1ULL << min_t(uint32_t, i, AFS_LAT_BUCKETS - 1);
 }
 
 /**
- * Remove a specified request from the red/black tree.
+ * Drop a reference to a hedge. The last one gives the carrier pages
+ * back to the pool.
  */
-void inline afs_eq_remove(struct afs_engine_queue *eq, struct afs_map_request *req) {
-    spin_lock(&eq->mq_lock);
-    if(!afs_eq_empty_unsafe(eq)){
-        rb_erase(&req->node, &eq->mq_tree);
+static void
+afs_hedge_put(struct afs_hedge *hedge) {
+    struct afs_private *context = hedge->afs_context;
+    int i;
+
+    if (!atomic_dec_and_test(&hedge->refs)) {
+        return;
+    }
+    for (i = 0; i < NUM_MAX_CARRIER_BLKS; i++) {
+        if (hedge->pages[i]) {
+            mempool_free(virt_to_page(hedge->pages[i]), &context->page_pool);
+        }
+    }
+    mempool_free(hedge, &context->hedge_pool);
+    if (atomic_dec_and_test(&context->hedges)) {
+        wake_up(&context->hedges_wait);
     }
-    spin_unlock(&eq->mq_lock);
 }
 
 /**
- * Check if an engine queue contains a request with a specified
- * bio.
+ * Give the pages of a request back to the pool.
  */
-struct afs_map_request *
-afs_eq_req_exist(struct afs_engine_queue *eq, struct bio *bio) {
-    struct rb_node *node = eq->mq_tree.rb_node;
-    uint32_t block_num = (bio->bi_iter.bi_sector * AFS_SECTOR_SIZE) / AFS_BLOCK_SIZE;
+static void
+afs_req_free_pages(struct afs_map_request *req) {
+    struct afs_private *context = req->afs_context;
+    int i;
 
-    spin_lock(&eq->mq_lock);
-    while (node) {
-        struct afs_map_request *this = container_of(node, struct afs_map_request, node);
+    if (req->data_block) {
+        mempool_free(virt_to_page(req->data_block), &context->page_pool);
+        req->data_block = NULL;
+    }
 
-        if (block_num < this->block) {
-            node = node->rb_left;
-        } else if (block_num > this->block){
-            node = node->rb_right;
-        } else {
-            spin_unlock(&eq->mq_lock);
-            return this;
+    // Carrier pages of a hedged read may still be the target of late bios.
+    if (req->hedge) {
+        for (i = 0; i < req->config->num_carrier_blocks; i++) {
+            req->carrier_blocks[i] = NULL;
         }
+        afs_hedge_put(req->hedge);
+        req->hedge = NULL;
+    }
+    for (i = 0; i < req->config->num_carrier_blocks; i++) {
+        if (req->carrier_blocks[i]) {
+            mempool_free(virt_to_page(req->carrier_blocks[i]), &context->page_pool);
+            req->carrier_blocks[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Record an error for the bio a request belongs to.
+ */
+void
+afs_req_error(struct afs_map_request *req, blk_status_t status) {
+    struct afs_map_request *owner = (req->parent) ? req->parent : req;
+
+    if (status != BLK_STS_OK) {
+        owner->status = status;
     }
-    spin_unlock(&eq->mq_lock);
-    return NULL;
 }
 
 /**
- * Get a pointer to a map entry in the Artifice map.
- * TODO: Protect by a lock.
+ * Writeback queue. Ends a FUA write once its map updates are durable.
  */
-static inline uint8_t *
-afs_get_map_entry(uint8_t *map, struct afs_config *config, uint32_t index) {
-    return map + (index * config->map_entry_sz);
+static void
+afs_fuaq(struct work_struct *ws) {
+    struct afs_map_request *owner = container_of(ws, struct afs_map_request, req_ws);
+    struct bio *bio = owner->bio;
+    int ret;
+
+    ret = afs_map_commit(owner->afs_context);
+    if (ret) {
+        afs_alert("could not commit map updates of FUA write [%d]", ret);
+    }
+    bio->bi_status = errno_to_blk_status(ret);
+    bio_endio(bio);
+}
+
+/**
+ * Drop a completed block from the request owning the bio. The last
+ * block to complete ends the bio.
+ */
+static void
+afs_req_put(struct afs_map_request *owner) {
+    struct afs_private *context = owner->afs_context;
+    struct afs_flush *flush = owner->flush;
+    struct afs_scrub *scrub = owner->scrub;
+    struct afs_repair *repair = owner->repair;
+    blk_status_t status = owner->status;
+    struct bio *bio = owner->bio;
+    bool repaired;
+
+    if (!atomic_dec_and_test(&owner->blocks_pending)) {
+        return;
+    }
+
+    // A request for a bio lives in the per-bio data of that bio, so
+    // ending the bio is what releases it. Nothing may touch the request
+    // afterwards.
+    if (bio) {
+        if (bio_op(bio) == REQ_OP_READ) {
+            afs_stats_read_latency(&context->stats, owner->start_ns);
+        } else {
+            afs_inflight_end(&context->inflight, owner->epoch);
+
+            // The carriers of a FUA write are durable, the map entry
+            // pointing at them is not yet.
+            if ((bio->bi_opf & REQ_FUA) && status == BLK_STS_OK) {
+                INIT_WORK(&owner->req_ws, afs_fuaq);
+                queue_work(context->writeback_wq, &owner->req_ws);
+                return;
+            }
+        }
+        bio->bi_status = owner->status;
+        bio_endio(bio);
+    } else {
+        repaired = atomic_read(&owner->rebuild_flag);
+        mempool_free(owner, &context->req_pool);
+        if (flush) {
+            afs_flush_put(flush, status);
+        }
+        if (scrub) {
+            afs_scrub_done(scrub, status != BLK_STS_OK, repaired);
+        }
+        if (repair) {
+            afs_repair_done(repair, status != BLK_STS_OK);
+        }
+    }
 }
 
+static int read_pages(struct afs_map_request *req, bool used_vmalloc, uint32_t first, uint32_t num_pages);
+
 /**
  * Cleanup a completed request.
  */
 void 
 afs_req_clean(struct afs_map_request *req) {
-    int i;
+    struct afs_private *context = req->afs_context;
+    struct afs_map_request *owner = (req->parent) ? req->parent : req;
 
     //set the state of the request to completed
     atomic64_set(&req->state, REQ_STATE_COMPLETED);
 
-    for(i = 0; i < req->config->num_carrier_blocks; i++){
-       free_page((uint64_t)req->carrier_blocks[i]);
-    }
-    
-    /*if (bio_op(req->bio) == REQ_OP_WRITE) {
-        afs_eq_remove(req->eq, req);
-    }*/
-  
-    //end the virtual block device's recieved bio
-    if(req->bio) {
-        bio_endio(req->bio);
-    }
+    afs_req_free_pages(req);
 
     if (req->encoder != NULL){
         gfshare_ctx_free(req->encoder);
         req->encoder = NULL;   
     }
-    if (req->allocated_write_page) {
-        kfree(req->allocated_write_page);
-        req->allocated_write_page = NULL;
+
+    if (req->map_page) {
+        afs_map_put(req->map, req->map_page);
+        req->map_page = NULL;
+    }
+
+    // The next request for this block may start now.
+    afs_block_unlock(&context->locks, &req->lock);
+
+    if (req != owner) {
+        mempool_free(req, &context->req_pool);
+    }
+    afs_req_put(owner);
+}
+
+/**
+ * Iterator over the part of the bio covered by a request.
+ */
+static struct bvec_iter
+afs_req_bio_iter(struct afs_map_request *req) {
+    struct bvec_iter iter = req->bio->bi_iter;
+
+    bio_advance_iter(req->bio, &iter, req->bio_offset);
+    iter.bi_size = req->request_size;
+    return iter;
+}
+
+/**
+ * Page of the bio a block can be decoded into, or encoded from, directly.
+ * Returns NULL for partial blocks and blocks split over several pages,
+ * those go through the data block.
+ */
+static struct page *
+afs_req_bio_page(struct afs_map_request *req) {
+    struct bvec_iter iter;
+    struct bio_vec bv;
+
+    if (!req->bio || !bio_has_data(req->bio) || req->request_size != AFS_BLOCK_SIZE) {
+        return NULL;
+    }
+    iter = afs_req_bio_iter(req);
+    bv = bio_iter_iovec(req->bio, iter);
+    return (bv.bv_len == AFS_BLOCK_SIZE) ? bv.bv_page : NULL;
+}
+
+/**
+ * Copy data between a block sized buffer and the part of the bio
+ * covered by a request.
+ */
+static void
+afs_bio_copy(struct afs_map_request *req, uint8_t *block, bool to_bio) {
+    struct bio_vec bv;
+    struct bvec_iter iter;
+    struct bvec_iter start;
+    uint8_t *bio_data = NULL;
+    uint32_t segment_offset;
+
+    block += req->sector_offset * AFS_SECTOR_SIZE;
+    start = afs_req_bio_iter(req);
+
+    segment_offset = 0;
+    __bio_for_each_segment (bv, req->bio, iter, start) {
+        bio_data = kmap_atomic(bv.bv_page);
+        if (to_bio) {
+            memcpy(bio_data + bv.bv_offset, block + segment_offset, bv.bv_len);
+        } else {
+            memcpy(block + segment_offset, bio_data + bv.bv_offset, bv.bv_len);
+        }
+        kunmap_atomic(bio_data);
+        segment_offset += bv.bv_len;
+    }
+}
+
+/**
+ * Carrier bio a bio was allocated as.
+ */
+static inline struct afs_carrier_bio *
+afs_carrier_bio(struct bio *bio) {
+    return container_of(bio, struct afs_carrier_bio, bio);
+}
+
+/**
+ * Completion of a carrier read chained to the last read of its batch.
+ * Remember which carriers failed so that decoding treats them as erasures.
+ */
+static void
+afs_read_chain_endio(struct bio *bio) {
+    struct afs_carrier_bio *cb = afs_carrier_bio(bio);
+    struct bio *parent = bio->bi_private;
+
+    if (bio->bi_status) {
+        set_bit(cb->carrier, &cb->req->carrier_errors);
     }
-    
-    kfree(req);
-    req = NULL; 
+    bio_put(bio);
+    bio_endio(parent);
 }
 
 /**
- * Custom end_io function to signal completion of all bio operations in a batch
+ * Completion of a batch of carrier reads. Runs once every carrier bio
+ * chained to this one has completed.
  */
 static void 
 afs_read_endio(struct bio *bio) {
-    struct afs_map_request *req = bio->bi_private;
+    struct afs_carrier_bio *cb = afs_carrier_bio(bio);
+    struct afs_map_request *req = cb->req;
+
+    if (bio->bi_status) {
+        set_bit(cb->carrier, &req->carrier_errors);
+    }
+    bio_put(bio);
+
+    INIT_WORK(&req->req_ws, afs_cryptoq);
+    queue_work_on(req->cpu, req->afs_context->cpu_wq, &req->req_ws);
+}
+
+/**
+ * Start decoding a hedged read. Only the first caller gets to touch the
+ * request, everybody after it is late.
+ */
+static void
+afs_hedge_decode(struct afs_hedge *hedge) {
+    struct afs_map_request *req = hedge->req;
+
+    if (test_and_set_bit(AFS_HEDGE_DECODING, &hedge->flags)) {
+        return;
+    }
+
+    // A set bit means that carrier has fully arrived and been verified,
+    // so a late bio racing with us can only add to the mask.
+    req->carriers_valid = READ_ONCE(hedge->valid_mask);
+    INIT_WORK(&req->req_ws, afs_cryptoq);
+    queue_work_on(req->cpu, hedge->afs_context->cpu_wq, &req->req_ws);
+}
 
+/**
+ * Completion of a hedged carrier read. Carriers are verified as they
+ * arrive, and decoding starts as soon as enough of them are valid, or
+ * once every issued carrier is in if that never happens.
+ */
+static void
+afs_hedge_endio(struct bio *bio) {
+    struct afs_hedge *hedge = bio->bi_private;
+    uint32_t i = afs_carrier_bio(bio)->carrier;
+    uint16_t checksum;
+
+    if (test_bit(AFS_HEDGE_DECODING, &hedge->flags)) {
+        atomic64_inc(&hedge->afs_context->stats.late_carriers);
+    }
+
+    if (!bio->bi_status) {
+        checksum = cityhash32_to_16(hedge->pages[i], AFS_BLOCK_SIZE);
+        if (checksum == hedge->checksums[i]) {
+            set_bit(i, &hedge->valid_mask);
+            if (atomic_inc_return(&hedge->valid) == hedge->threshold) {
+                afs_hedge_decode(hedge);
+            }
+        } else {
+            set_bit(i, &hedge->bad_mask);
+        }
+    } else {
+        set_bit(i, &hedge->bad_mask);
+    }
     bio_put(bio);
 
-    if(atomic_dec_and_test(&req->bios_pending)) {
-	//TODO this should just queue work
-	INIT_WORK(&req->req_ws, afs_cryptoq);
-        queue_work(req->afs_context->crypto_wq, &req->req_ws);
+    if (atomic_dec_and_test(&hedge->bios_pending)) {
+        afs_hedge_decode(hedge);
     }
-    return;
+    afs_hedge_put(hedge);
 }
 
 /**
  * Handle read decoding in seperate queued function because a bio endio is an atomic context, makes the crypto API freak out
  *
+ * A threshold read has only fetched the data shards. If one of them turns
+ * out to be unusable the parity shards are read in as well and decoding is
+ * retried once they arrive.
  */
+static int afs_write_encode(struct afs_map_request *req);
+static int afs_repair_carriers(struct afs_map_request *req, uint8_t **shares, unsigned long lost);
+
 int
 afs_read_decode(struct afs_map_request *req){
-    struct bio_vec bv;
-    struct bvec_iter iter;
-    uint8_t *bio_data = NULL;
-    uint32_t segment_offset;
+    struct afs_config *config = req->config;
+    struct page *page = NULL;
+    uint8_t *out = req->data_block;
+    uint8_t *shares[NUM_MAX_CARRIER_BLKS];
+    uint8_t erasures[NUM_MAX_CARRIER_BLKS];
+    uint8_t recovery[NUM_MAX_CARRIER_BLKS];
+    uint8_t difference[CARRIER_HASH_SZ];
+    uint8_t num_erasures = 0;
+    uint8_t num_recovery = 0;
+    unsigned long corrupted = 0;
     uint32_t i;
     uint16_t checksum;
-    /*if(in_atomic()){
-            afs_debug("in atomic");
-    } else {
-            afs_debug("not atomic");
-    }*/
+    int ret = 0;
 
-    //TODO: only do this when running a repair process, it is kind of pointless to do with every read
-    for(i = 0; i < req->config->num_carrier_blocks; i++) {
-        checksum = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE);
-        if(memcmp(&req->map_entry_tuple[i].checksum, &checksum, sizeof(uint16_t))) {
-            afs_debug("corrupted block: %d,  carrier block: %d, stored checksum %d, checksum %d, carrier block location %d", req->block, i, req->map_entry_tuple[i].checksum, checksum, req->map_entry_tuple[i].carrier_block_ptr);
+    if (req->read_mode == READ_MODE_HEDGED) {
+        // Carriers were verified as they arrived, anything not valid by now
+        // is treated as an erasure. Late bios may still be filling those
+        // pages, so they are never touched below.
+        corrupted = ~req->carriers_valid & (BIT(config->num_carrier_blocks) - 1);
+
+        // Carriers that are merely late are fine, those that arrived
+        // broken leave the block to be repaired.
+        if (READ_ONCE(req->hedge->bad_mask)) {
             atomic_set(&req->rebuild_flag, 1);
-            req->erasures[i] = '0';
+        }
+    } else {
+        // A carrier whose bio failed is as good as corrupted.
+        for(i = 0; i < req->carriers_read; i++) {
+            checksum = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE);
+            if(test_bit(i, &req->carrier_errors) || req->map_checksums[i] != checksum) {
+                afs_debug("corrupted block: %d,  carrier block: %d, stored checksum %d, checksum %d, carrier block location %d", req->block, i, req->map_checksums[i], checksum, req->map_carriers[i]);
+                atomic_set(&req->rebuild_flag, 1);
+                __set_bit(i, &corrupted);
+                req->erasures[i] = '0';
+            }
         }
     }
 
-        //memcpy(req->data_block, req->carrier_blocks[0], AFS_BLOCK_SIZE);
     if (req->encoding_type == SHAMIR) {
-        gfshare_ctx_dec_decode(req->encoder, req->erasures, req->carrier_blocks, req->data_block);
+        page = afs_req_bio_page(req);
+        out = (page) ? kmap(page) : req->data_block;
+        gfshare_ctx_dec_decode(req->encoder, req->erasures, req->carrier_blocks, out);
     } else if (req->encoding_type == AONT_RS) {
-        //spin_lock_irqsave(&req->req_lock, flags);
-        decode_aont_package(req->map_entry_difference, req->data_block, AFS_BLOCK_SIZE, req->carrier_blocks, 2, req->config->num_carrier_blocks - 2, (uint64_t*)req->iv, req->erasures, req->num_erasures);
-        //spin_unlock_irqrestore(&req->req_lock, flags);
+        if (bitmap_weight(&corrupted, config->num_carrier_blocks) > config->num_carrier_blocks - config->threshold) {
+            // A hedged read that never saw enough valid carriers has every
+            // issued bio completed by now, so it continues as a full read.
+            afs_action(req->carriers_read < config->num_carrier_blocks, ret = -EIO, done, "too many corrupted carriers [%u]", req->block);
+        }
+        if ((corrupted & (BIT(config->threshold) - 1)) && req->carriers_read < config->num_carrier_blocks &&
+            (req->read_mode != READ_MODE_HEDGED || atomic_read(&req->hedge->valid) < config->threshold)) {
+            uint8_t first = req->carriers_read;
+
+            afs_debug("fetching parity for block [%u]", req->block);
+            atomic64_inc(&req->afs_context->stats.parity_reads);
+            if (req->read_mode == READ_MODE_HEDGED) {
+                req->carrier_errors = corrupted & (BIT(first) - 1);
+                req->read_mode = READ_MODE_FULL;
+            }
+            req->carriers_read = config->num_carrier_blocks;
+            return read_pages(req, false, first, config->num_carrier_blocks - first);
+        }
+
+        // Pair every erased data shard with a parity shard that survived,
+        // and recover it in place in that parity shard.
+        memcpy(shares, req->carrier_blocks, sizeof(shares));
+        for (i = config->threshold; i < req->carriers_read; i++) {
+            if (!test_bit(i, &corrupted)) {
+                recovery[num_recovery++] = i - config->threshold;
+            }
+        }
+        for (i = 0; i < config->threshold; i++) {
+            if (test_bit(i, &corrupted)) {
+                afs_action(num_erasures < num_recovery, ret = -EIO, done, "too many corrupted carriers [%u:%u]", req->block, num_erasures);
+                shares[i] = shares[config->threshold + recovery[num_erasures]];
+                erasures[num_erasures++] = i;
+            }
+        }
+
+        page = afs_req_bio_page(req);
+        out = (page) ? kmap(page) : req->data_block;
+        ret = decode_aont_package(difference, out, AFS_BLOCK_SIZE, shares, config->threshold,
+            config->num_carrier_blocks - config->threshold, (uint64_t*)req->iv, erasures, recovery, num_erasures);
+        afs_assert(!ret, done, "could not decode block [%d:%u]", ret, req->block);
+    }
+
+    // A partial write was waiting for the current contents of its
+    // block. Whatever was corrupted is rewritten along with the rest.
+    if (req->rmw) {
+        if (req->encoder) {
+            gfshare_ctx_free(req->encoder);
+            req->encoder = NULL;
+        }
+        return afs_write_encode(req);
     }
 
         //Confirm hash matches.
@@ -218,205 +647,473 @@ afs_read_decode(struct afs_map_request *req){
         //TODO only run this check when explicitly rebuilding, while mounted it is kind of useless
         //afs_action(!ret, ret = -ENOENT, err, "data block is corrupted [%u]", req->block);
 
-    segment_offset = 0;
-    bio_for_each_segment (bv, req->bio, iter) {
-        bio_data = kmap(bv.bv_page);
-        if (bv.bv_len <= (req->request_size - segment_offset)) {
-            memcpy(bio_data + bv.bv_offset, req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, bv.bv_len);
+    // Rebuild requests have no bio to hand the data to, and they would
+    // only pollute the cache.
+    if (req->prefetch) {
+        afs_cache_prefetch(&req->afs_context->cache, req->block, out, req->cache_gen);
+    } else if (req->bio) {
+        afs_cache_fill(&req->afs_context->cache, req->block, out, req->cache_gen);
+        if (page) {
+            kunmap(page);
+            page = NULL;
         } else {
-            memcpy(bio_data + bv.bv_offset, req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, req->request_size - segment_offset);
-            kunmap(bv.bv_page);
-            break;
+            afs_bio_copy(req, req->data_block, true);
         }
-        segment_offset += bv.bv_len;
-        kunmap(bv.bv_page);
     }
-    if(atomic_read(&req->rebuild_flag)) {
-        //write a new function called write blocks, should have a flag to remap blocks
-        //only after that is finished can we clean up the request so we return
-	//TODO apparently we have a segmentation fault here
-        rebuild_blocks(req);
-        return 0;
+
+    // Scrubs and repairs run in the background, and move the corrupted
+    // carriers right away. Nobody else waits for that, the block is
+    // left to the repair queue.
+    if (atomic_read(&req->rebuild_flag)) {
+        if (req->scrub || req->repair) {
+            return afs_repair_carriers(req, shares, corrupted);
+        }
+        afs_repair_add(&req->afs_context->repair, req->block);
     }
 
     //cleanup
     afs_req_clean(req);
-    return 0;
+
+done:
+    if (page) {
+        kunmap(page);
+    }
+    return ret;
+}
+
+/**
+ * Release the carriers a write allocated for a block that was not
+ * mapped. They only ever were in block_nums, the map entry still says
+ * the block is unmapped and nothing was logged for it. The allocation
+ * vector is only touched through atomic bit operations, so this may run
+ * from a bio completion.
+ */
+static void
+afs_write_unmap(struct afs_map_request *req) {
+    uint32_t i;
+
+    if (!req->allocated) {
+        return;
+    }
+    for (i = 0; i < req->config->num_carrier_blocks; i++) {
+        if (req->block_nums[i] != AFS_INVALID_BLOCK) {
+            allocation_free(req->vector, req->block_nums[i]);
+        }
+        req->block_nums[i] = AFS_INVALID_BLOCK;
+    }
+    req->allocated = false;
 }
 
+/**
+ * Completion of the carrier writes of a request. Runs once every carrier
+ * bio chained to this one has completed, and sees the first error any
+ * of them ran into.
+ */
 static void 
 afs_write_endio(struct bio *bio) {
-    struct afs_map_request *req = bio->bi_private;
-    uint8_t *digest;
-    uint16_t checksum;
+    struct afs_map_request *req = afs_carrier_bio(bio)->req;
     uint32_t i;
 
+    // The cache already holds the new contents, which never made it.
+    // A failed writeback has to be retried. The map keeps the old
+    // checksums of a block written in place, its carriers that were not
+    // overwritten still decode to the old contents. A block that was not
+    // mapped still is not, its new carriers are released.
+    if (bio->bi_status) {
+        afs_req_error(req, bio->bi_status);
+        if (req->bio) {
+            afs_cache_invalidate(&req->afs_context->cache, req->block);
+        } else {
+            afs_cache_redirty(&req->afs_context->cache, req->block);
+        }
+        bio_put(bio);
+        afs_write_unmap(req);
+        afs_req_clean(req);
+        return;
+    }
     bio_put(bio); 
-    if(atomic_dec_and_test(&req->bios_pending)) {
-        digest = cityhash128_to_array(CityHash128(req->data_block, AFS_BLOCK_SIZE));
-        //memcpy(req->map_entry_hash, digest, SHA128_SZ);
-        //memset(req->map_entry_entropy, 0, ENTROPY_HASH_SZ);
-        for(i = 0; i < req->config->num_carrier_blocks; i++) {
-            checksum = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE); 
-            memcpy(&req->map_entry_tuple[i].checksum, &checksum, sizeof(uint16_t));
-            req->map_entry_tuple[i].checksum = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE);
-	}
 
-        afs_req_clean(req);
+    // Newly allocated carriers only go into the map entry now that they
+    // hold the block, a checkpoint must never see them any earlier.
+    //memset(req->map_entry_entropy, 0, ENTROPY_HASH_SZ);
+    for(i = 0; i < req->config->num_carrier_blocks; i++) {
+        req->map_carriers[i] = req->block_nums[i];
+        req->map_checksums[i] = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE);
     }
-    return;
+    afs_map_dirty(req->afs_context, req->map_page, req->block);
+
+    afs_req_clean(req);
 }
 
+/**
+ * Check that carrier blocks [first, first + num_pages) of a request are
+ * page aligned, before any bio is issued for them.
+ */
 static int
-read_pages(struct afs_map_request *req, bool used_vmalloc, uint32_t num_pages) {
+afs_carriers_aligned(struct afs_map_request *req, uint32_t first, uint32_t num_pages) {
+    uint32_t i;
+
+    for (i = first; i < first + num_pages; i++) {
+        if ((uint64_t)req->carrier_blocks[i] & (AFS_BLOCK_SIZE - 1)) {
+            afs_alert("page is not aligned [%u:%u]", req->block, i);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Allocate a bio for carrier block i of a request. Carrier bios come
+ * from the instance bio set, which keeps a reserve of its own, so this
+ * never fails.
+ */
+static struct bio *
+afs_carrier_bio_alloc(struct afs_map_request *req, bool used_vmalloc, uint32_t i, unsigned int op) {
+    struct afs_carrier_bio *cb;
+    struct page *page_structure;
+    struct bio *bio;
     uint64_t sector_num;
     const int page_offset = 0;
-    int i, ret = 0;
-    struct bio **read_bios = NULL;
-    
-    read_bios = kmalloc(sizeof(struct bio *) * num_pages, GFP_KERNEL);
-    atomic_set(&req->bios_pending, num_pages);
-
-    for(i = 0; i < num_pages; i++) {
-	struct page *page_structure;
-
-        read_bios[i] = bio_alloc(GFP_NOIO, 1);
-        afs_action(!IS_ERR(read_bios[i]), ret = PTR_ERR(read_bios[i]), done, "could not allocate bio [%d]", ret);
-        // Make sure page is aligned.
-        afs_action(!((uint64_t)req->carrier_blocks[i] & (AFS_BLOCK_SIZE - 1)), ret = -EINVAL, done, "page is not aligned [%d]", ret);
-
-        // Acquire page structure and sector offset.
-        page_structure = (used_vmalloc) ? vmalloc_to_page(req->carrier_blocks[i]) : virt_to_page(req->carrier_blocks[i]);
-        sector_num = (req->block_nums[i] * AFS_SECTORS_PER_BLOCK) + req->fs->data_start_off;
-
-        read_bios[i]->bi_opf |= REQ_OP_READ;
-        bio_set_dev(read_bios[i], req->bdev);
-        read_bios[i]->bi_iter.bi_sector = sector_num;
-        bio_add_page(read_bios[i], page_structure, AFS_BLOCK_SIZE, page_offset);
-        read_bios[i]->bi_private = req;
-        read_bios[i]->bi_end_io = afs_read_endio;
-        submit_bio(read_bios[i]);
+
+    bio = bio_alloc_bioset(GFP_NOIO, 1, &req->afs_context->carrier_bs);
+    cb = afs_carrier_bio(bio);
+    cb->req = req;
+    cb->carrier = i;
+
+    // Acquire page structure and sector offset.
+    page_structure = (used_vmalloc) ? vmalloc_to_page(req->carrier_blocks[i]) : virt_to_page(req->carrier_blocks[i]);
+    sector_num = (req->block_nums[i] * AFS_SECTORS_PER_BLOCK) + req->fs->data_start_off;
+
+    bio->bi_opf = op;
+    bio_set_dev(bio, req->bdev);
+    bio->bi_iter.bi_sector = sector_num;
+    bio_add_page(bio, page_structure, AFS_BLOCK_SIZE, page_offset);
+    return bio;
+}
+
+/**
+ * Submit a carrier bio through the instance submit queue.
+ */
+static inline void
+afs_carrier_submit(struct bio *bio) {
+    struct afs_carrier_bio *cb = afs_carrier_bio(bio);
+
+    afs_submit_bio(&cb->req->afs_context->submit, &cb->link, bio);
+}
+
+/**
+ * Read carrier blocks [first, first + num_pages) of a request.
+ *
+ * Every read is chained to the last one, whose completion starts the
+ * decode once the whole batch is in. Only one bio is held back at a
+ * time, so the bio set reserve is enough to make progress.
+ */
+static int
+read_pages(struct afs_map_request *req, bool used_vmalloc, uint32_t first, uint32_t num_pages) {
+    struct bio *bio = NULL, *next;
+    uint32_t i;
+    int ret;
+
+    ret = afs_carriers_aligned(req, first, num_pages);
+    afs_assert(!ret, done, "could not read carriers [%d]", ret);
+
+    for (i = first; i < first + num_pages; i++) {
+        next = afs_carrier_bio_alloc(req, used_vmalloc, i, REQ_OP_READ);
+        if (bio) {
+            // Like bio_chain(), but the chained bio still reports which
+            // carrier failed.
+            bio->bi_private = next;
+            bio->bi_end_io = afs_read_chain_endio;
+            bio_inc_remaining(next);
+            afs_carrier_submit(bio);
+        }
+        bio = next;
     }
+    bio->bi_end_io = afs_read_endio;
+    afs_carrier_submit(bio);
+
 done:
-    for(i = 0; i < num_pages; i++) read_bios[i] = NULL;
-    kfree(read_bios);
     return ret;
 }
 
-
+/**
+ * Issue a hedged read of the first hedge_width carriers of a request.
+ * The carrier pages are handed over to the hedge.
+ *
+ * Hedged reads are not chained, each carrier is verified as soon as it
+ * arrives.
+ */
 static int
-write_pages(struct afs_map_request *req, bool used_vmalloc, uint32_t num_pages) {
-    uint64_t sector_num;
-    int i, ret = 0;
-    const int page_offset = 0;
-    struct bio **write_bios = NULL;
-   
-    write_bios = kmalloc(sizeof(struct bio *) * num_pages, GFP_KERNEL);
-    atomic_set(&req->bios_pending, num_pages);
+hedge_pages(struct afs_map_request *req, uint32_t hedge_width) {
+    struct afs_private *context = req->afs_context;
+    struct afs_hedge *hedge;
+    struct bio *bio;
+    uint32_t i;
+    int ret;
+
+    // The map function cannot wait for a hedge.
+    hedge = mempool_alloc(&context->hedge_pool, current->bio_list ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_NOIO);
+    if (!hedge) {
+        return -EAGAIN;
+    }
 
-    for(i = 0; i < num_pages; i++) {
-        struct page *page_structure;
+    ret = afs_carriers_aligned(req, 0, hedge_width);
+    afs_action(!ret, mempool_free(hedge, &context->hedge_pool), done, "could not read carriers [%d]", ret);
+
+    hedge->req = req;
+    hedge->afs_context = context;
+    hedge->valid_mask = 0;
+    hedge->bad_mask = 0;
+    hedge->flags = 0;
+    hedge->threshold = req->config->threshold;
+    hedge->num_issued = hedge_width;
+    atomic_set(&hedge->valid, 0);
+    atomic_set(&hedge->bios_pending, hedge_width);
+    // One reference for each bio and one for the request.
+    atomic_set(&hedge->refs, hedge_width + 1);
+    for (i = 0; i < NUM_MAX_CARRIER_BLKS; i++) {
+        hedge->pages[i] = (i < req->config->num_carrier_blocks) ? req->carrier_blocks[i] : NULL;
+        hedge->checksums[i] = (i < req->config->num_carrier_blocks) ? req->map_checksums[i] : 0;
+    }
+    req->hedge = hedge;
+    atomic_inc(&context->hedges);
+    atomic64_inc(&context->stats.hedged_reads);
+
+    for (i = 0; i < hedge_width; i++) {
+        bio = afs_carrier_bio_alloc(req, false, i, REQ_OP_READ);
+        bio->bi_private = hedge;
+        bio->bi_end_io = afs_hedge_endio;
+        afs_carrier_submit(bio);
+    }
 
-        write_bios[i] = bio_alloc(GFP_NOIO, 1);
-        afs_action(!IS_ERR(write_bios[i]), ret = PTR_ERR(write_bios[i]), done, "could not allocate bio [%d]", ret);
+done:
+    return ret;
+}
+
+/**
+ * Fill the part of the carriers marked in carriers that an AONT-RS share
+ * leaves unused with random bytes. Carrier pages are recycled through
+ * the page pool, whatever they held before (the plaintext of another
+ * block, say) must never reach the disk.
+ */
+static void
+afs_carrier_pad(struct afs_map_request *req, unsigned long carriers) {
+    size_t share_size = (AFS_BLOCK_SIZE + KEY_SIZE) / req->config->threshold;
+    uint32_t i;
+
+    if (req->encoding_type != AONT_RS) {
+        return;
+    }
+    for_each_set_bit (i, &carriers, req->config->num_carrier_blocks) {
+        get_random_bytes(req->carrier_blocks[i] + share_size, AFS_BLOCK_SIZE - share_size);
+    }
+}
 
-        // Make sure page is aligned.
-        afs_action(!((uint64_t)req->carrier_blocks[i] & (AFS_BLOCK_SIZE - 1)), ret = -EINVAL, done, "page is not aligned [%d]", ret);
+/**
+ * Write the carrier blocks of a request marked in carriers. Every write
+ * is chained to the last one, whose end_io completes the request.
+ */
+static int
+write_pages(struct afs_map_request *req, bool used_vmalloc, unsigned long carriers, bio_end_io_t *end_io) {
+    struct bio *bio = NULL, *next;
+    unsigned int op = REQ_OP_WRITE;
+    uint32_t num_pages = req->config->num_carrier_blocks;
+    uint32_t i;
+    int ret;
 
-        // Acquire page structure and sector offset.
-        page_structure = (used_vmalloc) ? vmalloc_to_page(req->carrier_blocks[i]) : virt_to_page(req->carrier_blocks[i]);
-        sector_num = (req->block_nums[i] * AFS_SECTORS_PER_BLOCK) + req->fs->data_start_off;
+    ret = afs_carriers_aligned(req, 0, num_pages);
+    afs_assert(!ret, done, "could not write carriers [%d]", ret);
 
-        write_bios[i]->bi_opf |= REQ_OP_WRITE;
-        bio_set_dev(write_bios[i], req->bdev);
-        write_bios[i]->bi_iter.bi_sector = sector_num;
-        bio_add_page(write_bios[i], page_structure, AFS_BLOCK_SIZE, page_offset);
-        write_bios[i]->bi_private = req;
-        write_bios[i]->bi_end_io = afs_write_endio;
-        submit_bio(write_bios[i]);
+    if (req->bio && (req->bio->bi_opf & REQ_FUA)) {
+        op |= REQ_FUA;
+    }
+    for_each_set_bit (i, &carriers, num_pages) {
+        next = afs_carrier_bio_alloc(req, used_vmalloc, i, op);
+        if (bio) {
+            bio_chain(bio, next);
+            afs_carrier_submit(bio);
+        }
+        bio = next;
     }
+    bio->bi_end_io = end_io;
+    afs_carrier_submit(bio);
+
 done:
-    for(i = 0; i < num_pages; i++) write_bios[i] = NULL;
-    kfree(write_bios);
     return ret;
 }
 
 /**
- * Rebuilds and remaps a block that has already been read and reconstructed.
+ * Finish a repair once its carrier writes have completed. The map takes
+ * the new carriers and the old ones are released, or the new ones are
+ * if the writes failed. Runs on the rebuild queue, as the allocation
+ * vector cannot be taken from a bio completion.
+ */
+static void
+afs_repair_finishq(struct work_struct *ws) {
+    struct afs_map_request *req = container_of(ws, struct afs_map_request, req_ws);
+    uint32_t carriers[NUM_MAX_CARRIER_BLKS];
+    uint32_t num_carriers = 0;
+    uint32_t i;
+
+    for_each_set_bit (i, &req->carriers_lost, req->config->num_carrier_blocks) {
+        if (req->status != BLK_STS_OK) {
+            carriers[num_carriers++] = req->block_nums[i];
+            continue;
+        }
+        carriers[num_carriers++] = req->map_carriers[i];
+        req->map_carriers[i] = req->block_nums[i];
+        req->map_checksums[i] = cityhash32_to_16(req->carrier_blocks[i], AFS_BLOCK_SIZE);
+    }
+    if (req->status == BLK_STS_OK) {
+        afs_map_dirty(req->afs_context, req->map_page, req->block);
+    }
+    allocation_free_many(req->vector, carriers, num_carriers);
+    afs_req_clean(req);
+}
+
+/**
+ * Completion of the carrier writes of a repair.
+ */
+static void
+afs_repair_endio(struct bio *bio) {
+    struct afs_map_request *req = afs_carrier_bio(bio)->req;
+
+    afs_req_error(req, bio->bi_status);
+    bio_put(bio);
+
+    INIT_WORK(&req->req_ws, afs_repair_finishq);
+    queue_work(req->afs_context->rebuild_wq, &req->req_ws);
+}
+
+/**
+ * Move the lost carriers of a block that has just been decoded. Only the
+ * lost shards are regenerated and written to newly acquired blocks, the
+ * others stay where they are. Shamir shares cannot be regenerated one at
+ * a time, so those blocks are encoded again and move entirely.
  *
+ * @shares  Shards the decode used, recovered data shards sit in the
+ *          parity pages they were recovered into.
+ * @lost    Carriers found corrupted.
  */
-int 
-rebuild_blocks(struct afs_map_request *req) {
+static int
+afs_repair_carriers(struct afs_map_request *req, uint8_t **shares, unsigned long lost) {
     struct afs_config *config = req->config;
-    int ret= 0, i;
     uint32_t block_num;
+    uint32_t i;
+    int ret = 0;
 
-    for(i = 0; i < config->num_carrier_blocks; i++) {
-        req->erasures[i] = i + '0';
-    }
-
-    if(req->encoding_type == SHAMIR){
-        req->encoder = gfshare_ctx_init_enc(req->erasures, config->num_carrier_blocks, 2, AFS_BLOCK_SIZE);
+    if (req->encoding_type == AONT_RS) {
+        for (i = 0; i < config->threshold; i++) {
+            if (shares[i] != req->carrier_blocks[i]) {
+                memcpy(req->carrier_blocks[i], shares[i], AFS_BLOCK_SIZE);
+            }
+        }
+        ret = encode_aont_parity(req->carrier_blocks, AFS_BLOCK_SIZE, config->threshold, config->num_carrier_blocks - config->threshold);
+        afs_assert(!ret, done, "could not regenerate parity [%d:%u]", ret, req->block);
+    } else if (req->encoding_type == SHAMIR) {
+        for (i = 0; i < config->num_carrier_blocks; i++) {
+            req->erasures[i] = i + '0';
+        }
+        gfshare_ctx_free(req->encoder);
+        req->encoder = gfshare_ctx_init_enc(req->erasures, config->num_carrier_blocks, config->threshold, AFS_BLOCK_SIZE);
+        afs_action(req->encoder, ret = -ENOMEM, done, "could not set up Shamir encoder [%d:%u]", ret, req->block);
         gfshare_ctx_enc_getshares(req->encoder, req->data_block, req->carrier_blocks);
-    }else if(req->encoding_type == AONT_RS){
-        encode_aont_package(req->map_entry_difference, req->data_block, AFS_BLOCK_SIZE, req->carrier_blocks, 2, config->num_carrier_blocks - 2, (uint64_t*)req->iv);
+        lost = BIT(config->num_carrier_blocks) - 1;
     }
 
-    for (i = 0; i < config->num_carrier_blocks; i++) {
-        // Allocate new block, or use old one.
-        block_num = acquire_block(req->fs, req->vector);
-        afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOSPC, reset_entry, "no free space left");
-        req->map_entry_tuple[i].carrier_block_ptr = block_num;
+    req->carriers_lost = 0;
+    for_each_set_bit (i, &lost, config->num_carrier_blocks) {
+        ret = afs_acquire_carrier(req, &block_num);
+        afs_assert(!ret, reset, "could not acquire carrier [%d:%u]", ret, req->block);
         req->block_nums[i] = block_num;
-        memcpy(req->carrier_blocks[i], req->data_block, AFS_BLOCK_SIZE);
+        __set_bit(i, &req->carriers_lost);
     }
-    ret = write_pages(req, false, config->num_carrier_blocks);
-    afs_action(!ret, ret = -EIO, reset_entry, "could not write page at block [%u]", block_num);
+
+    afs_carrier_pad(req, req->carriers_lost);
+    ret = write_pages(req, false, req->carriers_lost, afs_repair_endio);
+    afs_action(!ret, ret = -EIO, reset, "could not write carriers of block [%u]", req->block);
+    return 0;
+
+reset:
+    for_each_set_bit (i, &req->carriers_lost, config->num_carrier_blocks) {
+        allocation_free(req->vector, req->block_nums[i]);
+    }
+    req->carriers_lost = 0;
+
+done:
     return ret;
+}
+
+/**
+ * Start reading the carriers of a mapped block. The decode continues
+ * once they have arrived.
+ */
+static int
+afs_read_carriers(struct afs_map_request *req, uint8_t read_mode) {
+    struct afs_config *config = req->config;
+    int ret;
+    int i;
+
+    if (req->encoding_type == SHAMIR) {
+        req->encoder = gfshare_ctx_init_dec(req->erasures, config->num_carrier_blocks, config->threshold, AFS_BLOCK_SIZE);
+    }
 
-reset_entry:
     for (i = 0; i < config->num_carrier_blocks; i++) {
-        if (req->map_entry_tuple[i].carrier_block_ptr != AFS_INVALID_BLOCK) {
-            allocation_free(req->vector, req->map_entry_tuple[i].carrier_block_ptr);
-        }
-        req->map_entry_tuple[i].carrier_block_ptr = AFS_INVALID_BLOCK;
+        req->block_nums[i] = req->map_carriers[i];
+        req->erasures[i] = i + '0';
     }
-    if(req->encoding_type == SHAMIR){
-        gfshare_ctx_free(req->encoder);
-        req->encoder = NULL;
+
+    req->read_mode = read_mode;
+    switch (req->read_mode) {
+    case READ_MODE_THRESHOLD:
+        req->carriers_read = config->threshold;
+        ret = read_pages(req, false, 0, req->carriers_read);
+        break;
+
+    case READ_MODE_HEDGED:
+        req->carriers_read = req->afs_context->args.hedge_width;
+        if (!req->carriers_read) {
+            req->carriers_read = config->threshold + 1;
+        }
+        req->carriers_read = clamp_t(uint8_t, req->carriers_read, config->threshold, config->num_carrier_blocks);
+        ret = hedge_pages(req, req->carriers_read);
+        if (ret != -EAGAIN) {
+            break;
+        }
+        // Without a hedge the block is read like any other.
+        req->read_mode = READ_MODE_FULL;
+        req->carriers_read = config->num_carrier_blocks;
+        ret = read_pages(req, false, 0, req->carriers_read);
+        break;
+
+    default:
+        req->carriers_read = config->num_carrier_blocks;
+        ret = read_pages(req, false, 0, req->carriers_read);
     }
     return ret;
 }
 
-
 /**
  * Perform a basic rebuild request, essentially a stripped down read that doesn't have an originating BIO
  */
 int
 afs_rebuild_request(struct afs_map_request *req){
     int ret = 0;
-    int i = 0;
 
     afs_action(atomic64_read(&req->state) == REQ_STATE_FLIGHT, ret = -EINVAL, done, "Request already completed");
 
-    req->map_entry = afs_get_map_entry(req->map, req->config, req->block);
-    req->map_entry_tuple = (struct afs_map_tuple *)req->map_entry;
-    req->map_entry_hash = req->map_entry + (req->config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
-    req->map_entry_difference = req->map_entry + (req->config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
+    ret = afs_req_map_entry(req);
+    afs_assert(!ret, done, "could not get map entry [%d:%u]", ret, req->block);
 
-    if (req->map_entry_tuple[0].carrier_block_ptr == AFS_INVALID_BLOCK) {
+    if (req->map_carriers[0] == AFS_INVALID_BLOCK) {
         afs_req_clean(req);
     } else {
-        if (req->encoding_type == SHAMIR) {
-            req->encoder = gfshare_ctx_init_dec(req->erasures, req->config->num_carrier_blocks, 2, AFS_BLOCK_SIZE);
-        }
+        ret = afs_req_alloc_pages(req);
+        afs_assert(!ret, done, "could not allocate request pages [%d]", ret);
 
-        for (i = 0; i < req->config->num_carrier_blocks; i++) {
-            req->block_nums[i] = req->map_entry_tuple[i].carrier_block_ptr;
-            req->erasures[i] = i + '0';
-        }
-        ret = read_pages(req, false, req->config->num_carrier_blocks);
-        afs_action(!ret, ret = -EIO, done, "could not read page at block [%u]", req->map_entry_tuple[i].carrier_block_ptr);
+        // Rebuilds always verify every carrier.
+        ret = afs_read_carriers(req, READ_MODE_FULL);
+        afs_action(!ret, ret = -EIO, done, "could not read carriers of block [%u]", req->block);
     }
 done:
     return ret;
@@ -427,123 +1124,174 @@ done:
  */
 int
 afs_read_request(struct afs_map_request *req, struct bio *bio) {
-    struct bio_vec bv;
-    struct bvec_iter iter;
-    uint8_t *bio_data = NULL;
-    uint32_t segment_offset;
     int ret = 0;
-    int i = 0;
 
     afs_action(req != NULL && bio != NULL, ret = -EIO, done, "already freed request");
     afs_action(atomic64_read(&req->state) == REQ_STATE_FLIGHT, ret = -EINVAL, done, "Request already completed");
 
     //afs_debug("read request [Size: %u | Block: %u | Sector Off: %u]", req_size, req->block, sector_offset);
 
-    req->map_entry = afs_get_map_entry(req->map, req->config, req->block);
-    req->map_entry_tuple = (struct afs_map_tuple *)req->map_entry;
-    req->map_entry_hash = req->map_entry + (req->config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
-    req->map_entry_difference = req->map_entry + (req->config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
-    //req->map_entry_entropy = req->map_entry_hash + CARRIER_HASH_SZ;
-
-    //The block is unallocated, zero fill the data block, remap and return, clean up request
-    if (req->map_entry_tuple[0].carrier_block_ptr == AFS_INVALID_BLOCK) {
-        memset(req->data_block, 0, AFS_BLOCK_SIZE);
-        segment_offset = 0;
-        bio_for_each_segment (bv, bio, iter) {
-            bio_data = kmap(bv.bv_page);
-            if (bv.bv_len <= (req->request_size - segment_offset)) {
-                memcpy(bio_data + bv.bv_offset, req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, bv.bv_len);
-            } else {
-                memcpy(bio_data + bv.bv_offset, req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, req->request_size - segment_offset);
-                kunmap(bv.bv_page);
-                break;
-            }
-            segment_offset += bv.bv_len;
-            kunmap(bv.bv_page);
-        }
+    // A map block that is not in memory cannot be read from the map
+    // function, the caller starts the read again from the flight queue.
+    ret = afs_req_map_entry(req);
+    if (ret) {
+        goto done;
+    }
+
+    // Anything written to the block from here on makes our decoded copy
+    // too old for the cache.
+    req->cache_gen = afs_cache_gen(&req->afs_context->cache, req->block);
+
+    // Dirty blocks only exist in the cache, clean ones are just cheaper
+    // to copy from there.
+    if (afs_cache_read_iter(&req->afs_context->cache, req->block, req->sector_offset * AFS_SECTOR_SIZE, req->bio, afs_req_bio_iter(req))) {
         afs_req_clean(req);
-    } else {
-	if (req->encoding_type == SHAMIR) {
-            req->encoder = gfshare_ctx_init_dec(req->erasures, req->config->num_carrier_blocks, 2, AFS_BLOCK_SIZE);
-        }
+        return 0;
+    }
 
-        for (i = 0; i < req->config->num_carrier_blocks; i++) {
-            req->block_nums[i] = req->map_entry_tuple[i].carrier_block_ptr;
-            req->erasures[i] = i + '0';
+    //The block is unallocated, zero fill the bio and clean up the request. There
+    //are no carriers to read so we never need the request pages.
+    if (req->map_carriers[0] == AFS_INVALID_BLOCK) {
+        afs_bio_copy(req, page_address(ZERO_PAGE(0)), true);
+        afs_req_clean(req);
+    } else {
+        // Without pages the read is started again from the flight queue,
+        // which looks the map entry up again.
+        ret = afs_req_alloc_pages(req);
+        if (ret == -EAGAIN) {
+            afs_map_put(req->map, req->map_page);
+            req->map_page = NULL;
+            goto done;
         }
-        ret = read_pages(req, false, req->config->num_carrier_blocks);
-        afs_action(!ret, ret = -EIO, done, "could not read page at block [%u]", req->map_entry_tuple[i].carrier_block_ptr);
+        afs_assert(!ret, done, "could not allocate request pages [%d]", ret);
+
+        // AONT-RS shares are systematic, so a healthy block can be decoded
+        // from its data shards alone. Parity is fetched only when needed.
+        // A hedged read issues extra carriers up front and decodes from
+        // whichever valid ones arrive first.
+        ret = afs_read_carriers(req, (req->encoding_type == AONT_RS) ? req->afs_context->args.read_mode : READ_MODE_FULL);
+        afs_action(!ret, ret = -EIO, done, "could not read carriers of block [%u]", req->block);
     }
 
 done:
     return ret;
 }
 
-//TODO perform a check based on a remap or corrupt block flag to remap corrupted blocks on read
 /**
- * Map a write request from userspace.
+ * Read a block ahead of a sequential stream. Blocks that are unmapped or
+ * already cached are left alone.
  */
 int
-afs_write_request(struct afs_map_request *req, struct bio *bio)
-{
-    struct afs_config *config = NULL;
-    struct bio_vec bv;
-    struct bvec_iter iter;
-    uint8_t *bio_data = NULL;
-    uint32_t block_num;
-    uint32_t segment_offset;
-    bool modification = false;
-    int ret = 0, i;
+afs_prefetch_request(struct afs_map_request *req) {
+    int ret = 0;
 
-    afs_action(atomic64_read(&req->state) == REQ_STATE_FLIGHT, ret = -EINVAL, err, "Request already completed");
+    ret = afs_req_map_entry(req);
+    if (ret) {
+        goto done;
+    }
+    req->cache_gen = afs_cache_gen(&req->afs_context->cache, req->block);
 
-    config = req->config;
+    if (req->map_carriers[0] == AFS_INVALID_BLOCK || afs_cache_contains(&req->afs_context->cache, req->block)) {
+        afs_req_clean(req);
+        return 0;
+    }
 
-    req->map_entry = afs_get_map_entry(req->map, config, req->block);
-    req->map_entry_tuple = (struct afs_map_tuple *)req->map_entry;
-    //TODO the hash is specific to the secret sharing version
-    req->map_entry_hash = req->map_entry + (config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
-    req->map_entry_difference = req->map_entry + (config->num_carrier_blocks * sizeof(*req->map_entry_tuple));
-    req->map_entry_entropy = req->map_entry_hash + CARRIER_HASH_SZ;
-    //afs_debug("write request [Size: %u | Block: %u | Sector Off: %u]", req_size, block_num, sector_offset);
+    ret = afs_req_alloc_pages(req);
+    afs_assert(!ret, done, "could not allocate request pages [%d]", ret);
+
+    // Prefetches are not latency bound, so they never hedge.
+    atomic64_inc(&req->afs_context->stats.prefetches);
+    ret = afs_read_carriers(req, (req->encoding_type == AONT_RS) ? READ_MODE_THRESHOLD : READ_MODE_FULL);
+    afs_action(!ret, ret = -EIO, done, "could not read carriers of block [%u]", req->block);
 
+done:
+    return ret;
+}
 
-    // If this write is a modification, then we perform a read-modify-write.
-    // Otherwise, a new block is allocated and written to. We perform the
-    // read of the block regardless because if the block is indeed unmapped, then
-    // the data block will be simply zero'ed out.
+/**
+ * Clear a map entry, leaving the block unmapped. The carriers it held are
+ * collected in carriers for the caller to free.
+ *
+ * @return  Number of carriers collected.
+ */
+static uint32_t
+afs_map_entry_clear(struct afs_map *map, uint32_t *entry_carriers, uint16_t *entry_checksums, uint32_t *carriers) {
+    uint32_t num_carriers = 0;
+    uint32_t i;
+
+    if (entry_carriers[0] == AFS_INVALID_BLOCK) {
+        return 0;
+    }
+    for (i = 0; i < map->num_carrier_blocks; i++) {
+        if (entry_carriers[i] != AFS_INVALID_BLOCK) {
+            carriers[num_carriers++] = entry_carriers[i];
+        }
+        entry_carriers[i] = AFS_INVALID_BLOCK;
+        entry_checksums[i] = 0;
+    }
+    return num_carriers;
+}
 
-    if (req->map_entry_tuple[0].carrier_block_ptr != AFS_INVALID_BLOCK) {
-        modification = true;
-        //ret = __afs_read_block(req);
-        afs_assert(!ret, err, "could not read data block [%d:%u]", ret, block_num);
+/**
+ * Unmap the block of a write that only holds zeroes. Unmapped blocks
+ * read back as zeroes, so there is nothing to encode or write.
+ */
+static void
+afs_write_zero_block(struct afs_map_request *req) {
+    uint32_t carriers[NUM_MAX_CARRIER_BLKS];
+    uint32_t num_carriers;
+
+    num_carriers = afs_map_entry_clear(req->map, req->map_carriers, req->map_checksums, carriers);
+    if (num_carriers) {
+        afs_map_dirty(req->afs_context, req->map_page, req->block);
     }
+    allocation_free_many(req->vector, carriers, num_carriers);
+    afs_req_clean(req);
+}
 
-    // Copy from the segments.
-    // NOTE: We don't technically need this complicated way
-    // of copying, because write bio's are a single contiguous
-    // page (because writes are cloned bio's). However, it does
-    // not hurt to keep it since it doesn't result in a performance
-    // degradation, and may help in future optimizations where we
-    // may have multiple pages in a write bio.
-    //
-    // NOTE: ^This case is only true if the __clone_bio function
-    // in dm_afs.c has override disabled. As of 3rd March 2019, the
-    // override has been enabled due to massive lock contention.
+/**
+ * Merge a write into its block, encode the block and write out the
+ * carriers. The data block already holds whatever the write does not
+ * cover.
+ */
+static int
+afs_write_encode(struct afs_map_request *req)
+{
+    struct afs_config *config = req->config;
+    struct page *page = NULL;
+    uint8_t *data = NULL;
+    uint8_t difference[CARRIER_HASH_SZ];
+    uint32_t block_num;
+    int ret = 0, i;
 
-    segment_offset = 0;
-    bio_for_each_segment (bv, bio, iter) {
-        bio_data = kmap(bv.bv_page);
-        if (bv.bv_len <= (req->request_size - segment_offset)) {
-            memcpy(req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, bio_data + bv.bv_offset, bv.bv_len);
+    // Whole blocks sitting in a single page of the bio are encoded
+    // straight from that page. Otherwise copy in the part of the bio
+    // covered by this block.
+    data = req->data_block;
+    page = afs_req_bio_page(req);
+    if (page) {
+        data = kmap(page);
+    } else if (req->bio) {
+        if (bio_op(req->bio) == REQ_OP_WRITE_ZEROES) {
+            memset(req->data_block + (req->sector_offset * AFS_SECTOR_SIZE), 0, req->request_size);
         } else {
-            memcpy(req->data_block + (req->sector_offset * AFS_SECTOR_SIZE) + segment_offset, bio_data + bv.bv_offset, req->request_size - segment_offset);
-            kunmap(bv.bv_page);
-            break;
+            afs_bio_copy(req, req->data_block, false);
         }
-        segment_offset += bv.bv_len;
-        kunmap(bv.bv_page);
     }
+    if (req->bio) {
+        afs_cache_write(&req->afs_context->cache, req->block, data);
+    }
+
+    // Blocks of zeroes are common (file system images, preallocated
+    // files) and do not need carriers at all.
+    if (!memchr_inv(data, 0, AFS_BLOCK_SIZE)) {
+        if (page) {
+            kunmap(page);
+        }
+        afs_write_zero_block(req);
+        return 0;
+    }
+
     //TODO update this to better reflect the total number of carrier blocks
     for(i = 0; i < config->num_carrier_blocks; i++){
         req->erasures[i] = i + '0';
@@ -551,39 +1299,193 @@ afs_write_request(struct afs_map_request *req, struct bio *bio)
 
     //encode the block
     if(req->encoding_type == SHAMIR){
-        req->encoder = gfshare_ctx_init_enc(req->erasures, config->num_carrier_blocks, 2, AFS_BLOCK_SIZE);
-	gfshare_ctx_enc_getshares(req->encoder, req->data_block, req->carrier_blocks);
+        req->encoder = gfshare_ctx_init_enc(req->erasures, config->num_carrier_blocks, config->threshold, AFS_BLOCK_SIZE);
+        if (req->encoder) {
+            gfshare_ctx_enc_getshares(req->encoder, data, req->carrier_blocks);
+        } else {
+            ret = -ENOMEM;
+        }
     } else if (req->encoding_type == AONT_RS){
-        encode_aont_package(req->map_entry_difference, req->data_block, AFS_BLOCK_SIZE, req->carrier_blocks, 2, config->num_carrier_blocks - 2, (uint64_t*)req->iv);
+        ret = encode_aont_package(difference, data, AFS_BLOCK_SIZE, req->carrier_blocks, config->threshold,
+            config->num_carrier_blocks - config->threshold, (uint64_t*)req->iv);
+    }
+    if (page) {
+        kunmap(page);
+    }
+    afs_assert(!ret, reset_entry, "could not encode block [%d:%u]", ret, req->block);
+
+    // A modification overwrites the carriers of the block in place,
+    // otherwise new ones are allocated. Those are staged in block_nums,
+    // the map entry only takes them once they have been written.
+    req->allocated = (req->map_carriers[0] == AFS_INVALID_BLOCK);
+    if (req->allocated) {
+        memset32(req->block_nums, AFS_INVALID_BLOCK, config->num_carrier_blocks);
     }
-
-
     for (i = 0; i < config->num_carrier_blocks; i++) {
         // Allocate new block, or use old one.
-        //allocation_free(req->vector, req->map_entry_tuple[i].carrier_block_ptr);
-        block_num = (modification) ? req->map_entry_tuple[i].carrier_block_ptr : acquire_block(req->fs, req->vector);
+        //allocation_free(req->vector, req->map_carriers[i]);
+        block_num = req->map_carriers[i];
+        if (req->allocated) {
+            ret = afs_acquire_carrier(req, &block_num);
+            afs_assert(!ret, reset_entry, "could not acquire carrier [%d:%u]", ret, req->block);
+        }
 	//afs_debug("block num %u", block_num);
-        afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOSPC, reset_entry, "no free space left");
-        req->map_entry_tuple[i].carrier_block_ptr = block_num;
 	req->block_nums[i] = block_num;
         //memcpy(req->carrier_blocks[i], req->data_block, AFS_BLOCK_SIZE);
     }
-    ret = write_pages(req, false, config->num_carrier_blocks);
+    afs_carrier_pad(req, BIT(config->num_carrier_blocks) - 1);
+    ret = write_pages(req, false, BIT(config->num_carrier_blocks) - 1, afs_write_endio);
     afs_action(!ret, ret = -EIO, reset_entry, "could not write page at block [%u]", block_num);
     return ret;
 
 reset_entry:
-    for (i = 0; i < config->num_carrier_blocks; i++) {
-        if (req->map_entry_tuple[i].carrier_block_ptr != AFS_INVALID_BLOCK) {
-            allocation_free(req->vector, req->map_entry_tuple[i].carrier_block_ptr);
-        }
-        req->map_entry_tuple[i].carrier_block_ptr = AFS_INVALID_BLOCK;
+    if (req->bio) {
+        afs_cache_invalidate(&req->afs_context->cache, req->block);
     }
-    if (req->encoding_type == SHAMIR) {
+    // Carriers allocated here are released again. A block written in
+    // place keeps its carriers and checksums, nothing was written to it.
+    afs_write_unmap(req);
+    if (req->encoding_type == SHAMIR && req->encoder) {
         gfshare_ctx_free(req->encoder);
     }
     req->encoder = NULL;
+    return ret;
+}
+
+//TODO perform a check based on a remap or corrupt block flag to remap corrupted blocks on read
+/**
+ * Map a write request from userspace.
+ */
+int
+afs_write_request(struct afs_map_request *req, struct bio *bio)
+{
+    struct afs_config *config = NULL;
+    int ret = 0;
+
+    afs_action(atomic64_read(&req->state) == REQ_STATE_FLIGHT, ret = -EINVAL, err, "Request already completed");
+
+    config = req->config;
+    ret = afs_req_map_entry(req);
+    afs_assert(!ret, err, "could not get map entry [%d:%u]", ret, req->block);
+
+    // Zeroing a whole block needs neither its old contents nor pages.
+    if (req->bio && bio_op(req->bio) == REQ_OP_WRITE_ZEROES && req->request_size == AFS_BLOCK_SIZE) {
+        afs_cache_discard(&req->afs_context->cache, req->block);
+        afs_write_zero_block(req);
+        return 0;
+    }
+
+    ret = afs_req_alloc_pages(req);
+    afs_assert(!ret, err, "could not allocate request pages [%d]", ret);
+
+    // A writeback only takes the contents of its block once it holds the
+    // lock on it. Any write acknowledged before then is in the cache
+    // already, and one that came after the block was last written back
+    // left nothing dirty.
+    if (!req->bio && !afs_cache_writeback(&req->afs_context->cache, req->block, req->data_block)) {
+        afs_req_clean(req);
+        return 0;
+    }
+
+    //afs_debug("write request [Size: %u | Block: %u | Sector Off: %u]", req_size, block_num, sector_offset);
+
+    // A partial write is a read-modify-write. What it does not cover comes
+    // from the cache if possible, an unmapped block is all zeroes, and
+    // otherwise the block is read and decoded first. That read completes
+    // asynchronously, and the decode resumes the write in
+    // afs_write_encode() without ever blocking a worker.
+    if (req->bio && req->request_size != AFS_BLOCK_SIZE &&
+        !afs_cache_read_block(&req->afs_context->cache, req->block, req->data_block)) {
+        if (req->map_carriers[0] == AFS_INVALID_BLOCK) {
+            memset(req->data_block, 0, AFS_BLOCK_SIZE);
+        } else {
+            // Hedged reads leave carrier pages to late bios, so they are
+            // never used for a block that is about to be encoded again.
+            req->rmw = true;
+            atomic64_inc(&req->afs_context->stats.rmw_reads);
+            ret = afs_read_carriers(req, (req->encoding_type == AONT_RS) ? READ_MODE_THRESHOLD : READ_MODE_FULL);
+            afs_action(!ret, ret = -EIO, err, "could not read carriers of block [%u]", req->block);
+            return 0;
+        }
+    }
+
+    ret = afs_write_encode(req);
 
 err:
     return ret;
 }
+
+/**
+ * Map a discard request from userspace.
+ *
+ * Every block the discard covers entirely is unmapped and its carriers
+ * are released. Blocks are handled in order from req->block on, under
+ * the lock of the request, and carriers are handed back to the
+ * allocation vector in batches under one lock. A block somebody else is
+ * working on parks the discard behind them, it goes on from that block
+ * once the lock is handed over, holding it already.
+ */
+int
+afs_discard_request(struct afs_map_request *req, struct bio *bio) {
+    struct afs_config *config = req->config;
+    struct afs_map_page *page = NULL;
+    uint32_t carriers[AFS_DISCARD_BATCH + NUM_MAX_CARRIER_BLKS];
+    uint32_t num_carriers = 0;
+    uint32_t cleared;
+    uint64_t end;
+    int ret = 0;
+
+    end = bio_end_sector(bio) / AFS_SECTORS_PER_BLOCK;
+    end = min_t(uint64_t, end, config->num_blocks);
+
+    for (; req->block < end; req->block++) {
+        // Consecutive blocks share map blocks, one page is held at a
+        // time.
+        if (!page || page->index != afs_map_index(req->map, req->block)) {
+            if (page) {
+                afs_map_put(req->map, page);
+            }
+            page = afs_map_get(req->map, req->block);
+            if (IS_ERR(page)) {
+                ret = PTR_ERR(page);
+                page = NULL;
+                afs_alert("could not get map entry [%d:%u]", ret, req->block);
+                break;
+            }
+        }
+
+        // Nothing is held while the discard waits.
+        if (!afs_block_locked(&req->lock) && !afs_block_lock(&req->afs_context->locks, &req->lock, req->block)) {
+            allocation_free_many(req->vector, carriers, num_carriers);
+            afs_map_put(req->map, page);
+            return 0;
+        }
+        afs_cache_discard(&req->afs_context->cache, req->block);
+
+        cleared = afs_map_entry_clear(req->map, afs_map_carriers(req->map, page, req->block),
+            afs_map_checksums(req->map, page, req->block), carriers + num_carriers);
+        if (cleared) {
+            afs_map_dirty(req->afs_context, page, req->block);
+            num_carriers += cleared;
+        }
+        afs_block_unlock(&req->afs_context->locks, &req->lock);
+
+        if (num_carriers >= AFS_DISCARD_BATCH) {
+            allocation_free_many(req->vector, carriers, num_carriers);
+            num_carriers = 0;
+            cond_resched();
+        }
+    }
+    allocation_free_many(req->vector, carriers, num_carriers);
+    if (page) {
+        afs_map_put(req->map, page);
+    }
+
+    // Blocks left mapped still read back as they were, which a discard
+    // allows for.
+    if (ret) {
+        afs_req_error(req, BLK_STS_IOERR);
+    }
+    afs_req_clean(req);
+    return 0;
+}
@@ -9,6 +9,15 @@
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <linux/gfp.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+
+// Transfers of a batch, waited for together.
+struct afs_io_batch {
+    atomic_t pending;
+    struct completion done;
+    blk_status_t status;
+};
 
 /**
  * Read or write to an block device.
@@ -36,6 +45,10 @@ afs_blkdev_io(struct afs_io *request)
         bio->bi_opf |= REQ_OP_WRITE;
         break;
 
+    case IO_WRITE_FUA:
+        bio->bi_opf |= REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA;
+        break;
+
     default:
         afs_action(0, ret = -EINVAL, invalid_type, "invalid IO type [%d]", request->type);
     }
@@ -44,9 +57,9 @@ afs_blkdev_io(struct afs_io *request)
     bio->bi_iter.bi_sector = request->io_sector;
     bio_add_page(bio, request->io_page, request->io_size, page_offset);
 
-    submit_bio_wait(bio);
+    ret = submit_bio_wait(bio);
     kfree(bio);
-    return 0;
+    return ret;
 
 invalid_type:
     bio_endio(bio);
@@ -102,8 +115,8 @@ done:
 /**
  * Write a single page.
  */
-int
-write_page(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset, bool used_vmalloc)
+static int
+afs_write_page(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset, bool used_vmalloc, enum afs_io_type type)
 {
     struct afs_io request;
     struct page *page_structure;
@@ -131,7 +144,7 @@ write_page(const void *page, struct block_device *bdev, uint32_t block_num, uint
     request.io_page = page_structure;
     request.io_sector = sector_num;
     request.io_size = AFS_BLOCK_SIZE;
-    request.type = IO_WRITE;
+    request.type = type;
 
     ret = afs_blkdev_io(&request);
     afs_assert(!ret, done, "error in writing block device [%d]", ret);
@@ -142,3 +155,94 @@ done:
     }
     return ret;
 }
+
+/**
+ * Write a single page.
+ */
+int
+write_page(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset, bool used_vmalloc)
+{
+    return afs_write_page(page, bdev, block_num, sector_offset, used_vmalloc, IO_WRITE);
+}
+
+/**
+ * Write a single page with a preflush and FUA.
+ */
+int
+write_page_fua(const void *page, struct block_device *bdev, uint32_t block_num, uint32_t sector_offset, bool used_vmalloc)
+{
+    return afs_write_page(page, bdev, block_num, sector_offset, used_vmalloc, IO_WRITE_FUA);
+}
+
+/**
+ * Flush the volatile write cache of a block device.
+ */
+int
+afs_blkdev_flush(struct block_device *bdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+    return blkdev_issue_flush(bdev);
+#else
+    return blkdev_issue_flush(bdev, GFP_NOIO);
+#endif
+}
+
+
+/**
+ * Completion of a transfer in a batch.
+ */
+static void
+afs_batch_endio(struct bio *bio)
+{
+    struct afs_io_batch *batch = bio->bi_private;
+
+    if (bio->bi_status) {
+        batch->status = bio->bi_status;
+    }
+    bio_put(bio);
+    if (atomic_dec_and_test(&batch->pending)) {
+        complete(&batch->done);
+    }
+}
+
+/**
+ * Read or write a batch of pages.
+ *
+ * @return  0       Every transfer succeeded.
+ * @return  <0      Error of a failed transfer.
+ */
+int
+afs_blkdev_batch(uint8_t **pages, uint32_t *block_nums, uint32_t num_pages, struct block_device *bdev, uint32_t sector_offset, bool used_vmalloc, enum afs_io_type type)
+{
+    struct afs_io_batch batch;
+    struct blk_plug plug;
+    struct bio *bio;
+    uint32_t i;
+
+    atomic_set(&batch.pending, 1);
+    init_completion(&batch.done);
+    batch.status = BLK_STS_OK;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < num_pages; i++) {
+        bio = bio_alloc(GFP_NOIO, 1);
+        bio->bi_opf = (type == IO_READ) ? REQ_OP_READ : REQ_OP_WRITE;
+        if (type == IO_WRITE_FUA) {
+            bio->bi_opf |= REQ_PREFLUSH | REQ_FUA;
+        }
+        bio_set_dev(bio, bdev);
+        bio->bi_iter.bi_sector = ((sector_t)block_nums[i] * AFS_SECTORS_PER_BLOCK) + sector_offset;
+        bio_add_page(bio, (used_vmalloc) ? vmalloc_to_page(pages[i]) : virt_to_page(pages[i]), AFS_BLOCK_SIZE, 0);
+        bio->bi_private = &batch;
+        bio->bi_end_io = afs_batch_endio;
+        atomic_inc(&batch.pending);
+        submit_bio(bio);
+    }
+    blk_finish_plug(&plug);
+
+    if (atomic_dec_and_test(&batch.pending)) {
+        complete(&batch.done);
+    }
+    wait_for_completion(&batch.done);
+    return blk_status_to_errno(batch.status);
+}
@@ -0,0 +1,161 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_lock.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/**
+ * Bucket a block hashes to.
+ */
+static inline struct afs_lock_bucket *
+afs_lock_bucket(struct afs_lock_table *table, uint32_t block) {
+    return &table->buckets[hash_32(block, table->bits)];
+}
+
+/**
+ * Find the holder of a block. Bucket lock must be held.
+ */
+static struct afs_block_lock *
+afs_lock_holder(struct afs_lock_bucket *bucket, uint32_t block) {
+    struct afs_block_lock *holder;
+
+    list_for_each_entry (holder, &bucket->held, node) {
+        if (holder->block == block) {
+            return holder;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Initialize a lock table.
+ */
+int
+afs_lock_table_init(struct afs_lock_table *table, struct workqueue_struct *wq) {
+    uint32_t i;
+
+    table->bits = AFS_LOCK_TABLE_BITS;
+    table->wq = wq;
+    atomic_set(&table->nr_held, 0);
+    init_waitqueue_head(&table->idle);
+    table->buckets = vmalloc(sizeof(*table->buckets) << table->bits);
+    if (!table->buckets) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < (1U << table->bits); i++) {
+        spin_lock_init(&table->buckets[i].lock);
+        INIT_LIST_HEAD(&table->buckets[i].held);
+    }
+    return 0;
+}
+
+/**
+ * Release a lock table.
+ */
+void
+afs_lock_table_exit(struct afs_lock_table *table) {
+    vfree(table->buckets);
+    table->buckets = NULL;
+}
+
+/**
+ * Wait until no lock is held.
+ */
+void
+afs_lock_table_wait_idle(struct afs_lock_table *table) {
+    wait_event(table->idle, !atomic_read(&table->nr_held));
+}
+
+/**
+ * Initialize a lock.
+ */
+void
+afs_block_lock_init(struct afs_block_lock *lock, work_func_t func) {
+    INIT_LIST_HEAD(&lock->node);
+    INIT_LIST_HEAD(&lock->waiters);
+    INIT_WORK(&lock->work, func);
+}
+
+/**
+ * Take the lock on a block, or wait for it behind the holder.
+ */
+bool
+afs_block_lock(struct afs_lock_table *table, struct afs_block_lock *lock, uint32_t block) {
+    struct afs_lock_bucket *bucket = afs_lock_bucket(table, block);
+    struct afs_block_lock *holder;
+    unsigned long flags;
+
+    lock->block = block;
+    spin_lock_irqsave(&bucket->lock, flags);
+    holder = afs_lock_holder(bucket, block);
+    if (holder) {
+        list_add_tail(&lock->node, &holder->waiters);
+    } else {
+        list_add(&lock->node, &bucket->held);
+        atomic_inc(&table->nr_held);
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return !holder;
+}
+
+/**
+ * Take the lock on a block if nobody holds it.
+ */
+bool
+afs_block_trylock(struct afs_lock_table *table, struct afs_block_lock *lock, uint32_t block) {
+    struct afs_lock_bucket *bucket = afs_lock_bucket(table, block);
+    struct afs_block_lock *holder;
+    unsigned long flags;
+
+    lock->block = block;
+    spin_lock_irqsave(&bucket->lock, flags);
+    holder = afs_lock_holder(bucket, block);
+    if (!holder) {
+        list_add(&lock->node, &bucket->held);
+        atomic_inc(&table->nr_held);
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    return !holder;
+}
+
+/**
+ * Release a block lock.
+ */
+void
+afs_block_unlock(struct afs_lock_table *table, struct afs_block_lock *lock) {
+    struct afs_lock_bucket *bucket;
+    struct afs_block_lock *next = NULL;
+    unsigned long flags;
+
+    if (list_empty(&lock->node)) {
+        return;
+    }
+
+    bucket = afs_lock_bucket(table, lock->block);
+    spin_lock_irqsave(&bucket->lock, flags);
+    list_del_init(&lock->node);
+
+    // The oldest waiter becomes the holder, and inherits everyone
+    // queued behind it.
+    if (!list_empty(&lock->waiters)) {
+        next = list_first_entry(&lock->waiters, struct afs_block_lock, node);
+        list_del_init(&next->node);
+        list_splice_tail_init(&lock->waiters, &next->waiters);
+        list_add(&next->node, &bucket->held);
+    }
+    spin_unlock_irqrestore(&bucket->lock, flags);
+
+    // A lock handed over stays held.
+    if (next) {
+        queue_work(table->wq, &next->work);
+    } else if (atomic_dec_and_test(&table->nr_held)) {
+        wake_up(&table->idle);
+    }
+}
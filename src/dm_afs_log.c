@@ -0,0 +1,337 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_io.h>
+#include <dm_afs_log.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/**
+ * Log block seq in memory.
+ */
+static inline struct afs_log_header *
+afs_log_block(struct afs_log *log, uint64_t seq)
+{
+    return (struct afs_log_header *)(log->pages + ((seq % log->num_blocks) * AFS_BLOCK_SIZE));
+}
+
+/**
+ * Make seq the head block, holding count records so far. Lock must be
+ * held, or the log not yet in use.
+ */
+static void
+afs_log_start_block(struct afs_log *log, uint64_t seq, uint32_t count)
+{
+    struct afs_log_header *header = afs_log_block(log, seq);
+
+    memset(header, 0, AFS_BLOCK_SIZE);
+    header->id = log->id;
+    header->seq = seq;
+    header->count = count;
+    log->head = seq;
+    log->count = count;
+}
+
+/**
+ * Initialize a log with nowhere to write.
+ */
+void
+afs_log_init(struct afs_log *log)
+{
+    memset(log, 0, sizeof(*log));
+    spin_lock_init(&log->lock);
+    mutex_init(&log->commit_lock);
+}
+
+/**
+ * Open a log kept in the given blocks.
+ */
+int
+afs_log_open(struct afs_log *log, uint64_t id, const uint32_t *blocks, uint32_t num_blocks, uint32_t record_sz,
+    uint64_t tail, uint32_t tail_count, struct block_device *bdev, uint32_t sector_offset)
+{
+    int ret;
+
+    log->pages = vzalloc(num_blocks * AFS_BLOCK_SIZE);
+    log->blocks = kmalloc_array(num_blocks, sizeof(*log->blocks), GFP_KERNEL);
+    log->batch_pages = kmalloc_array(num_blocks, sizeof(*log->batch_pages), GFP_KERNEL);
+    log->batch_blocks = kmalloc_array(num_blocks, sizeof(*log->batch_blocks), GFP_KERNEL);
+    afs_action(log->pages && log->blocks && log->batch_pages && log->batch_blocks, ret = -ENOMEM, err, "could not allocate log [%d]", ret);
+
+    memcpy(log->blocks, blocks, num_blocks * sizeof(*log->blocks));
+    log->id = id;
+    log->num_blocks = num_blocks;
+    log->record_sz = record_sz;
+    log->records_per_block = (AFS_BLOCK_SIZE - sizeof(struct afs_log_header)) / record_sz;
+    log->tail = tail;
+    log->tail_count = tail_count;
+    log->committed = tail;
+    log->end = tail;
+    log->bdev = bdev;
+    log->sector_offset = sector_offset;
+    afs_log_start_block(log, tail, tail_count);
+    return 0;
+
+err:
+    afs_log_exit(log);
+    return ret;
+}
+
+/**
+ * Release a log.
+ */
+void
+afs_log_exit(struct afs_log *log)
+{
+    vfree(log->pages);
+    kfree(log->blocks);
+    kfree(log->batch_pages);
+    kfree(log->batch_blocks);
+    log->pages = NULL;
+    log->blocks = NULL;
+    log->batch_pages = NULL;
+    log->batch_blocks = NULL;
+}
+
+/**
+ * Pass every record of the blocks read at mount, from the tail on, to
+ * fn. Counts the records passed in *count.
+ */
+static int
+afs_log_for_each(struct afs_log *log, afs_log_apply_fn fn, void *private, uint64_t *count)
+{
+    struct afs_log_header *header;
+    uint8_t *record;
+    uint32_t block;
+    uint64_t seq;
+    uint32_t i;
+    int ret;
+
+    for (seq = log->tail; seq < log->end; seq++) {
+        // Records of the tail block before the mark are in the map blocks.
+        header = afs_log_block(log, seq);
+        record = (uint8_t *)(header + 1);
+        for (i = (seq == log->tail) ? log->tail_count : 0; i < header->count; i++) {
+            memcpy(&block, record + (i * log->record_sz), sizeof(block));
+            ret = fn(private, block, record + (i * log->record_sz) + sizeof(block));
+            afs_assert(!ret, done, "could not apply log record [%d:%u]", ret, block);
+            (*count)++;
+        }
+    }
+    ret = 0;
+
+done:
+    return ret;
+}
+
+/**
+ * Read a log.
+ *
+ * Every log block is read in a single batch. Blocks are then checked from
+ * the tail on, the first block that is missing, torn or left over from an
+ * earlier lap of the ring ends the log.
+ */
+int
+afs_log_read(struct afs_log *log, afs_log_apply_fn scan, void *private)
+{
+    struct afs_log_header *header;
+    uint8_t digest[SHA256_SZ];
+    uint64_t scanned = 0;
+    uint64_t seq;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < log->num_blocks; i++) {
+        log->batch_pages[i] = log->pages + (i * AFS_BLOCK_SIZE);
+    }
+    ret = afs_blkdev_batch(log->batch_pages, log->blocks, log->num_blocks, log->bdev, log->sector_offset, true, IO_READ);
+    afs_assert(!ret, done, "could not read log [%d]", ret);
+
+    for (seq = log->tail; seq - log->tail < log->num_blocks; seq++) {
+        header = afs_log_block(log, seq);
+        hash_sha256((uint8_t *)header + SHA256_SZ, AFS_BLOCK_SIZE - SHA256_SZ, digest);
+        if (memcmp(header->hash, digest, SHA256_SZ) || header->id != log->id || header->seq != seq ||
+            header->count > log->records_per_block) {
+            break;
+        }
+    }
+    log->end = seq;
+    ret = afs_log_for_each(log, scan, private, &scanned);
+
+done:
+    return ret;
+}
+
+/**
+ * Replay a log read at mount.
+ */
+int
+afs_log_replay(struct afs_log *log, afs_log_apply_fn apply, void *private)
+{
+    uint64_t seq = log->end;
+    int ret;
+
+    ret = afs_log_for_each(log, apply, private, &log->replayed);
+    if (ret) {
+        return ret;
+    }
+
+    // Appends go on in a block of their own. A log replayed in full has
+    // no room left until the next checkpoint.
+    if (seq == log->tail) {
+        afs_log_start_block(log, log->tail, log->tail_count);
+    } else {
+        afs_log_start_block(log, seq, 0);
+        log->overflow = (seq - log->tail == log->num_blocks);
+    }
+    log->committed = log->head;
+    return 0;
+}
+
+/**
+ * Append the updated entry of a block.
+ */
+int
+afs_log_append(struct afs_log *log, uint32_t block, const uint8_t *entry)
+{
+    struct afs_log_header *header;
+    unsigned long flags;
+    uint8_t *record;
+    int due = 0;
+
+    spin_lock_irqsave(&log->lock, flags);
+    if (!log->pages || log->overflow) {
+        goto unlock;
+    }
+
+    // The next block of the ring is only free once a checkpoint has
+    // covered it. Until then records are dropped, the map blocks have
+    // to be written instead.
+    if (log->count == log->records_per_block) {
+        if (log->head + 1 - log->tail >= log->num_blocks) {
+            log->overflow = true;
+            due = AFS_LOG_CHECKPOINT;
+            goto unlock;
+        }
+        afs_log_start_block(log, log->head + 1, 0);
+    }
+
+    header = afs_log_block(log, log->head);
+    record = (uint8_t *)(header + 1) + (log->count * log->record_sz);
+    memcpy(record, &block, sizeof(block));
+    memcpy(record + sizeof(block), entry, log->record_sz - sizeof(block));
+    header->count = ++log->count;
+
+    if (!log->dirty) {
+        log->dirty = true;
+        due |= AFS_LOG_COMMIT;
+    }
+    if (!log->checkpoint_due && log->head - log->tail >= log->num_blocks / 2) {
+        log->checkpoint_due = true;
+        due |= AFS_LOG_CHECKPOINT;
+    }
+
+unlock:
+    spin_unlock_irqrestore(&log->lock, flags);
+    return due;
+}
+
+/**
+ * Commit the log.
+ *
+ * The head block is sealed, and every block since the last commit is
+ * written at once. Sealed blocks never change, so they are written
+ * outside the lock while appends go on in the next block. The carrier
+ * writes the records describe are flushed first, so a record never
+ * reaches the disk ahead of its data.
+ */
+int
+afs_log_commit(struct afs_log *log)
+{
+    struct afs_log_header *header;
+    unsigned long flags;
+    uint64_t first, last;
+    uint64_t seq;
+    uint32_t n = 0;
+    int ret = 0;
+
+    mutex_lock(&log->commit_lock);
+    spin_lock_irqsave(&log->lock, flags);
+    if (!log->pages) {
+        ret = -ENOENT;
+    } else if (log->overflow) {
+        ret = -ENOSPC;
+    } else if (log->count) {
+        if (log->head + 1 - log->tail >= log->num_blocks) {
+            log->overflow = true;
+            ret = -ENOSPC;
+        } else {
+            afs_log_start_block(log, log->head + 1, 0);
+        }
+    }
+    log->dirty = false;
+    first = log->committed;
+    last = log->head;
+    spin_unlock_irqrestore(&log->lock, flags);
+
+    if (ret || first == last) {
+        goto done;
+    }
+
+    for (seq = first; seq < last; seq++) {
+        header = afs_log_block(log, seq);
+        hash_sha256((uint8_t *)header + SHA256_SZ, AFS_BLOCK_SIZE - SHA256_SZ, header->hash);
+        log->batch_pages[n] = (uint8_t *)header;
+        log->batch_blocks[n] = log->blocks[seq % log->num_blocks];
+        n++;
+    }
+    ret = afs_blkdev_flush(log->bdev);
+    afs_assert(!ret, done, "could not flush before log commit [%d:%llu]", ret, first);
+    ret = afs_blkdev_batch(log->batch_pages, log->batch_blocks, n, log->bdev, log->sector_offset, true, IO_WRITE);
+    afs_assert(!ret, done, "could not commit log [%d:%llu]", ret, first);
+    log->committed = last;
+    log->commits++;
+
+done:
+    mutex_unlock(&log->commit_lock);
+    return ret;
+}
+
+/**
+ * Mark the head for a checkpoint. Records dropped so far are covered by
+ * the checkpoint.
+ */
+void
+afs_log_mark(struct afs_log *log, struct afs_log_mark *mark)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&log->lock, flags);
+    mark->seq = log->head;
+    mark->count = log->count;
+    mark->overflow = log->overflow;
+    log->overflow = false;
+    log->checkpoint_due = false;
+    spin_unlock_irqrestore(&log->lock, flags);
+}
+
+/**
+ * End a checkpoint.
+ */
+void
+afs_log_checkpoint(struct afs_log *log, struct afs_log_mark *mark, bool done)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&log->lock, flags);
+    if (done) {
+        log->tail = mark->seq;
+        log->tail_count = mark->count;
+    } else if (mark->overflow) {
+        log->overflow = true;
+    }
+    spin_unlock_irqrestore(&log->lock, flags);
+}
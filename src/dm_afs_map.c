@@ -0,0 +1,401 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_map.h>
+#include <linux/bitmap.h>
+#include <linux/err.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/**
+ * Find the page of a map block. Lock must be held.
+ */
+static struct afs_map_page *
+afs_map_lookup(struct afs_map *map, uint32_t index)
+{
+    struct afs_map_page *page;
+
+    hlist_for_each_entry(page, &map->table[hash_32(index, map->table_bits)], node) {
+        if (page->index == index) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a page for the page pool.
+ */
+static void *
+afs_map_pool_alloc(gfp_t gfp_mask, void *pool_data)
+{
+    struct afs_map *map = pool_data;
+    struct afs_map_page *page;
+    size_t num_slots = (size_t)map->entries_per_block * map->num_carrier_blocks;
+
+    page = kzalloc(sizeof(*page), gfp_mask);
+    if (!page) {
+        return NULL;
+    }
+
+    // Both arrays share one allocation, which stays within a single page
+    // for every map format.
+    page->carriers = kmalloc(afs_map_page_size(map), gfp_mask);
+    if (!page->carriers) {
+        kfree(page);
+        return NULL;
+    }
+    page->checksums = (uint16_t *)(page->carriers + num_slots);
+    INIT_LIST_HEAD(&page->lru);
+    return page;
+}
+
+/**
+ * Free a page of the page pool.
+ */
+static void
+afs_map_pool_free(void *element, void *pool_data)
+{
+    struct afs_map_page *page = element;
+
+    kfree(page->carriers);
+    kfree(page);
+}
+
+/**
+ * Free a page that is no longer in the map.
+ */
+static void
+afs_map_page_free(struct afs_map *map, struct afs_map_page *page)
+{
+    if (page) {
+        mempool_free(page, &map->pool);
+    }
+}
+
+/**
+ * Remove a page from the map. Lock must be held.
+ */
+static void
+afs_map_remove(struct afs_map *map, struct afs_map_page *page)
+{
+    hlist_del(&page->node);
+    list_del_init(&page->lru);
+    map->count--;
+}
+
+/**
+ * Take the oldest clean page nobody uses out of the map, to be reused.
+ * Lock must be held.
+ */
+static struct afs_map_page *
+afs_map_evict(struct afs_map *map)
+{
+    struct afs_map_page *page;
+
+    list_for_each_entry_reverse(page, &map->lru, lru) {
+        if (!test_bit(page->index, map->dirty)) {
+            afs_map_remove(map, page);
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a page. Short on memory, the oldest clean page nobody uses
+ * makes room even below capacity. Only without one do we wait for a page
+ * to come back to the pool, the I/O holding it is on its way.
+ */
+static struct afs_map_page *
+afs_map_page_alloc(struct afs_map *map)
+{
+    struct afs_map_page *page;
+    unsigned long flags;
+
+    page = mempool_alloc(&map->pool, GFP_NOWAIT | __GFP_NOWARN);
+    if (page) {
+        return page;
+    }
+
+    spin_lock_irqsave(&map->lock, flags);
+    page = afs_map_evict(map);
+    spin_unlock_irqrestore(&map->lock, flags);
+    if (page) {
+        return page;
+    }
+    return mempool_alloc(&map->pool, GFP_NOIO);
+}
+
+/**
+ * Initialize a map.
+ */
+int
+afs_map_init(struct afs_map *map, uint32_t num_blocks, uint8_t num_carrier_blocks, uint32_t entries_per_block,
+    uint32_t capacity, afs_map_read_fn read, afs_map_read_many_fn read_many)
+{
+    int ret = 0;
+
+    memset(map, 0, sizeof(*map));
+    spin_lock_init(&map->lock);
+    INIT_LIST_HEAD(&map->lru);
+    init_waitqueue_head(&map->wait);
+    atomic_set(&map->nr_dirty, 0);
+    map->num_blocks = num_blocks;
+    map->num_map_blocks = DIV_ROUND_UP(num_blocks, entries_per_block);
+    map->entries_per_block = entries_per_block;
+    map->num_carrier_blocks = num_carrier_blocks;
+    map->capacity = max_t(uint32_t, capacity, 1);
+    map->dirty_limit = max_t(uint32_t, map->capacity / 2, 1);
+    map->read = read;
+    map->read_many = read_many;
+
+    map->table_bits = ilog2(roundup_pow_of_two(map->capacity));
+    map->table = vzalloc(sizeof(*map->table) << map->table_bits);
+    afs_action(map->table, ret = -ENOMEM, err, "could not allocate map table [%d]", ret);
+
+    // Nothing is dirty yet, replaying the log dirties what it updates.
+    map->dirty = vzalloc(BITS_TO_LONGS(map->num_map_blocks) * sizeof(*map->dirty));
+    afs_action(map->dirty, ret = -ENOMEM, err, "could not allocate map dirty state [%d]", ret);
+
+    // Reading the map must not fail for want of memory, the reserve gets
+    // the requests in flight through.
+    ret = mempool_init(&map->pool, AFS_MAP_RESERVE_PAGES, afs_map_pool_alloc, afs_map_pool_free, map);
+    afs_assert(!ret, err, "could not create map page pool [%d]", ret);
+    afs_debug("initialized Artifice map [%u map blocks, %u in memory]", map->num_map_blocks, map->capacity);
+    return 0;
+
+err:
+    afs_map_exit(map);
+    return ret;
+}
+
+/**
+ * Release a map.
+ */
+void
+afs_map_exit(struct afs_map *map)
+{
+    struct afs_map_page *page;
+    struct hlist_node *next;
+    uint32_t i;
+
+    if (map->table) {
+        for (i = 0; i < (1U << map->table_bits); i++) {
+            hlist_for_each_entry_safe(page, next, &map->table[i], node) {
+                if (page->refs) {
+                    afs_alert("map block still in use [%u:%u]", page->index, page->refs);
+                }
+                afs_map_remove(map, page);
+                afs_map_page_free(map, page);
+            }
+        }
+    }
+    mempool_exit(&map->pool);
+    vfree(map->table);
+    vfree(map->dirty);
+    map->table = NULL;
+    map->dirty = NULL;
+}
+
+/**
+ * Take a reference on the page of map block index. A missing page is
+ * inserted before it is read, and *read tells the caller to read it.
+ * Anybody else getting it meanwhile waits for that read instead of
+ * issuing their own.
+ */
+static struct afs_map_page *
+afs_map_grab(struct afs_map *map, uint32_t index, bool *read)
+{
+    struct afs_map_page *page = NULL;
+    struct afs_map_page *spare = NULL;
+    unsigned long flags;
+
+    *read = false;
+    spin_lock_irqsave(&map->lock, flags);
+    page = afs_map_lookup(map, index);
+    if (page) {
+        map->hits++;
+        goto found;
+    }
+
+    // The read would sit behind the very bio waiting for it.
+    if (current->bio_list) {
+        spin_unlock_irqrestore(&map->lock, flags);
+        return ERR_PTR(-EAGAIN);
+    }
+
+    // Past capacity the oldest clean page makes room. Without one the
+    // map grows until a checkpoint cleans some.
+    if (map->count >= map->capacity) {
+        spare = afs_map_evict(map);
+    }
+    spin_unlock_irqrestore(&map->lock, flags);
+
+    if (!spare) {
+        spare = afs_map_page_alloc(map);
+    }
+
+    spin_lock_irqsave(&map->lock, flags);
+    page = afs_map_lookup(map, index);
+    if (page) {
+        map->hits++;
+        goto found;
+    }
+    page = spare;
+    page->index = index;
+    page->refs = 1;
+    page->state = AFS_MAP_PAGE_READING;
+    INIT_LIST_HEAD(&page->lru);
+    hlist_add_head(&page->node, &map->table[hash_32(index, map->table_bits)]);
+    map->count++;
+    map->misses++;
+    spin_unlock_irqrestore(&map->lock, flags);
+    *read = true;
+    return page;
+
+found:
+    if (!page->refs++) {
+        list_del_init(&page->lru);
+    }
+    spin_unlock_irqrestore(&map->lock, flags);
+    afs_map_page_free(map, spare);
+    return page;
+}
+
+/**
+ * Publish the outcome of reading pages, and wake whoever waits for them.
+ */
+static void
+afs_map_read_done(struct afs_map *map, struct afs_map_page **pages, uint32_t count, int ret)
+{
+    unsigned long flags;
+    uint32_t i;
+
+    spin_lock_irqsave(&map->lock, flags);
+    for (i = 0; i < count; i++) {
+        pages[i]->state = (ret) ? AFS_MAP_PAGE_ERROR : AFS_MAP_PAGE_UPTODATE;
+    }
+    spin_unlock_irqrestore(&map->lock, flags);
+    wake_up_all(&map->wait);
+}
+
+/**
+ * Get the page holding the entry of a block.
+ */
+struct afs_map_page *
+afs_map_get(struct afs_map *map, uint32_t block)
+{
+    struct afs_map_page *page;
+    bool read;
+
+    page = afs_map_grab(map, afs_map_index(map, block), &read);
+    if (IS_ERR(page)) {
+        return page;
+    }
+    if (read) {
+        afs_map_read_done(map, &page, 1, map->read(map, page));
+    }
+    wait_event(map->wait, READ_ONCE(page->state) != AFS_MAP_PAGE_READING);
+
+    if (READ_ONCE(page->state) == AFS_MAP_PAGE_ERROR) {
+        afs_map_put(map, page);
+        return ERR_PTR(-EIO);
+    }
+    return page;
+}
+
+/**
+ * Get the pages of several map blocks. Every missing page is inserted
+ * first, then all of them are read with a single call to read_many.
+ */
+int
+afs_map_get_many(struct afs_map *map, const uint32_t *indices, uint32_t count, struct afs_map_page **pages)
+{
+    struct afs_map_page **missing = NULL;
+    uint32_t num_missing = 0;
+    uint32_t i;
+    bool read;
+    int ret = 0;
+
+    missing = kvmalloc_array(count, sizeof(*missing), GFP_KERNEL);
+    afs_action(missing, ret = -ENOMEM, done, "could not allocate map pages [%d]", ret);
+
+    for (i = 0; i < count; i++) {
+        pages[i] = afs_map_grab(map, indices[i], &read);
+        if (read) {
+            missing[num_missing++] = pages[i];
+        }
+    }
+    if (num_missing) {
+        afs_map_read_done(map, missing, num_missing, map->read_many(map, missing, num_missing));
+    }
+
+    for (i = 0; i < count; i++) {
+        wait_event(map->wait, READ_ONCE(pages[i]->state) != AFS_MAP_PAGE_READING);
+        if (READ_ONCE(pages[i]->state) == AFS_MAP_PAGE_ERROR) {
+            ret = -EIO;
+        }
+    }
+    if (ret) {
+        for (i = 0; i < count; i++) {
+            afs_map_put(map, pages[i]);
+        }
+    }
+
+done:
+    kvfree(missing);
+    return ret;
+}
+
+/**
+ * Put a page. Pages that could not be read leave the map with their last
+ * user, so the next one tries again, and so do clean pages past
+ * capacity.
+ */
+void
+afs_map_put(struct afs_map *map, struct afs_map_page *page)
+{
+    unsigned long flags;
+    bool drop = false;
+
+    spin_lock_irqsave(&map->lock, flags);
+    if (!--page->refs) {
+        if (page->state == AFS_MAP_PAGE_ERROR || (map->count > map->capacity && !test_bit(page->index, map->dirty))) {
+            afs_map_remove(map, page);
+            drop = true;
+        } else {
+            list_add(&page->lru, &map->lru);
+        }
+    }
+    spin_unlock_irqrestore(&map->lock, flags);
+
+    if (drop) {
+        afs_map_page_free(map, page);
+    }
+}
+
+/**
+ * Whether a block has carriers.
+ */
+int
+afs_map_mapped(struct afs_map *map, uint32_t block)
+{
+    struct afs_map_page *page;
+    bool mapped;
+
+    page = afs_map_get(map, block);
+    if (IS_ERR(page)) {
+        return PTR_ERR(page);
+    }
+    mapped = (READ_ONCE(afs_map_carriers(map, page, block)[0]) != AFS_INVALID_BLOCK);
+    afs_map_put(map, page);
+    return mapped;
+}
@@ -6,8 +6,11 @@
 #include <dm_afs.h>
 #include <dm_afs_io.h>
 #include <dm_afs_modules.h>
+#include <linux/bitmap.h>
 #include <linux/crypto.h>
+#include <linux/err.h>
 #include <linux/errno.h>
+#include <linux/mm.h>
 #include <linux/random.h>
 
 /**
@@ -44,13 +47,19 @@ static int64_t binary_search(uint32_t *array, uint32_t value, uint32_t length){
  * TODO build config for everything
  */
 void
-build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uint8_t num_entropy_blocks)
+build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uint8_t num_entropy_blocks, uint8_t map_format)
 {
     struct afs_config *config = &context->config;
 
     config->num_carrier_blocks = num_carrier_blocks;
+    config->threshold = 2;
     config->num_entropy_blocks = num_entropy_blocks;
-    config->map_entry_sz = CARRIER_HASH_SZ + ENTROPY_HASH_SZ + (sizeof(struct afs_map_tuple) * config->num_carrier_blocks);
+    config->map_format = map_format;
+    if (map_format == AFS_MAP_COMPACT) {
+        config->map_entry_sz = (sizeof(uint32_t) + sizeof(uint16_t)) * config->num_carrier_blocks;
+    } else {
+        config->map_entry_sz = CARRIER_HASH_SZ + ENTROPY_HASH_SZ + (sizeof(struct afs_map_tuple) * config->num_carrier_blocks);
+    }
     config->unused_space_per_block = (AFS_BLOCK_SIZE - SHA512_SZ) % config->map_entry_sz;
     config->num_map_entries_per_block = (AFS_BLOCK_SIZE - SHA512_SZ) / config->map_entry_sz;
     config->num_blocks = config->instance_size / AFS_BLOCK_SIZE;
@@ -72,7 +81,7 @@ build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uin
    
     afs_debug("Number carrier blocks per tuple: %u", config->num_carrier_blocks);
     afs_debug("Number entropy blocks per tuple: %u", config->num_entropy_blocks); 
-    afs_debug("Map entry size: %u", config->map_entry_sz);
+    afs_debug("Map format: %u | Map entry size: %u", config->map_format, config->map_entry_sz);
     afs_debug("Unused: %u | Entries per block: %u", config->unused_space_per_block, config->num_map_entries_per_block);
     afs_debug("Blocks: %u", config->num_blocks);
     afs_debug("Map blocks: %u", config->num_map_blocks);
@@ -80,303 +89,511 @@ build_configuration(struct afs_private *context, uint8_t num_carrier_blocks, uin
 }
 
 /**
- * Create the Artifice map and initialize it to
- * invalids.
+ * Location of map block i on the disk. The super block points to the
+ * first ones, the pointer blocks to the rest, in order.
  */
-int
-afs_create_map(struct afs_private *context)
+static uint32_t
+afs_map_block_ptr(struct afs_private *context, uint32_t i)
+{
+    if (i < NUM_MAP_BLKS_IN_SB) {
+        return context->super_block.map_block_ptrs[i];
+    }
+    i -= NUM_MAP_BLKS_IN_SB;
+    return context->afs_ptr_blocks[i / NUM_MAP_BLKS_IN_PB].map_block_ptrs[i % NUM_MAP_BLKS_IN_PB];
+}
+
+/**
+ * Write the entry of a block as the map format lays it out.
+ */
+static void
+afs_map_pack_entry(struct afs_config *config, const uint32_t *carriers, const uint16_t *checksums, uint8_t *entry)
+{
+    struct afs_map_tuple *tuple = (struct afs_map_tuple *)entry;
+    uint32_t i;
+
+    if (config->map_format == AFS_MAP_COMPACT) {
+        memcpy(entry, carriers, config->num_carrier_blocks * sizeof(*carriers));
+        memcpy(entry + (config->num_carrier_blocks * sizeof(*carriers)), checksums, config->num_carrier_blocks * sizeof(*checksums));
+        return;
+    }
+
+    memset(entry, 0, config->map_entry_sz);
+    for (i = 0; i < config->num_carrier_blocks; i++) {
+        tuple[i].carrier_block_ptr = carriers[i];
+        tuple[i].checksum = checksums[i];
+    }
+}
+
+/**
+ * Read the entry of a block as the map format lays it out.
+ */
+static void
+afs_map_unpack_entry(struct afs_config *config, uint32_t *carriers, uint16_t *checksums, const uint8_t *entry)
+{
+    const struct afs_map_tuple *tuple = (const struct afs_map_tuple *)entry;
+    uint32_t i;
+
+    if (config->map_format == AFS_MAP_COMPACT) {
+        memcpy(carriers, entry, config->num_carrier_blocks * sizeof(*carriers));
+        memcpy(checksums, entry + (config->num_carrier_blocks * sizeof(*carriers)), config->num_carrier_blocks * sizeof(*checksums));
+        return;
+    }
+
+    for (i = 0; i < config->num_carrier_blocks; i++) {
+        carriers[i] = tuple[i].carrier_block_ptr;
+        checksums[i] = tuple[i].checksum;
+    }
+}
+
+/**
+ * Number of entries map block i holds, only the last one is short.
+ */
+static inline uint32_t
+afs_map_block_entries(struct afs_config *config, uint32_t i)
+{
+    return min_t(uint32_t, config->num_blocks - (i * config->num_map_entries_per_block), config->num_map_entries_per_block);
+}
+
+/**
+ * Copy the entries map block i holds into the arrays of its page.
+ */
+static void
+afs_load_map_block(struct afs_private *context, uint32_t i, uint32_t *carriers, uint16_t *checksums, const uint8_t *map_block)
 {
     struct afs_config *config = &context->config;
-    struct afs_map_tuple *map_tuple = NULL;
-    uint8_t *map_entries = NULL;
-    uint8_t map_entry_sz;
-    uint32_t num_blocks;
-    uint32_t num_carrier_blocks;
-    uint32_t i, j;
+    const uint8_t *entries_start = map_block + SHA512_SZ + config->unused_space_per_block;
+    uint32_t count = afs_map_block_entries(config, i);
+    uint32_t slots = config->num_map_entries_per_block * config->num_carrier_blocks;
+    uint32_t j;
+
+    if (config->map_format == AFS_MAP_COMPACT) {
+        memcpy(carriers, entries_start, count * config->num_carrier_blocks * sizeof(*carriers));
+        memcpy(checksums, entries_start + (slots * sizeof(*carriers)), count * config->num_carrier_blocks * sizeof(*checksums));
+        return;
+    }
+
+    for (j = 0; j < count; j++) {
+        afs_map_unpack_entry(config, carriers + (j * config->num_carrier_blocks), checksums + (j * config->num_carrier_blocks),
+            entries_start + (j * config->map_entry_sz));
+    }
+}
+
+/**
+ * Build map block i from the arrays of its page: the entries it holds,
+ * and their hash.
+ */
+static void
+afs_build_map_block(struct afs_private *context, uint32_t i, const uint32_t *carriers, const uint16_t *checksums, uint8_t *map_block)
+{
+    struct afs_config *config = &context->config;
+    uint8_t *entries_start = map_block + SHA512_SZ + config->unused_space_per_block;
+    uint32_t count = afs_map_block_entries(config, i);
+    uint32_t slots = config->num_map_entries_per_block * config->num_carrier_blocks;
+    uint32_t j;
+
+    memset(map_block, 0, AFS_BLOCK_SIZE);
+    if (config->map_format == AFS_MAP_COMPACT) {
+        memcpy(entries_start, carriers, count * config->num_carrier_blocks * sizeof(*carriers));
+        memcpy(entries_start + (slots * sizeof(*carriers)), checksums, count * config->num_carrier_blocks * sizeof(*checksums));
+    } else {
+        for (j = 0; j < count; j++) {
+            afs_map_pack_entry(config, carriers + (j * config->num_carrier_blocks), checksums + (j * config->num_carrier_blocks),
+                entries_start + (j * config->map_entry_sz));
+        }
+    }
+    hash_sha512(entries_start, AFS_BLOCK_SIZE - SHA512_SZ - config->unused_space_per_block, map_block);
+}
+
+/**
+ * Read a map block into a page of the Artifice map.
+ */
+static int
+afs_read_map_block(struct afs_map *map, struct afs_map_page *page)
+{
+    struct afs_private *context = container_of(map, struct afs_private, afs_map);
+    uint8_t *map_block = NULL;
+    int ret;
+
+    map_block = (uint8_t *)__get_free_page(GFP_NOIO);
+    afs_action(map_block, ret = -ENOMEM, done, "could not allocate map block [%d]", ret);
+
+    ret = read_page(map_block, context->bdev, afs_map_block_ptr(context, page->index), context->passive_fs.data_start_off, false);
+    afs_assert(!ret, done, "could not read map block [%d:%u]", ret, page->index);
+    // TODO: Calculate and verify hash.
+    afs_load_map_block(context, page->index, page->carriers, page->checksums, map_block);
+
+done:
+    free_page((unsigned long)map_block);
+    return ret;
+}
+
+/**
+ * Read several map blocks into pages of the Artifice map. They are read
+ * in batches, with a whole batch in flight at once.
+ */
+static int
+afs_read_map_blocks(struct afs_map *map, struct afs_map_page **map_pages, uint32_t num_pages)
+{
+    struct afs_private *context = container_of(map, struct afs_private, afs_map);
+    uint8_t *map_blocks = NULL;
+    uint8_t **pages = NULL;
+    uint32_t *blocks = NULL;
+    uint32_t first;
+    uint32_t count;
+    uint32_t i;
     int ret = 0;
 
-    map_entry_sz = config->map_entry_sz;
-    num_blocks = config->num_blocks;
-    num_carrier_blocks = config->num_carrier_blocks;
-
-    // Allocate all required map_entries.
-    map_entries = vmalloc(num_blocks * map_entry_sz);
-    afs_action(map_entries, ret = -ENOMEM, done, "could not allocate map entries [%d]", ret);
-    afs_debug("allocated Artifice map");
-
-    for (i = 0; i < num_blocks; i++) {
-        map_tuple = (struct afs_map_tuple *)(map_entries + (i * map_entry_sz));
-        for (j = 0; j < num_carrier_blocks; j++) {
-            map_tuple->carrier_block_ptr = AFS_INVALID_BLOCK;
-            //map_tuple->entropy_block_ptr = AFS_INVALID_BLOCK;
-            map_tuple->checksum = 0;
-            map_tuple += 1;
+    map_blocks = vmalloc(AFS_MAP_LOAD_BATCH * AFS_BLOCK_SIZE);
+    pages = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*pages), GFP_KERNEL);
+    blocks = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*blocks), GFP_KERNEL);
+    afs_action(map_blocks && pages && blocks, ret = -ENOMEM, done, "could not allocate memory for map data [%d]", ret);
+
+    for (first = 0; first < num_pages; first += count) {
+        count = min_t(uint32_t, num_pages - first, AFS_MAP_LOAD_BATCH);
+        for (i = 0; i < count; i++) {
+            pages[i] = map_blocks + (i * AFS_BLOCK_SIZE);
+            blocks[i] = afs_map_block_ptr(context, map_pages[first + i]->index);
+        }
+
+        ret = afs_blkdev_batch(pages, blocks, count, context->bdev, context->passive_fs.data_start_off, true, IO_READ);
+        afs_assert(!ret, done, "could not read map blocks [%d:%u]", ret, map_pages[first]->index);
+
+        // TODO: Calculate and verify hash.
+        for (i = 0; i < count; i++) {
+            afs_load_map_block(context, map_pages[first + i]->index, map_pages[first + i]->carriers,
+                map_pages[first + i]->checksums, pages[i]);
         }
-        // map_tuple now points to the beginning of the hash and the entropy.
-        memset(map_tuple, 0, CARRIER_HASH_SZ + ENTROPY_HASH_SZ);
     }
-    afs_debug("initialized Artifice map");
-    context->afs_map = map_entries;
-    ret = 0;
 
 done:
+    kfree(blocks);
+    kfree(pages);
+    vfree(map_blocks);
     return ret;
 }
 
 /**
- * Fill an Artifice map with values from the
- * metadata.
+ * Set up the Artifice map. Nothing is read until a block is accessed.
  */
 int
-afs_fill_map(struct afs_super_block *sb, struct afs_private *context)
+afs_create_map(struct afs_private *context)
 {
     struct afs_config *config = &context->config;
-    struct afs_ptr_block *ptr_block = NULL;
-    uint8_t *afs_map = NULL;
-    uint8_t *map_block = NULL;
-    uint8_t *map_block_hash = NULL;
-    uint8_t *map_block_unused = NULL;
-    uint8_t *map_block_entries = NULL;
-    uint8_t map_entry_sz;
-    uint8_t num_map_entries_per_block;
-    uint32_t next_block;
-    uint32_t entries_read;
-    uint32_t entries_left;
-    uint32_t i, j;
-    int ret = 0;
-    uint32_t data_sector_offset = context->passive_fs.data_start_off;
-
-    // Acquire the map.
-    afs_map = context->afs_map;
 
-    map_entry_sz = config->map_entry_sz;
-    num_map_entries_per_block = config->num_map_entries_per_block;
+    return afs_map_init(&context->afs_map, config->num_blocks, config->num_carrier_blocks, config->num_map_entries_per_block,
+        context->args.map_cache_blocks, afs_read_map_block, afs_read_map_blocks);
+}
 
-    map_block = kmalloc(AFS_BLOCK_SIZE, GFP_KERNEL);
-    ptr_block = kmalloc(sizeof(*ptr_block), GFP_KERNEL);
-    afs_action(map_block && ptr_block, ret = -ENOMEM, err, "could not allocate memory for map data [%d]", ret);
+/**
+ * Free the Artifice map.
+ */
+void
+afs_free_map(struct afs_private *context)
+{
+    afs_map_exit(&context->afs_map);
+}
 
-    // Read in everything from the super block first.
-    entries_read = 0;
-    for (i = 0; i < NUM_MAP_BLKS_IN_SB; i++) {
-        // Read map block.
-        ret = read_page(map_block, context->bdev, sb->map_block_ptrs[i], data_sector_offset, false);
-        afs_assert(!ret, read_err, "could not read map block [%d:%u]", ret, entries_read % config->num_map_blocks);
-        allocation_set(&context->vector, sb->map_block_ptrs[i]);
+/**
+ * Mark the carriers of every mapped block in the allocation vector.
+ *
+ * A mount reads no map blocks, so until this has gone over all of them
+ * the allocation vector does not know which blocks hold carriers. Map
+ * blocks are read in batches, with a whole batch in flight at once, and
+ * nothing is kept of them but the bits they set. Carriers only the log
+ * knows about are marked by its replay. Gives up with -EINTR once
+ * scan_stop is set.
+ */
+int
+afs_scan_map(struct afs_private *context)
+{
+    struct afs_config *config = &context->config;
+    const struct afs_map_tuple *tuple;
+    const uint8_t *entries_start;
+    uint8_t **pages = NULL;
+    uint32_t *blocks = NULL;
+    uint8_t *map_blocks = NULL;
+    uint32_t carrier;
+    uint32_t first;
+    uint32_t count;
+    uint32_t slots;
+    uint32_t i, j;
+    int ret = 0;
 
-        // Offset into the block.
-        map_block_hash = map_block;
-        map_block_unused = map_block_hash + SHA512_SZ;
-        map_block_entries = map_block_unused + config->unused_space_per_block;
-        // TODO: Calculate and verify hash.
+    map_blocks = vmalloc(AFS_MAP_LOAD_BATCH * AFS_BLOCK_SIZE);
+    pages = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*pages), GFP_KERNEL);
+    blocks = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*blocks), GFP_KERNEL);
+    afs_action(map_blocks && pages && blocks, ret = -ENOMEM, done, "could not allocate memory for map data [%d]", ret);
 
-        entries_left = config->num_blocks - entries_read;
-        if (entries_left <= num_map_entries_per_block) {
-            memcpy(afs_map + (entries_read * map_entry_sz), map_block_entries, entries_left * map_entry_sz);
-            entries_read += entries_left;
-            break;
-        } else {
-            memcpy(afs_map + (entries_read * map_entry_sz), map_block_entries, num_map_entries_per_block * map_entry_sz);
-            entries_read += num_map_entries_per_block;
+    for (first = 0; first < config->num_map_blocks; first += count) {
+        if (READ_ONCE(context->scan_stop)) {
+            ret = -EINTR;
+            goto done;
         }
-    }
-    afs_debug("super block's map blocks read");
 
-    // Begin reading from pointer blocks.
-    for (i = 0; i < config->num_ptr_blocks; i++) {
-        next_block = (i == 0) ? sb->first_ptr_block : ptr_block->next_ptr_block;
-        ret = read_page(ptr_block, context->bdev, next_block, data_sector_offset, false);
-        afs_assert(!ret, read_err, "could not read pointer block [%d:%u]", ret, i);
-        allocation_set(&context->vector, next_block);
-        // TODO: Calculate and verify hash of ptr_block.
+        count = min_t(uint32_t, config->num_map_blocks - first, AFS_MAP_LOAD_BATCH);
+        for (i = 0; i < count; i++) {
+            pages[i] = map_blocks + (i * AFS_BLOCK_SIZE);
+            blocks[i] = afs_map_block_ptr(context, first + i);
+        }
 
-        for (j = 0; j < NUM_MAP_BLKS_IN_PB; i++) {
-            // Read map block.
-            ret = read_page(map_block, context->bdev, ptr_block->map_block_ptrs[j], data_sector_offset, false);
-            afs_assert(!ret, read_err, "could not read map block [%d:%u]", ret, entries_read % config->num_map_blocks);
-            allocation_set(&context->vector, ptr_block->map_block_ptrs[j]);
-
-            // Offset into the block.
-            map_block_hash = map_block;
-            map_block_unused = map_block_hash + SHA512_SZ;
-            map_block_entries = map_block_unused + config->unused_space_per_block;
-            // TODO: Calculate and verify hash.
-
-            entries_left = config->num_blocks - entries_read;
-            if (entries_left <= num_map_entries_per_block) {
-                memcpy(afs_map + (entries_read * map_entry_sz), map_block_entries, entries_left * map_entry_sz);
-                entries_read += entries_left;
-                break;
-            } else {
-                memcpy(afs_map + (entries_read * map_entry_sz), map_block_entries, num_map_entries_per_block * map_entry_sz);
-                entries_read += num_map_entries_per_block;
+        ret = afs_blkdev_batch(pages, blocks, count, context->bdev, context->passive_fs.data_start_off, true, IO_READ);
+        afs_assert(!ret, done, "could not read map blocks [%d:%u]", ret, first);
+
+        for (i = 0; i < count; i++) {
+            entries_start = pages[i] + SHA512_SZ + config->unused_space_per_block;
+            slots = afs_map_block_entries(config, first + i) * config->num_carrier_blocks;
+            for (j = 0; j < slots; j++) {
+                if (config->map_format == AFS_MAP_COMPACT) {
+                    memcpy(&carrier, entries_start + (j * sizeof(carrier)), sizeof(carrier));
+                } else {
+                    tuple = (const struct afs_map_tuple *)(entries_start + ((j / config->num_carrier_blocks) * config->map_entry_sz));
+                    carrier = tuple[j % config->num_carrier_blocks].carrier_block_ptr;
+                }
+                if (carrier != AFS_INVALID_BLOCK) {
+                    allocation_set(&context->vector, carrier);
+                }
             }
         }
-
-        // If we break into here because no more entries were left,
-        // then clearly we shouldn't even have any more pointer blocks
-        // left.
+        WRITE_ONCE(context->scan_cursor, first + count);
+        cond_resched();
     }
-    afs_action(entries_read == config->num_blocks, ret = -EIO, read_err,
-        "read incorrect amount [%u:%u]", entries_read, config->num_blocks);
-    afs_debug("pointer blocks' map blocks read");
+    afs_debug("map blocks scanned");
+    ret = 0;
 
-    kfree(ptr_block);
-    kfree(map_block);
-    return 0;
+done:
+    kfree(blocks);
+    kfree(pages);
+    vfree(map_blocks);
+    return ret;
+}
 
-read_err:
-    if (ptr_block)
-        kfree(ptr_block);
-    if (map_block)
-        kfree(map_block);
+/**
+ * Mark the map block holding the entry of a block dirty, and log the
+ * entry. The caller holds the page the entry is in. The map block is
+ * written by a checkpoint a while later, or right away once too many
+ * are dirty, the log is committed much sooner.
+ */
+void
+afs_map_dirty(struct afs_private *context, struct afs_map_page *page, uint32_t block)
+{
+    struct afs_config *config = &context->config;
+    struct afs_map *map = &context->afs_map;
+    uint8_t entry[MAP_ENTRY_MAX_SZ];
+    int due;
 
-err:
-    return ret;
+    if (!test_and_set_bit(page->index, map->dirty)) {
+        if (atomic_inc_return(&map->nr_dirty) >= map->dirty_limit) {
+            mod_delayed_work(context->writeback_wq, &context->map_dw, 0);
+        } else {
+            queue_delayed_work(context->writeback_wq, &context->map_dw, msecs_to_jiffies(AFS_MAP_FLUSH_DELAY_MS));
+        }
+    }
+
+    afs_map_pack_entry(config, afs_map_carriers(map, page, block), afs_map_checksums(map, page, block), entry);
+    due = afs_log_append(&context->log, block, entry);
+    if (due & AFS_LOG_COMMIT) {
+        queue_delayed_work(context->writeback_wq, &context->log_dw, msecs_to_jiffies(AFS_LOG_COMMIT_DELAY_MS));
+    }
+    if (due & AFS_LOG_CHECKPOINT) {
+        mod_delayed_work(context->writeback_wq, &context->map_dw, 0);
+    }
 }
 
 /**
- * Create the Artifice map blocks.
+ * Checkpoint the map: write the dirty map blocks to disk, and move the
+ * tail of the log past what they hold.
+ *
+ * A map block is marked clean before it is built, and entries are only
+ * marked dirty once they have been updated. An update racing with the
+ * build dirties the block again, so it never stays on the disk torn.
+ * Every update a map block holds is in the log before the block is
+ * written, a crash in between replays them over it. The page is held
+ * until the block is on the disk, so it is never read back older.
  */
 int
-afs_create_map_blocks(struct afs_private *context)
+afs_map_flush(struct afs_private *context)
 {
     struct afs_config *config = &context->config;
-    uint8_t *ptr = NULL;
-    uint8_t *afs_map = NULL;
-    uint8_t *map_blocks = NULL;
-    uint8_t *hash = NULL;
-    uint8_t *unused_space = NULL;
-    uint8_t *entries_start = NULL;
-    uint8_t map_entry_sz;
-    uint8_t num_map_entries_per_block;
-    uint32_t num_map_blocks;
-    uint32_t num_blocks;
-    uint32_t entries_written;
-    uint32_t entries_left;
+    struct afs_aux_block *aux = &context->aux_block;
+    struct afs_map *map = &context->afs_map;
+    struct afs_map_page *page;
+    struct afs_log_mark mark;
+    uint64_t log_tail;
+    uint32_t log_tail_count;
+    uint32_t written = 0;
     uint32_t i;
     int ret = 0;
+    int err;
 
-    afs_map = context->afs_map;
-    map_entry_sz = config->map_entry_sz;
-    num_map_entries_per_block = config->num_map_entries_per_block;
-    num_map_blocks = config->num_map_blocks;
-    num_blocks = config->num_blocks;
-
-    // Allocate all required map_blocks.
-    map_blocks = vmalloc(AFS_BLOCK_SIZE * num_map_blocks);
-    afs_action(map_blocks, ret = -ENOMEM, block_err, "could not allocate map blocks [%d]", ret);
-    afs_debug("allocated Artifice map blocks");
-
-    memset(map_blocks, 0, AFS_BLOCK_SIZE * num_map_blocks);
-    entries_written = 0;
-
-    ptr = map_blocks;
-    for (i = 0; i < num_map_blocks; i++) {
-        hash = ptr;
-        unused_space = hash + SHA512_SZ;
-        entries_start = unused_space + config->unused_space_per_block;
-
-        entries_left = num_blocks - entries_written;
-        if (entries_left <= num_map_entries_per_block) {
-            memcpy(entries_start, afs_map + (entries_written * map_entry_sz), entries_left * map_entry_sz);
-            entries_written += entries_left;
+    mutex_lock(&context->map_flush_lock);
+    afs_log_mark(&context->log, &mark);
+
+    // A log that cannot take the updates leaves the map blocks as the
+    // only copy of them.
+    err = afs_log_commit(&context->log);
+    if (err && err != -ENOENT && err != -ENOSPC) {
+        afs_alert("could not commit log before checkpoint [%d]", err);
+    }
+
+    // Map entries name carriers written with plain writes, those have to
+    // be durable before a map block that points at them.
+    if (atomic_read(&map->nr_dirty)) {
+        ret = afs_blkdev_flush(context->bdev);
+        if (ret) {
+            afs_alert("could not flush carriers before checkpoint [%d]", ret);
+            goto checkpoint;
+        }
+    }
+
+    for_each_set_bit (i, map->dirty, config->num_map_blocks) {
+        // Dirty pages are never evicted, this is not a read.
+        page = afs_map_get(map, i * config->num_map_entries_per_block);
+        if (IS_ERR(page)) {
+            afs_alert("dirty map block not in memory [%ld:%u]", PTR_ERR(page), i);
+            ret = PTR_ERR(page);
+            continue;
+        }
+        if (test_and_clear_bit(i, map->dirty)) {
+            atomic_dec(&map->nr_dirty);
+        }
+        smp_mb__after_atomic();
+
+        afs_build_map_block(context, i, page->carriers, page->checksums, context->map_flush_block);
+        err = write_page(context->map_flush_block, context->bdev, afs_map_block_ptr(context, i), context->passive_fs.data_start_off, false);
+        if (err) {
+            afs_alert("could not write map block [%d:%u]", err, i);
+            if (!test_and_set_bit(i, map->dirty)) {
+                atomic_inc(&map->nr_dirty);
+            }
+            ret = err;
         } else {
-            memcpy(entries_start, afs_map + (entries_written * map_entry_sz), num_map_entries_per_block * map_entry_sz);
-            entries_written += num_map_entries_per_block;
+            written++;
         }
+        afs_map_put(map, page);
+    }
 
-        hash_sha512(entries_start, AFS_BLOCK_SIZE - SHA512_SZ - config->unused_space_per_block, hash);
-        ptr += AFS_BLOCK_SIZE;
+    // The map blocks have to be durable before the tail moves past the
+    // log records they hold.
+    if (!ret && written) {
+        ret = afs_blkdev_flush(context->bdev);
+        if (ret) {
+            afs_alert("could not flush map blocks [%d]", ret);
+        }
     }
-    afs_action(entries_written == num_blocks, ret = -EIO, write_err,
-        "wrote incorrect amount [%u:%u]", entries_written, num_blocks);
-    afs_debug("initialized Artifice map blocks");
 
-    context->afs_map_blocks = map_blocks;
-    return 0;
+    // The new tail has to be on the disk before the log blocks before it
+    // are used again.
+    if (!ret && aux->log_num_blocks && (aux->log_tail != mark.seq || aux->log_tail_count != mark.count)) {
+        mutex_lock(&context->aux_lock);
+        log_tail = aux->log_tail;
+        log_tail_count = aux->log_tail_count;
+        aux->log_tail = mark.seq;
+        aux->log_tail_count = mark.count;
+        ret = afs_write_aux_block(context);
+        if (ret) {
+            afs_alert("could not save log tail [%d:%llu]", ret, mark.seq);
+            aux->log_tail = log_tail;
+            aux->log_tail_count = log_tail_count;
+        }
+        mutex_unlock(&context->aux_lock);
+    }
 
-write_err:
-    vfree(map_blocks);
+checkpoint:
+    afs_log_checkpoint(&context->log, &mark, !ret);
+    mutex_unlock(&context->map_flush_lock);
 
-block_err:
+    // Failed blocks are retried later.
+    if (ret) {
+        queue_delayed_work(context->writeback_wq, &context->map_dw, msecs_to_jiffies(AFS_MAP_FLUSH_DELAY_MS));
+    }
     return ret;
 }
 
 /**
- * Write map blocks to pointer blocks.
+ * Make every map update made so far durable. The updates are committed to
+ * the log, or without room in it the map blocks are written instead, and
+ * the passive device is flushed after.
  */
 int
-write_map_blocks(struct afs_private *context, bool update)
+afs_map_commit(struct afs_private *context)
+{
+    int ret;
+
+    ret = afs_log_commit(&context->log);
+    if (ret) {
+        ret = afs_map_flush(context);
+    }
+    if (!ret) {
+        ret = afs_blkdev_flush(context->bdev);
+    }
+    return ret;
+}
+
+/**
+ * Acquire and write the map blocks of a new instance.
+ *
+ * Every map block starts out empty, and all but the last one hold the
+ * same number of entries, so only two of them are built. They are
+ * written in batches, with a whole batch in flight at once.
+ */
+int
+write_map_blocks(struct afs_private *context)
 {
     struct afs_config *config = &context->config;
-    struct afs_super_block *sb = NULL;
-    struct afs_passive_fs *fs = NULL;
-    struct afs_ptr_block *afs_ptr_blocks = NULL;
-    uint8_t *afs_map_blocks = NULL;
-    uint32_t num_map_blocks;
-    uint32_t num_ptr_blocks;
-    uint32_t blocks_written;
-    uint32_t blocks_left;
+    struct afs_super_block *sb = &context->super_block;
+    struct afs_passive_fs *fs = &context->passive_fs;
+    uint32_t num_slots = config->num_map_entries_per_block * config->num_carrier_blocks;
+    uint32_t *carriers = NULL;
+    uint16_t *checksums = NULL;
+    uint8_t *map_blocks = NULL;
+    uint8_t **pages = NULL;
+    uint32_t *blocks = NULL;
     uint32_t block_num;
-    int64_t i, j;
-    uint32_t data_sector_offset = context->passive_fs.data_start_off;
+    uint32_t first;
+    uint32_t count;
+    uint32_t i;
     int ret = 0;
 
-    sb = &context->super_block;
-    fs = &context->passive_fs;
-    afs_map_blocks = context->afs_map_blocks;
-
-    num_map_blocks = config->num_map_blocks;
-    num_ptr_blocks = config->num_ptr_blocks;
-
-    // First utilize all the map block pointers from the super block.
-    blocks_written = 0;
-    for (i = 0; i < NUM_MAP_BLKS_IN_SB; i++) {
-        blocks_left = num_map_blocks - blocks_written;
-        if (!blocks_left) {
-            afs_debug("super block map block pointers filled");
-            return 0;
-        }
+    carriers = kmalloc_array(num_slots, sizeof(*carriers), GFP_KERNEL);
+    checksums = kcalloc(num_slots, sizeof(*checksums), GFP_KERNEL);
+    map_blocks = vmalloc(2 * AFS_BLOCK_SIZE);
+    pages = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*pages), GFP_KERNEL);
+    blocks = kmalloc_array(AFS_MAP_LOAD_BATCH, sizeof(*blocks), GFP_KERNEL);
+    afs_action(carriers && checksums && map_blocks && pages && blocks, ret = -ENOMEM, done, "could not allocate map blocks [%d]", ret);
+    memset32(carriers, AFS_INVALID_BLOCK, num_slots);
+    afs_build_map_block(context, 0, carriers, checksums, map_blocks);
+    afs_build_map_block(context, config->num_map_blocks - 1, carriers, checksums, map_blocks + AFS_BLOCK_SIZE);
+    afs_debug("initialized Artifice map blocks");
 
-        if (!update) {
-            block_num = acquire_block(fs, &context->vector);
-            afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOSPC, done, "no more free blocks");
+    // The super block points to the first map blocks, the pointer blocks
+    // to the rest.
+    for (i = 0; i < config->num_map_blocks; i++) {
+        block_num = acquire_block(fs, &context->vector);
+        afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOSPC, done, "no more free blocks");
+        if (i < NUM_MAP_BLKS_IN_SB) {
             sb->map_block_ptrs[i] = block_num;
         } else {
-            block_num = sb->map_block_ptrs[i];
+            context->afs_ptr_blocks[(i - NUM_MAP_BLKS_IN_SB) / NUM_MAP_BLKS_IN_PB].map_block_ptrs[(i - NUM_MAP_BLKS_IN_SB) % NUM_MAP_BLKS_IN_PB] = block_num;
         }
-        ret = write_page(afs_map_blocks + (blocks_written * AFS_BLOCK_SIZE), context->bdev, block_num, data_sector_offset, true);
-        afs_assert(!ret, done, "could not write blocks [%d:%u]", ret, blocks_written);
-        blocks_written += 1;
     }
-    afs_debug("super block map block pointers filled");
-
-    // If we even reach this point, then it means that some ptr_blocks are required.
-    afs_ptr_blocks = context->afs_ptr_blocks;
-    for (i = 0; i < num_ptr_blocks; i++) {
-        for (j = 0; j < NUM_MAP_BLKS_IN_PB; j++) {
-            blocks_left = num_map_blocks - blocks_written;
-            if (!blocks_left) {
-                break;
-            }
 
-            if (!update) {
-                block_num = acquire_block(fs, &context->vector);
-                afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOSPC, done, "no more free blocks");
-                afs_ptr_blocks[i].map_block_ptrs[j] = block_num;
-            } else {
-                block_num = afs_ptr_blocks[i].map_block_ptrs[j];
-            }
-            ret = write_page(afs_map_blocks + (blocks_written * AFS_BLOCK_SIZE), context->bdev, block_num, data_sector_offset, true);
-            afs_assert(!ret, done, "could not write block [%d:%u]", ret, blocks_written);
-            blocks_written += 1;
+    for (first = 0; first < config->num_map_blocks; first += count) {
+        count = min_t(uint32_t, config->num_map_blocks - first, AFS_MAP_LOAD_BATCH);
+        for (i = 0; i < count; i++) {
+            pages[i] = (first + i == config->num_map_blocks - 1) ? map_blocks + AFS_BLOCK_SIZE : map_blocks;
+            blocks[i] = afs_map_block_ptr(context, first + i);
         }
+        ret = afs_blkdev_batch(pages, blocks, count, context->bdev, fs->data_start_off, true, IO_WRITE);
+        afs_assert(!ret, done, "could not write map blocks [%d:%u]", ret, first);
     }
-    afs_debug("pointer blocks map block pointers filled");
     ret = 0;
 
 done:
+    kfree(blocks);
+    kfree(pages);
+    vfree(map_blocks);
+    kfree(checksums);
+    kfree(carriers);
     return ret;
 }
 
@@ -396,7 +613,7 @@ write_ptr_blocks(struct afs_super_block *sb, struct afs_passive_fs *fs, struct a
     int ret = 0;
 
     // Write all the map blocks.
-    ret = write_map_blocks(context, false);
+    ret = write_map_blocks(context);
     afs_debug("map blocks written");
     afs_assert(!ret, done, "could not write Artifice map blocks [%d]", ret);
 
@@ -442,6 +659,218 @@ done:
     return ret;
 }
 
+/**
+ * Write the auxiliary block to disk, durably and after everything written
+ * before it. Instances without one have nowhere to keep it, and nothing is
+ * written.
+ */
+int
+afs_write_aux_block(struct afs_private *context)
+{
+    struct afs_aux_block *aux = &context->aux_block;
+    uint32_t block_num = context->super_block.aux_block_ptr;
+
+    if (block_num == AFS_INVALID_BLOCK) {
+        return 0;
+    }
+
+    hash_sha256((uint8_t *)aux + SHA256_SZ, sizeof(*aux) - SHA256_SZ, aux->hash);
+    return write_page_fua(aux, context->bdev, block_num, context->passive_fs.data_start_off, false);
+}
+
+/**
+ * Read the auxiliary block from disk. Instances created before it
+ * existed have no valid one, they are left without.
+ */
+static int
+afs_read_aux_block(struct afs_private *context)
+{
+    struct afs_aux_block *aux = &context->aux_block;
+    uint32_t block_num = context->super_block.aux_block_ptr;
+    uint8_t digest[SHA256_SZ];
+    int ret;
+
+    afs_action(block_num != AFS_INVALID_BLOCK, ret = -ENOENT, err, "no aux block");
+    ret = read_page(aux, context->bdev, block_num, context->passive_fs.data_start_off, false);
+    afs_assert(!ret, err, "could not read aux block [%d:%u]", ret, block_num);
+
+    hash_sha256((uint8_t *)aux + SHA256_SZ, sizeof(*aux) - SHA256_SZ, digest);
+    afs_action(!memcmp(aux->hash, digest, SHA256_SZ), ret = -ENOENT, err, "aux block corrupted");
+    allocation_set(&context->vector, block_num);
+    return 0;
+
+err:
+    memset(aux, 0, sizeof(*aux));
+    context->super_block.aux_block_ptr = AFS_INVALID_BLOCK;
+    return ret;
+}
+
+/**
+ * Note the map block a record of the log updates.
+ */
+static int
+afs_log_scan(void *private, uint32_t block, const uint8_t *entry)
+{
+    struct afs_private *context = private;
+    struct afs_map *map = &context->afs_map;
+
+    if (block < context->config.num_blocks) {
+        __set_bit(afs_map_index(map, block), map->dirty);
+    }
+    return 0;
+}
+
+/**
+ * Apply a record replayed from the log to the map. The carriers it
+ * points to are in use, whatever the map blocks on the disk say. The
+ * page it updates is in memory already.
+ */
+static int
+afs_log_apply(void *private, uint32_t block, const uint8_t *entry)
+{
+    struct afs_private *context = private;
+    struct afs_config *config = &context->config;
+    struct afs_map *map = &context->afs_map;
+    struct afs_map_page *page;
+    uint32_t *carriers;
+    uint32_t i;
+
+    if (block >= config->num_blocks) {
+        return 0;
+    }
+    page = afs_map_get(map, block);
+    if (IS_ERR(page)) {
+        return PTR_ERR(page);
+    }
+
+    carriers = afs_map_carriers(map, page, block);
+    afs_map_unpack_entry(config, carriers, afs_map_checksums(map, page, block), entry);
+    for (i = 0; i < config->num_carrier_blocks; i++) {
+        if (carriers[i] != AFS_INVALID_BLOCK) {
+            allocation_set(&context->vector, carriers[i]);
+        }
+    }
+    afs_map_put(map, page);
+    return 0;
+}
+
+/**
+ * Open the log of a mounted instance and replay it over the map. The map
+ * blocks it dirties stay in memory until the first checkpoint writes
+ * them.
+ *
+ * The log is read first, and the map blocks its records update are
+ * marked dirty. Those are read all at once, in batches, and only then
+ * are the records applied, so replay takes a read of the log and of the
+ * map blocks it touches, whatever the order of the records.
+ */
+static int
+afs_replay_log(struct afs_private *context)
+{
+    struct afs_config *config = &context->config;
+    struct afs_aux_block *aux = &context->aux_block;
+    struct afs_map *map = &context->afs_map;
+    struct afs_map_page **pages = NULL;
+    uint32_t *indices = NULL;
+    uint32_t count = 0;
+    uint32_t i;
+    int ret;
+
+    // Instances without a log yet get one once they are up.
+    if (!aux->log_num_blocks) {
+        return 0;
+    }
+    afs_action(aux->log_num_blocks <= AFS_LOG_BLKS, ret = -EINVAL, err, "log too large [%u]", aux->log_num_blocks);
+
+    ret = afs_log_open(&context->log, aux->log_id, aux->log_blocks, aux->log_num_blocks, sizeof(uint32_t) + config->map_entry_sz,
+        aux->log_tail, aux->log_tail_count, context->bdev, context->passive_fs.data_start_off);
+    afs_assert(!ret, err, "could not open log [%d]", ret);
+    for (i = 0; i < aux->log_num_blocks; i++) {
+        allocation_set(&context->vector, aux->log_blocks[i]);
+    }
+
+    ret = afs_log_read(&context->log, afs_log_scan, context);
+    afs_assert(!ret, err, "could not read log [%d]", ret);
+
+    count = bitmap_weight(map->dirty, config->num_map_blocks);
+    if (count) {
+        indices = kvmalloc_array(count, sizeof(*indices), GFP_KERNEL);
+        pages = kvmalloc_array(count, sizeof(*pages), GFP_KERNEL);
+        afs_action(indices && pages, ret = -ENOMEM, err, "could not allocate replayed map blocks [%d]", ret);
+        count = 0;
+        for_each_set_bit (i, map->dirty, config->num_map_blocks) {
+            indices[count++] = i;
+        }
+        ret = afs_map_get_many(map, indices, count, pages);
+        afs_assert(!ret, err, "could not read map blocks of log [%d]", ret);
+        atomic_set(&map->nr_dirty, count);
+    }
+
+    ret = afs_log_replay(&context->log, afs_log_apply, context);
+    for (i = 0; i < count; i++) {
+        afs_map_put(map, pages[i]);
+    }
+    afs_assert(!ret, err, "could not replay log [%d]", ret);
+    afs_debug("log replayed [%llu records over %u map blocks from %llu]", context->log.replayed, count, aux->log_tail);
+
+err:
+    kvfree(pages);
+    kvfree(indices);
+    return ret;
+}
+
+/**
+ * Give an instance a log. Instances without an aux block have nowhere to
+ * keep it, their map is only written by checkpoints.
+ */
+int
+afs_create_log(struct afs_private *context)
+{
+    struct afs_config *config = &context->config;
+    struct afs_aux_block *aux = &context->aux_block;
+    uint32_t i = 0;
+    int ret;
+
+    if (context->super_block.aux_block_ptr == AFS_INVALID_BLOCK || aux->log_num_blocks) {
+        return 0;
+    }
+
+    // Free blocks are only known once the map has been scanned.
+    wait_for_completion(&context->scanned);
+    afs_action(!READ_ONCE(context->scan_err), ret = context->scan_err, block_err, "no allocation vector [%d]", ret);
+
+    for (i = 0; i < AFS_LOG_BLKS; i++) {
+        aux->log_blocks[i] = acquire_block(&context->passive_fs, &context->vector);
+        afs_action(aux->log_blocks[i] != AFS_INVALID_BLOCK, ret = -ENOSPC, block_err, "no more free blocks");
+    }
+
+    // Whatever these blocks held before cannot pass for this log.
+    get_random_bytes(&aux->log_id, sizeof(aux->log_id));
+    aux->log_tail = 0;
+    aux->log_tail_count = 0;
+    ret = afs_log_open(&context->log, aux->log_id, aux->log_blocks, AFS_LOG_BLKS, sizeof(uint32_t) + config->map_entry_sz,
+        0, 0, context->bdev, context->passive_fs.data_start_off);
+    afs_assert(!ret, block_err, "could not open log [%d]", ret);
+
+    mutex_lock(&context->aux_lock);
+    aux->log_num_blocks = AFS_LOG_BLKS;
+    ret = afs_write_aux_block(context);
+    if (ret) {
+        aux->log_num_blocks = 0;
+    }
+    mutex_unlock(&context->aux_lock);
+    afs_assert(!ret, log_err, "could not write aux block [%d]", ret);
+    return 0;
+
+log_err:
+    afs_log_exit(&context->log);
+
+block_err:
+    allocation_free_many(&context->vector, aux->log_blocks, i);
+    memset(aux->log_blocks, 0, sizeof(aux->log_blocks));
+    return ret;
+}
+
 int chain_hash_superblock(uint32_t *pass_hash[SHA1_SZ], uint32_t *sb_block, uint32_t block_device_size, struct afs_passive_fs *fs){
     while(binary_search(fs->block_list, *sb_block, fs->list_len) == -1){
         
@@ -475,7 +904,7 @@ write_super_block(struct afs_super_block *sb, struct afs_passive_fs *fs, struct
         memcpy(&sb_block[0] , pass_hash[0], sizeof(uint32_t));
         sb_block[0] = sb_block[0] % block_device_size; 
     }
-    allocation_set(&context->vector, sb_block[0]);
+    allocation_set(&context->vector, fs->block_list[sb_block[0]]);
 
     //generate list of additional superblock locations
     //Iteratively hash like before
@@ -488,17 +917,13 @@ write_super_block(struct afs_super_block *sb, struct afs_passive_fs *fs, struct
             memcpy(&sb_block[i] , pass_hash[i], sizeof(uint32_t));
             sb_block[i] = sb_block[i] % block_device_size;
         }
-        allocation_set(&context->vector, sb_block[i]);
+        allocation_set(&context->vector, fs->block_list[sb_block[i]]);
     }
 
     // Build the Artifice Map.
     ret = afs_create_map(context);
     afs_assert(!ret, map_err, "could not create Artifice map [%d]", ret);
 
-    // Build the Artifice Map Blocks.
-    ret = afs_create_map_blocks(context);
-    afs_assert(!ret, map_block_err, "could not create Artifice map blocks [%d]", ret);
-
     // Allocate the Artifice Pointer Blocks.
     ptr_blocks = kmalloc(config->num_ptr_blocks * sizeof(*ptr_blocks), GFP_KERNEL);
     afs_action(ptr_blocks, ret = -ENOMEM, ptr_block_err, "could not allocate ptr_blocks [%d]", ret);
@@ -512,6 +937,14 @@ write_super_block(struct afs_super_block *sb, struct afs_passive_fs *fs, struct
     afs_debug("pointer blocks written");
     afs_assert(!ret, ptr_block_err, "could not write pointer blocks [%d]", ret);
 
+    // The aux block starts out empty.
+    sb->aux_block_ptr = acquire_block(fs, &context->vector);
+    afs_action(sb->aux_block_ptr != AFS_INVALID_BLOCK, ret = -ENOSPC, sb_err, "no more free blocks");
+    memset(&context->aux_block, 0, sizeof(context->aux_block));
+    context->aux_block.map_format = config->map_format;
+    ret = afs_write_aux_block(context);
+    afs_assert(!ret, sb_err, "could not write aux block [%d]", ret);
+
     // 1. Take note of the instance size.
     // 2. Take note of the entropy directory for the instance.
     // 3. Hash the super block.
@@ -526,52 +959,18 @@ write_super_block(struct afs_super_block *sb, struct afs_passive_fs *fs, struct
         afs_debug("super blocks written to disk replica %u [block: %u]", i, sb_block[i]);
     }
 
-    // We don't need the map blocks anymore.
-    vfree(context->afs_map_blocks);
     return 0;
 
 sb_err:
     kfree(context->afs_ptr_blocks);
 
 ptr_block_err:
-    vfree(context->afs_map_blocks);
-
-map_block_err:
-    vfree(context->afs_map);
+    afs_free_map(context);
 
 map_err:
     return ret;
 }
 
-/**
- * Traverse through the Artifice map and
- * rebuild the allocation vector.
- */
-static void
-rebuild_allocation_vector(struct afs_private *context)
-{
-    struct afs_config *config = &context->config;
-    struct afs_map_tuple *map_tuple = NULL;
-    uint8_t *afs_map = NULL;
-    uint8_t num_carrier_blocks;
-    uint8_t map_entry_sz;
-    uint32_t num_entries;
-    uint32_t i, j;
-
-    afs_map = context->afs_map;
-    num_entries = config->num_blocks;
-    num_carrier_blocks = config->num_carrier_blocks;
-    map_entry_sz = config->map_entry_sz;
-
-    for (i = 0; i < num_entries; i++) {
-        map_tuple = (struct afs_map_tuple *)(afs_map + (i * map_entry_sz));
-        for (j = 0; j < num_carrier_blocks; j++) {
-            allocation_set(&context->vector, map_tuple->carrier_block_ptr);
-            map_tuple += 1;
-        }
-    }
-}
-
 /**
  * Initialize the entires into the pointer blocks.
  */
@@ -591,9 +990,11 @@ rebuild_ptr_blocks(struct afs_private *context)
 
     num_ptr_blocks = config->num_ptr_blocks;
     for (i = 0; i < num_ptr_blocks; i++) {
-        block_num = (i == 0) ? context->super_block.first_ptr_block : afs_ptr_blocks[i].next_ptr_block;
+        block_num = (i == 0) ? context->super_block.first_ptr_block : afs_ptr_blocks[i - 1].next_ptr_block;
         ret = read_page(afs_ptr_blocks + i, context->bdev, block_num, data_sector_offset, false);
         afs_assert(!ret, done, "could not read pointer block [%d:%u]", ret, block_num);
+        allocation_set(&context->vector, block_num);
+        // TODO: Calculate and verify hash of ptr_block.
     }
     ret = 0;
 
@@ -616,6 +1017,7 @@ find_super_block(struct afs_super_block *sb, struct afs_private *context)
     uint32_t sb_tries = 0;
     uint8_t pass_hash[NUM_SUPERBLOCK_REPLICAS][SHA1_SZ];
     uint32_t block_device_size = config->bdev_size / AFS_SECTORS_PER_BLOCK;
+    uint32_t i;
 
     hash_sha1(context->args.passphrase, PASSPHRASE_SZ, pass_hash[0]);
     memcpy(&sb_block[0], pass_hash[0], sizeof(uint32_t));
@@ -644,7 +1046,7 @@ find_super_block(struct afs_super_block *sb, struct afs_private *context)
             break; 
         }
     }
-    allocation_set(&context->vector, sb_block[0]);
+    allocation_set(&context->vector, context->passive_fs.block_list[sb_block[0]]);
 
     afs_action(!ret, ret = -ENOENT, err, "super block corrupted");
 
@@ -652,19 +1054,23 @@ find_super_block(struct afs_super_block *sb, struct afs_private *context)
     afs_action(config->instance_size == sb->instance_size, ret = -EINVAL, err,
         "incorrect size provided [%llu:%llu]", config->instance_size, sb->instance_size);
 
+    // Without it the instance keeps working, it only forgets the state
+    // kept there. Instances that never had one use the legacy map format.
+    ret = afs_read_aux_block(context);
+    if (ret) {
+        afs_alert("no aux block, state is not kept across mounts [%d]", ret);
+    }
+    afs_action(context->aux_block.map_format <= AFS_MAP_COMPACT, ret = -EINVAL, err,
+        "unknown map format [%u]", context->aux_block.map_format);
+
     // TODO: Acquire from RS params in SB.
-    build_configuration(context, 4, 1);
+    build_configuration(context, 4, 1, context->aux_block.map_format);
 
     ret = afs_create_map(context);
     afs_assert(!ret, err, "could not create artifice map [%d]", ret);
 
-    ret = afs_fill_map(sb, context);
-    afs_assert(!ret, map_fill_err, "could not fill artifice map [%d]", ret);
-    rebuild_allocation_vector(context);
-    afs_debug("Artifice map rebuilt");
-
-    // Create the Artifice Pointer Blocks. These are required for when
-    // we need to re-write the map blocks.
+    // Read the Artifice Pointer Blocks. These locate the map blocks, and
+    // are required for when we need to re-write them.
     ptr_blocks = kmalloc(config->num_ptr_blocks * sizeof(*ptr_blocks), GFP_KERNEL);
     afs_action(ptr_blocks, ret = -ENOMEM, map_fill_err, "could not allocate ptr_blocks [%d]", ret);
     context->afs_ptr_blocks = ptr_blocks;
@@ -673,13 +1079,27 @@ find_super_block(struct afs_super_block *sb, struct afs_private *context)
     afs_assert(!ret, ptr_block_err, "could not rebuild Artifice pointer blocks [%d]", ret);
     afs_debug("Artifice pointer blocks rebuilt");
 
+    // The map blocks themselves are read once somebody needs them, and
+    // scanned for carriers in use once the instance is up.
+    for (i = 0; i < config->num_map_blocks; i++) {
+        allocation_set(&context->vector, afs_map_block_ptr(context, i));
+    }
+
+    // Updates since the last checkpoint are only in the log.
+    ret = afs_replay_log(context);
+    afs_assert(!ret, log_err, "could not replay log [%d]", ret);
+    afs_debug("Artifice map ready");
+
     return 0;
 
+log_err:
+    afs_log_exit(&context->log);
+
 ptr_block_err:
-    kfree(context->afs_map_blocks);
+    kfree(context->afs_ptr_blocks);
 
 map_fill_err:
-    vfree(context->afs_map);
+    afs_free_map(context);
 
 err:
     return ret;
@@ -0,0 +1,124 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_prefetch.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+
+/**
+ * Stream a read continues, or the stream to replace with a new one.
+ * Lock must be held.
+ */
+static struct afs_stream *
+afs_prefetch_stream(struct afs_prefetch *pf, uint32_t block, bool *found) {
+    struct afs_stream *oldest = &pf->streams[0];
+    uint32_t i;
+
+    for (i = 0; i < AFS_PREFETCH_STREAMS; i++) {
+        if (pf->streams[i].hits && pf->streams[i].next == block) {
+            *found = true;
+            return &pf->streams[i];
+        }
+        if (time_before(pf->streams[i].last, oldest->last)) {
+            oldest = &pf->streams[i];
+        }
+    }
+    *found = false;
+    return oldest;
+}
+
+/**
+ * Initialize stream detection.
+ */
+void
+afs_prefetch_init(struct afs_prefetch *pf, uint32_t max_window, uint32_t limit) {
+    memset(pf, 0, sizeof(*pf));
+    spin_lock_init(&pf->lock);
+    pf->max_window = max_window;
+    pf->limit = limit;
+}
+
+/**
+ * Account a read of blocks [block, block + num_blocks).
+ */
+bool
+afs_prefetch_read(struct afs_prefetch *pf, uint32_t block, uint32_t num_blocks) {
+    struct afs_stream *stream;
+    unsigned long flags;
+    uint32_t end;
+    bool found;
+    bool due = false;
+
+    if (!pf->max_window) {
+        return false;
+    }
+
+    spin_lock_irqsave(&pf->lock, flags);
+    stream = afs_prefetch_stream(pf, block, &found);
+    stream->last = jiffies;
+    if (!found) {
+        stream->next = block + num_blocks;
+        stream->ahead = stream->next;
+        stream->window = min_t(uint32_t, AFS_PREFETCH_MIN_WINDOW, pf->max_window);
+        stream->hits = 1;
+        stream->pending = 0;
+        goto done;
+    }
+
+    stream->next = block + num_blocks;
+    if (++stream->hits < AFS_PREFETCH_TRIGGER) {
+        goto done;
+    }
+
+    // The stream overtook the prefetch, whatever was still pending has
+    // been read by now.
+    if (stream->ahead < stream->next) {
+        stream->ahead = stream->next;
+        stream->pending = 0;
+    }
+
+    // Top up once the stream is into the second half of the window.
+    if (stream->ahead - stream->next > stream->window / 2) {
+        goto done;
+    }
+    end = min_t(uint64_t, (uint64_t)stream->next + stream->window, pf->limit);
+    if (end <= stream->ahead) {
+        goto done;
+    }
+    if (!stream->pending) {
+        stream->pending_start = stream->ahead;
+    }
+    stream->pending += end - stream->ahead;
+    stream->ahead = end;
+    stream->window = min_t(uint32_t, stream->window * 2, pf->max_window);
+    due = true;
+
+done:
+    spin_unlock_irqrestore(&pf->lock, flags);
+    return due;
+}
+
+/**
+ * Take a range of blocks due for prefetching.
+ */
+bool
+afs_prefetch_take(struct afs_prefetch *pf, uint32_t *start, uint32_t *count) {
+    unsigned long flags;
+    bool taken = false;
+    uint32_t i;
+
+    spin_lock_irqsave(&pf->lock, flags);
+    for (i = 0; i < AFS_PREFETCH_STREAMS; i++) {
+        if (pf->streams[i].pending) {
+            *start = pf->streams[i].pending_start;
+            *count = pf->streams[i].pending;
+            pf->streams[i].pending = 0;
+            taken = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&pf->lock, flags);
+    return taken;
+}
@@ -1 +1,132 @@
-/* should contain code for repair functions */
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_repair.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/**
+ * Repair worker. Issues the next batch of queued blocks.
+ */
+static void
+afs_repairq(struct work_struct *ws) {
+    struct afs_repair *repair = container_of(to_delayed_work(ws), struct afs_repair, dw);
+    unsigned long flags;
+    uint32_t block;
+    int ret;
+
+    spin_lock_irqsave(&repair->lock, flags);
+    while (repair->nr_pending && repair->inflight < AFS_REPAIR_BATCH) {
+        block = find_next_bit(repair->pending, repair->num_blocks, repair->cursor);
+        if (block >= repair->num_blocks) {
+            block = find_first_bit(repair->pending, repair->num_blocks);
+        }
+        __clear_bit(block, repair->pending);
+        repair->nr_pending--;
+        repair->cursor = block + 1;
+        repair->inflight++;
+        spin_unlock_irqrestore(&repair->lock, flags);
+
+        ret = repair->issue(repair, block);
+
+        spin_lock_irqsave(&repair->lock, flags);
+        if (ret) {
+            repair->inflight--;
+        }
+    }
+    spin_unlock_irqrestore(&repair->lock, flags);
+}
+
+/**
+ * Initialize a repair queue.
+ */
+int
+afs_repair_init(struct afs_repair *repair, struct workqueue_struct *wq, uint32_t num_blocks, afs_repair_issue_fn issue) {
+    memset(repair, 0, sizeof(*repair));
+    repair->pending = vzalloc(BITS_TO_LONGS(num_blocks) * sizeof(*repair->pending));
+    if (!repair->pending) {
+        return -ENOMEM;
+    }
+
+    spin_lock_init(&repair->lock);
+    repair->num_blocks = num_blocks;
+    repair->wq = wq;
+    repair->issue = issue;
+    INIT_DELAYED_WORK(&repair->dw, afs_repairq);
+    return 0;
+}
+
+/**
+ * Release a repair queue.
+ */
+void
+afs_repair_exit(struct afs_repair *repair) {
+    vfree(repair->pending);
+    repair->pending = NULL;
+}
+
+/**
+ * Queue a block for repair.
+ */
+void
+afs_repair_add(struct afs_repair *repair, uint32_t block) {
+    unsigned long flags;
+    bool added = false;
+
+    spin_lock_irqsave(&repair->lock, flags);
+    if (repair->pending && block < repair->num_blocks && !test_bit(block, repair->pending)) {
+        __set_bit(block, repair->pending);
+        repair->nr_pending++;
+        added = !repair->inflight;
+    }
+    spin_unlock_irqrestore(&repair->lock, flags);
+
+    // A batch in flight picks up whatever was queued once it completes.
+    if (added) {
+        queue_delayed_work(repair->wq, &repair->dw, msecs_to_jiffies(AFS_REPAIR_DELAY_MS));
+    }
+}
+
+/**
+ * Stop issuing repairs.
+ */
+void
+afs_repair_stop(struct afs_repair *repair) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&repair->lock, flags);
+    if (repair->pending) {
+        bitmap_zero(repair->pending, repair->num_blocks);
+    }
+    repair->nr_pending = 0;
+    spin_unlock_irqrestore(&repair->lock, flags);
+
+    cancel_delayed_work_sync(&repair->dw);
+}
+
+/**
+ * Completion of a repair.
+ */
+void
+afs_repair_done(struct afs_repair *repair, bool error) {
+    unsigned long flags;
+    bool next;
+
+    spin_lock_irqsave(&repair->lock, flags);
+    repair->inflight--;
+    if (error) {
+        repair->errors++;
+    } else {
+        repair->repaired++;
+    }
+    next = !repair->inflight && repair->nr_pending;
+    spin_unlock_irqrestore(&repair->lock, flags);
+
+    if (next) {
+        queue_delayed_work(repair->wq, &repair->dw, msecs_to_jiffies(AFS_REPAIR_DELAY_MS));
+    }
+}
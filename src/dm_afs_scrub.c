@@ -0,0 +1,246 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_scrub.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+
+/**
+ * Refill the tokens for the time passed since the last refill. At most a
+ * tenth of a second worth of blocks is saved up. Lock must be held.
+ */
+static void
+afs_scrub_refill(struct afs_scrub *scrub) {
+    uint64_t fill;
+    uint32_t burst;
+
+    if (!scrub->rate) {
+        return;
+    }
+
+    fill = div_u64((uint64_t)(jiffies - scrub->refill) * scrub->rate, HZ);
+    if (!fill) {
+        return;
+    }
+    burst = max_t(uint32_t, scrub->rate / 10, scrub->window);
+    scrub->tokens = min_t(uint64_t, scrub->tokens + fill, burst);
+    scrub->refill += div_u64(fill * HZ, scrub->rate);
+}
+
+/**
+ * Scrub worker. Issues blocks until the window is full, the tokens run
+ * out or a checkpoint is due. Completions queue it again.
+ */
+static void
+afs_scrubq(struct work_struct *ws) {
+    struct afs_scrub *scrub = container_of(to_delayed_work(ws), struct afs_scrub, dw);
+    unsigned long delay = 0;
+    unsigned long flags;
+    uint32_t checkpoint = 0;
+    uint32_t scanned = 0;
+    uint32_t block;
+    uint64_t passes = 0;
+    bool requeue = false;
+    bool save = false;
+    int ret;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    afs_scrub_refill(scrub);
+    while (scrub->running && scrub->inflight < scrub->window) {
+        // Every block before the cursor has to be done before the
+        // cursor is saved.
+        if (scrub->cursor == scrub->num_blocks || scrub->cursor - scrub->checkpoint >= AFS_SCRUB_CHECKPOINT_BLKS) {
+            save = !scrub->inflight;
+            break;
+        }
+
+        // Unmapped blocks cost nothing, but a sparse instance would keep
+        // the worker going for a long time.
+        if (scanned == AFS_SCRUB_SCAN_BLKS) {
+            requeue = true;
+            break;
+        }
+
+        if (scrub->rate && !scrub->tokens) {
+            delay = max_t(unsigned long, HZ / scrub->rate, 1);
+            requeue = true;
+            break;
+        }
+
+        block = scrub->cursor++;
+        scrub->inflight++;
+        scanned++;
+        spin_unlock_irqrestore(&scrub->lock, flags);
+
+        ret = scrub->issue(scrub, block);
+
+        spin_lock_irqsave(&scrub->lock, flags);
+        if (ret) {
+            scrub->inflight--;
+        } else if (scrub->tokens) {
+            scrub->tokens--;
+        }
+    }
+
+    if (save) {
+        if (scrub->cursor == scrub->num_blocks) {
+            scrub->cursor = 0;
+            scrub->passes++;
+            scrub->running = false;
+            afs_debug("scrub pass %llu completed [%llu repaired]", scrub->passes, scrub->repaired);
+        }
+        scrub->checkpoint = scrub->cursor;
+        checkpoint = scrub->checkpoint;
+        passes = scrub->passes;
+        requeue = scrub->running;
+    }
+    spin_unlock_irqrestore(&scrub->lock, flags);
+
+    if (save) {
+        scrub->save(scrub, checkpoint, passes);
+    }
+    if (requeue) {
+        queue_delayed_work(scrub->wq, &scrub->dw, delay);
+    }
+}
+
+/**
+ * Initialize a scrubber.
+ */
+void
+afs_scrub_init(struct afs_scrub *scrub, struct workqueue_struct *wq, uint32_t num_blocks, uint32_t rate,
+    afs_scrub_issue_fn issue, afs_scrub_save_fn save) {
+    memset(scrub, 0, sizeof(*scrub));
+    spin_lock_init(&scrub->lock);
+    scrub->num_blocks = num_blocks;
+    scrub->window = AFS_SCRUB_WINDOW;
+    scrub->rate = rate;
+    scrub->refill = jiffies;
+    scrub->wq = wq;
+    scrub->issue = issue;
+    scrub->save = save;
+    INIT_DELAYED_WORK(&scrub->dw, afs_scrubq);
+}
+
+/**
+ * Continue from a saved checkpoint.
+ */
+void
+afs_scrub_restore(struct afs_scrub *scrub, uint32_t checkpoint, uint64_t passes) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    scrub->cursor = (checkpoint < scrub->num_blocks) ? checkpoint : 0;
+    scrub->checkpoint = scrub->cursor;
+    scrub->passes = passes;
+    spin_unlock_irqrestore(&scrub->lock, flags);
+}
+
+/**
+ * Start, or continue, a pass.
+ */
+void
+afs_scrub_start(struct afs_scrub *scrub) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    if (!scrub->running) {
+        scrub->running = true;
+        scrub->refill = jiffies;
+    }
+    spin_unlock_irqrestore(&scrub->lock, flags);
+
+    mod_delayed_work(scrub->wq, &scrub->dw, 0);
+}
+
+/**
+ * Stop issuing blocks.
+ */
+void
+afs_scrub_pause(struct afs_scrub *scrub) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    scrub->running = false;
+    spin_unlock_irqrestore(&scrub->lock, flags);
+}
+
+/**
+ * Change the rate.
+ */
+void
+afs_scrub_set_rate(struct afs_scrub *scrub, uint32_t rate) {
+    unsigned long flags;
+    bool running;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    scrub->rate = rate;
+    scrub->tokens = 0;
+    scrub->refill = jiffies;
+    running = scrub->running;
+    spin_unlock_irqrestore(&scrub->lock, flags);
+
+    // A worker waiting for tokens at the old rate is moved up.
+    if (running) {
+        mod_delayed_work(scrub->wq, &scrub->dw, 0);
+    }
+}
+
+/**
+ * Pause and wait for the worker.
+ */
+void
+afs_scrub_stop(struct afs_scrub *scrub) {
+    afs_scrub_pause(scrub);
+    cancel_delayed_work_sync(&scrub->dw);
+}
+
+/**
+ * Save the position of a stopped scrubber.
+ */
+void
+afs_scrub_save(struct afs_scrub *scrub) {
+    unsigned long flags;
+    uint32_t checkpoint;
+    uint64_t passes;
+    bool moved;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    moved = scrub->checkpoint != scrub->cursor;
+    scrub->checkpoint = scrub->cursor;
+    checkpoint = scrub->checkpoint;
+    passes = scrub->passes;
+    spin_unlock_irqrestore(&scrub->lock, flags);
+
+    if (moved) {
+        scrub->save(scrub, checkpoint, passes);
+    }
+}
+
+/**
+ * Completion of a scrubbed block.
+ */
+void
+afs_scrub_done(struct afs_scrub *scrub, bool error, bool repaired) {
+    unsigned long flags;
+    bool running;
+
+    spin_lock_irqsave(&scrub->lock, flags);
+    scrub->inflight--;
+    scrub->scrubbed++;
+    if (error) {
+        scrub->errors++;
+    } else if (repaired) {
+        scrub->repaired++;
+    }
+    running = scrub->running;
+    spin_unlock_irqrestore(&scrub->lock, flags);
+
+    // A worker waiting for tokens keeps waiting.
+    if (running) {
+        queue_delayed_work(scrub->wq, &scrub->dw, 0);
+    }
+}
@@ -0,0 +1,106 @@
+/**
+ * Author: Yash Gupta <ygupta@ucsc.edu>, Austen Barker <atbarker@ucsc.edu>
+ * Copyright: UC Santa Cruz, SSRC
+ */
+#include <dm_afs.h>
+#include <dm_afs_submit.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/spinlock.h>
+
+/**
+ * Submit a batch of queued bios in ascending sector order.
+ */
+static void
+afs_submitq(struct work_struct *ws) {
+    struct afs_submit_queue *queue = container_of(ws, struct afs_submit_queue, ws);
+    struct afs_submit_link *link;
+    struct rb_node *node;
+    struct rb_root batch;
+    struct blk_plug plug;
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->lock, flags);
+    batch = queue->root;
+    queue->root = RB_ROOT;
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    // A submitted bio may complete and take its link with it, so every
+    // node leaves the tree before its bio is submitted. The tree then
+    // only ever holds links whose bios are still ours.
+    blk_start_plug(&plug);
+    while ((node = rb_first(&batch))) {
+        rb_erase(node, &batch);
+        link = rb_entry(node, struct afs_submit_link, node);
+        submit_bio(link->bio);
+    }
+    blk_finish_plug(&plug);
+}
+
+/**
+ * Initialize a submit queue.
+ */
+int
+afs_submit_init(struct afs_submit_queue *queue, bool sorted) {
+    spin_lock_init(&queue->lock);
+    queue->root = RB_ROOT;
+    queue->sorted = sorted;
+    INIT_WORK(&queue->ws, afs_submitq);
+
+    // Queued bios hold carrier bios from the instance bio set, which only
+    // get freed once they are submitted. The queue has to make progress
+    // under memory pressure.
+    queue->wq = alloc_workqueue("%s", WQ_HIGHPRI | WQ_MEM_RECLAIM, 1, "Artifice Submit WQ");
+    if (!queue->wq) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Release a submit queue.
+ */
+void
+afs_submit_exit(struct afs_submit_queue *queue) {
+    if (queue->wq) {
+        destroy_workqueue(queue->wq);
+        queue->wq = NULL;
+    }
+}
+
+/**
+ * Submit a bio through a queue.
+ */
+void
+afs_submit_bio(struct afs_submit_queue *queue, struct afs_submit_link *link, struct bio *bio) {
+    struct rb_node **node = &queue->root.rb_node;
+    struct rb_node *parent = NULL;
+    struct afs_submit_link *other;
+    unsigned long flags;
+    bool first;
+
+    if (!queue->sorted) {
+        submit_bio(bio);
+        return;
+    }
+
+    link->bio = bio;
+    spin_lock_irqsave(&queue->lock, flags);
+    first = RB_EMPTY_ROOT(&queue->root);
+    while (*node) {
+        parent = *node;
+        other = rb_entry(parent, struct afs_submit_link, node);
+        if (bio->bi_iter.bi_sector < other->bio->bi_iter.bi_sector) {
+            node = &parent->rb_left;
+        } else {
+            node = &parent->rb_right;
+        }
+    }
+    rb_link_node(&link->node, parent, node);
+    rb_insert_color(&link->node, &queue->root);
+    spin_unlock_irqrestore(&queue->lock, flags);
+
+    if (first) {
+        queue_work(queue->wq, &queue->ws);
+    }
+}
@@ -30,110 +30,145 @@ static int calc_hash(const uint8_t *data, size_t datalen, uint8_t *digest) {
     return ret;
 }*/
 
+/**
+ * Length of the ciphertext held by data share i. Share i holds bytes
+ * [i * rs_block_size, (i + 1) * rs_block_size) of the encrypted payload,
+ * whatever lies beyond the ciphertext is the difference.
+ */
+static inline size_t aont_share_cipher(size_t i, size_t cipher_size, size_t rs_block_size){
+    size_t start = rs_block_size * i;
+
+    return (start < cipher_size) ? min(rs_block_size, cipher_size - start) : 0;
+}
+
+/**
+ * Encrypt data straight into the data shares, hashing the ciphertext on
+ * the way.
+ */
+static void aont_encrypt_shares(const uint8_t *data, uint8_t **shares, size_t cipher_size, size_t rs_block_size, size_t data_blocks,
+                                uint64_t *key, uint64_t *nonce, uint8_t *hash){
+    struct sha3_ctx ctx;
+    size_t length;
+    int i;
+
+    sha3_256_init(&ctx);
+    for (i = 0; i < data_blocks; i++) {
+        length = aont_share_cipher(i, cipher_size, rs_block_size);
+        speck_ctr_offset(&data[rs_block_size * i], shares[i], length, key, nonce, rs_block_size * i);
+        sha3_256_update(&ctx, shares[i], length);
+    }
+    sha3_256_final(&ctx, hash);
+}
+
+/**
+ * Hash the ciphertext held by the data shares.
+ */
+static void aont_hash_shares(uint8_t **shares, size_t cipher_size, size_t rs_block_size, size_t data_blocks, uint8_t *hash){
+    struct sha3_ctx ctx;
+    int i;
+
+    sha3_256_init(&ctx);
+    for (i = 0; i < data_blocks; i++) {
+        sha3_256_update(&ctx, shares[i], aont_share_cipher(i, cipher_size, rs_block_size));
+    }
+    sha3_256_final(&ctx, hash);
+}
+
+/**
+ * Decrypt the ciphertext held by the data shares straight into data.
+ */
+static void aont_decrypt_shares(uint8_t **shares, uint8_t *data, size_t cipher_size, size_t rs_block_size, size_t data_blocks,
+                                uint64_t *key, uint64_t *nonce){
+    int i;
+
+    for (i = 0; i < data_blocks; i++) {
+        speck_ctr_offset(shares[i], &data[rs_block_size * i], aont_share_cipher(i, cipher_size, rs_block_size), key, nonce, rs_block_size * i);
+    }
+}
+
+/**
+ * Copy the difference between a buffer and the tails of the data shares.
+ */
+static void aont_copy_difference(uint8_t *difference, uint8_t **shares, size_t cipher_size, size_t rs_block_size,
+                                 size_t data_blocks, bool to_shares){
+    size_t offset, length;
+    int i;
+
+    for (i = 0; i < data_blocks; i++) {
+        offset = aont_share_cipher(i, cipher_size, rs_block_size);
+        length = rs_block_size - offset;
+        if (!length) {
+            continue;
+        }
+        if (to_shares) {
+            memcpy(&shares[i][offset], &difference[rs_block_size * i + offset - cipher_size], length);
+        } else {
+            memcpy(&difference[rs_block_size * i + offset - cipher_size], &shares[i][offset], length);
+        }
+    }
+}
+
 //TODO change sizes here
 int encode_aont_package(uint8_t *difference, const uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce){
-    //uint8_t canary[CANARY_SIZE];
     size_t cipher_size = data_length;
     size_t encrypted_payload_size = cipher_size + KEY_SIZE;
     size_t rs_block_size = encrypted_payload_size / data_blocks;
     uint64_t key[4];
     uint64_t hash[4];
-    //uint64_t difference[4];
     cauchy_encoder_params params;
-    uint8_t *plaintext_buffer = NULL;
-    uint8_t *ciphertext_buffer = NULL;
     int i = 0;
-    int ret = 0;
-    
-    plaintext_buffer = kmalloc(encrypted_payload_size, GFP_KERNEL);
-    if(plaintext_buffer == NULL) return -1;
-    ciphertext_buffer = kmalloc(encrypted_payload_size, GFP_KERNEL);
-    if(ciphertext_buffer == NULL) return -1;
-    
-
-    //TODO Compute canary of the data block (small hash?)
-    //memset(canary, 0, CANARY_SIZE);
-    memcpy(plaintext_buffer, data, data_length);
-    //memcpy(&plaintext_buffer[data_length], canary, CANARY_SIZE);
 
     //generate key and IV
     get_random_bytes(key, sizeof(key)); 
 
-    speck_ctr((uint64_t*)plaintext_buffer, (uint64_t*)ciphertext_buffer, cipher_size, key, nonce);
-    //encrypt_payload(encode_buffer, cipher_size, key, KEY_SIZE, 1);
-
-    params.BlockBytes = rs_block_size;
-    params.OriginalCount = data_blocks;
-    params.RecoveryCount = parity_blocks;
-
-    sha3_256(ciphertext_buffer, cipher_size, (uint8_t*)hash);
+    // The plaintext is read once and the ciphertext goes straight into
+    // the data shares, there are no intermediate buffers.
+    aont_encrypt_shares(data, shares, cipher_size, rs_block_size, data_blocks, key, nonce, (uint8_t*)hash);
 
     for (i = 0; i < 4; i++) {
         ((uint64_t*)difference)[i] = key[i] ^ hash[i];
     }
+    aont_copy_difference(difference, shares, cipher_size, rs_block_size, data_blocks, true);
 
-    memcpy(&ciphertext_buffer[cipher_size], difference, KEY_SIZE);
+    params.BlockBytes = rs_block_size;
+    params.OriginalCount = data_blocks;
+    params.RecoveryCount = parity_blocks;
+    return cauchy_rs_encode(params, shares, &shares[data_blocks]);
+}
 
-    //TODO eliminate these memcpy operations, do everything in place
-    for (i = 0; i < data_blocks; i++) {
-        memcpy(shares[i], &ciphertext_buffer[rs_block_size * i], rs_block_size);
-    }
-    
-    cauchy_rs_encode(params, shares, &shares[data_blocks]);
-    
-    kfree(plaintext_buffer);
-    kfree(ciphertext_buffer);
-    return ret;
+int encode_aont_parity(uint8_t **shares, size_t data_length, size_t data_blocks, size_t parity_blocks){
+    cauchy_encoder_params params;
+
+    params.BlockBytes = (data_length + KEY_SIZE) / data_blocks;
+    params.OriginalCount = data_blocks;
+    params.RecoveryCount = parity_blocks;
+    return cauchy_rs_encode(params, shares, &shares[data_blocks]);
 }
 
-int decode_aont_package(uint8_t *difference, uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce, uint8_t *erasures, uint8_t num_erasures){
-    //uint8_t canary[CANARY_SIZE];
+int decode_aont_package(uint8_t *difference, uint8_t *data, size_t data_length, uint8_t **shares, size_t data_blocks, size_t parity_blocks, uint64_t *nonce, uint8_t *erasures, uint8_t *recovery, uint8_t num_erasures){
     size_t cipher_size = data_length;
     size_t encrypted_payload_size = cipher_size + KEY_SIZE;
     size_t rs_block_size = encrypted_payload_size / data_blocks;
     uint64_t key[4];
     uint64_t hash[4];
-    //uint64_t difference[4];
     cauchy_encoder_params params;
-    uint8_t *ciphertext_buffer = NULL;
-    uint8_t *plaintext_buffer = NULL;
     int ret = 0;
     int i = 0;
 
-    plaintext_buffer = kmalloc(encrypted_payload_size, GFP_KERNEL);
-    if(plaintext_buffer == NULL) return -1;
-    ciphertext_buffer = kmalloc(encrypted_payload_size, GFP_KERNEL);
-    if(ciphertext_buffer == NULL) return -1;
-
-    //memset(canary, 0, CANARY_SIZE);
-
     params.BlockBytes = rs_block_size;
     params.OriginalCount = data_blocks;
     params.RecoveryCount = parity_blocks;
 
-    ret = cauchy_rs_decode(params, shares, &shares[data_blocks], erasures, num_erasures);
+    ret = cauchy_rs_decode(params, shares, &shares[data_blocks], erasures, recovery, num_erasures);
 
-    for(i = 0; i < data_blocks; i++){
-        memcpy(&ciphertext_buffer[rs_block_size * i], shares[i], rs_block_size);
-    }
-
-    sha3_256(ciphertext_buffer, cipher_size, (uint8_t*)hash);
-
-    memcpy(difference, &ciphertext_buffer[cipher_size], KEY_SIZE);
+    // The ciphertext is hashed and decrypted where it sits in the shares.
+    aont_hash_shares(shares, cipher_size, rs_block_size, data_blocks, (uint8_t*)hash);
+    aont_copy_difference(difference, shares, cipher_size, rs_block_size, data_blocks, false);
 
     for(i = 0; i < 4; i++){
         key[i] = ((uint64_t*)difference)[i] ^ hash[i];
     }
 
-    speck_ctr((uint64_t*)ciphertext_buffer, (uint64_t*)plaintext_buffer, cipher_size, key, nonce);
-
-    //encrypt_payload(encode_buffer, cipher_size, key, KEY_SIZE, 0);
-    //if(memcmp(canary, &plaintext_buffer[data_length], CANARY_SIZE)){
-    //    return -1;
-    //}
-    memcpy(data, plaintext_buffer, data_length);
-
-    kfree(plaintext_buffer);
-    kfree(ciphertext_buffer);
+    aont_decrypt_shares(shares, data, cipher_size, rs_block_size, data_blocks, key, nonce);
     return ret;
 }
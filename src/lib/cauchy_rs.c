@@ -1903,6 +1903,7 @@ int cauchy_rs_decode(
     uint8_t** dataBlocks,
     uint8_t** parityBlocks,
     uint8_t* erasures,
+    uint8_t* recovery,
     uint8_t num_erasures)         // Array of 'originalCount' blocks as described above
 {
     CauchyDecoder *state = cauchy_malloc(sizeof(CauchyDecoder));
@@ -1925,8 +1926,9 @@ int cauchy_rs_decode(
     }
 
     for(i = 0; i < num_erasures; i++){
-        blocks[erasures[i]].Block = parityBlocks[i];
-        blocks[erasures[i]].Index = cauchy_get_recovery_block_index(params, i);
+        int parity = (recovery) ? recovery[i] : i;
+        blocks[erasures[i]].Block = parityBlocks[parity];
+        blocks[erasures[i]].Index = cauchy_get_recovery_block_index(params, parity);
     }
 
     if (Initialize(state, params, blocks)) {
@@ -1948,7 +1950,10 @@ int cauchy_rs_decode(
     Decode(state);
     for(i = 0; i < params.OriginalCount; ++i){
     //    print_hex_dump(KERN_DEBUG, "decoded: ", DUMP_PREFIX_OFFSET, 20, 1, (void*)blocks[i].Block, 16, true);
-        memcpy(dataBlocks[i], blocks[i].Block, params.BlockBytes);
+        // Callers may point an erased data block at its recovery block.
+        if (dataBlocks[i] != blocks[i].Block) {
+            memcpy(dataBlocks[i], blocks[i].Block, params.BlockBytes);
+        }
     }
 
 done:
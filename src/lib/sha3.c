@@ -1,6 +1,7 @@
 #include "lib/sha3.h"
 
 #define R 1088
+#define RATE_BYTES (R / 8)
 
 #define ROUNDS 24
 
@@ -69,49 +70,58 @@ static void keccak_f(uint64_t s[25])
     }
 }
 
-void sha3_256(uint8_t* message, uint64_t length, uint8_t* digest)
+void sha3_256_init(struct sha3_ctx *ctx)
 {
-    int64_t bit_len = length * 8 + 2; // length in bytes to length in bits (+2 pad min)
-    int64_t pad_len = ((-bit_len % R) + R) % R;
-    int64_t num_blocks = (bit_len + pad_len) / 64;
-    int64_t num_p = 0;
-    uint64_t* P = NULL;
-    uint64_t* d = NULL;
-    int i, j;
-
-    uint64_t* padded_message = sha_calloc(num_blocks, sizeof(uint64_t));
-    memcpy(padded_message, message, length);
-
-    // append 01
-    padded_message[length / 8] |= 0x2UL << ((length % 8) * 8);
-    // pad10*1
-    padded_message[bit_len / 64] |= 0x1UL << (bit_len % 64);
-    padded_message[(bit_len + pad_len - 1) / 64] |= 0x1UL << ((bit_len + pad_len - 1) % 64);
-
-    num_p = num_blocks / 17;
-    P = sha_calloc(num_p * 25, sizeof(uint64_t));
-
-    for (i = 0; i < num_p; i++)
-    {
-        memcpy(P + i * 25, padded_message + i * 17, 17 * 8);
-    }
-
-    sha_free(padded_message);
+    memset(ctx, 0, sizeof(*ctx));
+}
 
-    d = sha_calloc(25, sizeof(uint64_t));
+void sha3_256_update(struct sha3_ctx *ctx, const uint8_t *message, uint64_t length)
+{
+    uint8_t *state = (uint8_t *)ctx->s;
+    uint64_t word;
 
-    for (i = 0; i < num_p; i++)
+    while (length > 0)
     {
-        for (j = 0; j < 25; j++)
+        // Whole words are absorbed at once.
+        if (ctx->pos % 8 == 0 && length >= 8)
         {
-            d[j] ^= *(P + 25 * i + j);
+            memcpy(&word, message, 8);
+            ctx->s[ctx->pos / 8] ^= word;
+            ctx->pos += 8;
+            message += 8;
+            length -= 8;
+        }
+        else
+        {
+            state[ctx->pos++] ^= *message++;
+            length--;
         }
 
-        keccak_f(d);
+        if (ctx->pos == RATE_BYTES)
+        {
+            keccak_f(ctx->s);
+            ctx->pos = 0;
+        }
     }
+}
+
+void sha3_256_final(struct sha3_ctx *ctx, uint8_t *digest)
+{
+    uint8_t *state = (uint8_t *)ctx->s;
 
-    sha_free(P);
-    memcpy(digest, d, 32);
-    sha_free(d);
+    // SHA3 domain bits 01 followed by pad10*1.
+    state[ctx->pos] ^= 0x06;
+    state[RATE_BYTES - 1] ^= 0x80;
+    keccak_f(ctx->s);
+
+    memcpy(digest, ctx->s, 32);
 }
 
+void sha3_256(uint8_t* message, uint64_t length, uint8_t* digest)
+{
+    struct sha3_ctx ctx;
+
+    sha3_256_init(&ctx);
+    sha3_256_update(&ctx, message, length);
+    sha3_256_final(&ctx, digest);
+}
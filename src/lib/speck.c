@@ -57,21 +57,25 @@ void enc_round(uint64_t *in, uint64_t key)
     in[0] = rotate(right, 3) ^ (rotate(left, -8) + right) ^ key;
 }
 
-void speck_encrypt(uint64_t *in, uint64_t *out, uint64_t *key)
+static void speck_encrypt_schedule(uint64_t *in, uint64_t *out, uint64_t *keys)
 {
-    uint64_t *keys = speck_malloc(ROUNDS * sizeof(uint64_t));
     int i;
-    if(keys == NULL) return;
 
     out[0] = in[0];
     out[1] = in[1];
-    key_schedule(key, keys);
 
     for (i = 0; i < ROUNDS; i++)
     {
         enc_round(out, keys[i]);
     }
-    speck_free(keys);
+}
+
+void speck_encrypt(uint64_t *in, uint64_t *out, uint64_t *key)
+{
+    uint64_t keys[ROUNDS];
+
+    key_schedule(key, keys);
+    speck_encrypt_schedule(in, out, keys);
 }
 
 void dec_round(uint64_t *in, uint64_t key)
@@ -85,9 +89,8 @@ void dec_round(uint64_t *in, uint64_t key)
 
 void speck_decrypt(uint64_t *in, uint64_t *out, uint64_t *key)
 {
-    uint64_t *keys = speck_malloc(ROUNDS * sizeof(uint64_t));
+    uint64_t keys[ROUNDS];
     int i;
-    if(keys == NULL) return;
 
     out[0] = in[0];
     out[1] = in[1];
@@ -97,28 +100,59 @@ void speck_decrypt(uint64_t *in, uint64_t *out, uint64_t *key)
     {
         dec_round(out, keys[i]);
     }
-    speck_free(keys);
 }
 
-//The data has to be 64 bit aligned
-void speck_ctr(uint64_t *in, uint64_t *out, size_t pt_length, uint64_t *key, uint64_t *nonce)
+//Counter mode starting offset bytes into the key stream, so a buffer can
+//be processed in pieces. Neither the offset nor the length have to be a
+//multiple of the block size.
+void speck_ctr_offset(const uint8_t *in, uint8_t *out, size_t length, uint64_t *key, uint64_t *nonce, size_t offset)
 {
-    uint64_t* pad = speck_malloc(2 * sizeof(uint64_t));
-    uint64_t local_nonce[2] = {nonce[0], nonce[1]};
-    int i;
+    uint64_t keys[ROUNDS];
+    uint64_t counter[2] = {nonce[0], nonce[1]};
+    uint64_t pad[2];
+    uint64_t block[2];
+    size_t skip = offset % 16;
+    size_t n, i;
 
-    if(pad == NULL) return;
+    key_schedule(key, keys);
 
-    for (i = 0; i < pt_length/8; i+=2)
+    // Advance the counter to the block holding offset.
+    counter[0] += offset / 16;
+    if (counter[0] < nonce[0])
     {
-        speck_encrypt(local_nonce, pad, key);
+        counter[1]++;
+    }
 
+    while (length > 0)
+    {
+        speck_encrypt_schedule(counter, pad, keys);
 
-        out[i] = in[i] ^ pad[0];
-        out[i + 1] = in[i + 1] ^ pad[1];
+        n = (length < 16 - skip) ? length : 16 - skip;
+        if (n == 16)
+        {
+            memcpy(block, in, 16);
+            block[0] ^= pad[0];
+            block[1] ^= pad[1];
+            memcpy(out, block, 16);
+        }
+        else
+        {
+            for (i = 0; i < n; i++)
+            {
+                out[i] = in[i] ^ ((uint8_t *)pad)[skip + i];
+            }
+        }
 
-        add1(local_nonce, 2);
+        in += n;
+        out += n;
+        length -= n;
+        skip = 0;
+        add1(counter, 2);
     }
-    speck_free(pad);
 }
 
+//The data has to be 64 bit aligned
+void speck_ctr(uint64_t *in, uint64_t *out, size_t pt_length, uint64_t *key, uint64_t *nonce)
+{
+    speck_ctr_offset((const uint8_t *)in, (uint8_t *)out, pt_length, key, nonce, 0);
+}